@@ -22,100 +22,1189 @@
 
 #if defined(STACK_USE_MQTT_CLIENT)
 
-#include "MQTTclient.h"
 #include "typedefs.h"
 #include "TCPIP Stack/TCPIP.h"
+#include "MQTTclient.h"
+#include "TCPIP Stack/MQTTTrace.h"
 
  static bool RequestPending = 0;
- static byte PendingRequests = 0;
 
-#define REQ_TIMEOUT_CYCLES  100
+ // Request rings, one per priority lane: a single producer (main loop, one
+ // ISR or a thread) fills the slot at a lane's Tail, MQTTClientTask consumes
+ // from its Head.  The counters run free, each written by one side only, so
+ // no lock is needed
+
+ // Orders the slot accesses against the counter that hands the slot over
+ #ifndef MQTT_MEMORY_BARRIER
+ #if defined(__GNUC__)
+ #define MQTT_MEMORY_BARRIER() __sync_synchronize()
+ #else
+ #define MQTT_MEMORY_BARRIER()
+ #endif
+ #endif
+
+// Request timeouts follow the broker RTT (MQTTAckTimeout); name resolution
+// is not a broker round trip and keeps the stack's fixed allowance
+#define REQ_DNS_TIMEOUT  (6*TICK_SECOND)
+
+ static DWORD RequestDeadline = 0;
 
- static word RequestTimeoutCounter = 0;
- 
- static char DefaultUsername[20] = "";
- static char DefaultPassword[20] = "";
- static char DefaultDeviceId[20] = "";
+ static bool Pipelining = 0;
+ static bool Persistent = 0;
+ static byte ProtocolVersion = MQTTPROTOCOLVERSION;
+ static bool Compression = 0;
+ static bool Adaptive = 0;
+ static bool LinkFixed = 0;            // MqttSetLinkParams: batch, flush delay and window apply as set
+ static byte SessionRequests = 0;      // queued requests carried by the current session
 
  static BYTE ServerName[30] =	"";
  static byte ServerPasswd[30] = "";
 
- #define Mqtt_Request_DevId_Pos 0x00
- #define Mqtt_Request_DevId_Len 0x01
- #define Mqtt_Request_ServerAddr_Pos (Mqtt_Request_DevId_Pos+Mqtt_Request_DevId_Len)
- #define Mqtt_Request_ServerAddr_Len 0x01
- #define Mqtt_Request_TopicName_Pos (Mqtt_Request_ServerAddr_Pos+Mqtt_Request_ServerAddr_Len)
- #define Mqtt_Request_TopicName_Len 0x01
- #define Mqtt_Request_MsgBuff_Pos   (Mqtt_Request_TopicName_Pos+Mqtt_Request_TopicName_Len)
- #define Mqtt_Request_MsgBuff_Len   0x01
- #define Mqtt_Request_Username_Pos   (Mqtt_Request_MsgBuff_Pos+Mqtt_Request_MsgBuff_Len)
- #define Mqtt_Request_Username_Len   0x01
- #define Mqtt_Request_Password_Pos   (Mqtt_Request_Username_Pos+Mqtt_Request_Username_Len)
- #define Mqtt_Request_Password_Len   0x01
- #define Mqtt_Request_Size          (Mqtt_Request_Password_Pos+Mqtt_Request_Password_Len)
- #define Mqtt_Max_Client_Requests 10
-
- byte* MqttClientRequests[Mqtt_Max_Client_Requests][Mqtt_Request_Size];
- void (*MqttClientRequestCallbacks[Mqtt_Max_Client_Requests])();
+ // Lane sizes, powers of two: the ring counters wrap at 256
+ #ifndef Mqtt_Lane_Low_Size
+ #define Mqtt_Lane_Low_Size 4
+ #endif
+ #ifndef Mqtt_Lane_Normal_Size
+ #define Mqtt_Lane_Normal_Size 8
+ #endif
+ #ifndef Mqtt_Lane_High_Size
+ #define Mqtt_Lane_High_Size 4
+ #endif
+ #define Mqtt_Max_Client_Requests (Mqtt_Lane_Low_Size+Mqtt_Lane_Normal_Size+Mqtt_Lane_High_Size)
+
+ // Lane weights: sessions each lane may start per scheduling round
+ #ifndef Mqtt_Lane_Low_Weight
+ #define Mqtt_Lane_Low_Weight 1
+ #endif
+ #ifndef Mqtt_Lane_Normal_Weight
+ #define Mqtt_Lane_Normal_Weight 4
+ #endif
+ #ifndef Mqtt_Lane_High_Weight
+ #define Mqtt_Lane_High_Weight 16
+ #endif
+
+ // Connection profiles and topics, registered once and referenced by index
+ // from the queue.  Both tables are written by the producer side only; an
+ // entry is complete before the request using it is handed over.  Entries
+ // count the requests holding them (queued, in the retry area or a dead
+ // letter): one no request holds is reused, unless MqttAddProfile or
+ // MqttInternTopic handed its index to the application
+ #ifndef Mqtt_Max_Profiles
+ #define Mqtt_Max_Profiles 4
+ #endif
+ #ifndef Mqtt_Max_Topics
+ #define Mqtt_Max_Topics 16
+ #endif
+
+ typedef struct {
+    byte* Server;
+    WORD Port;
+    byte* ClientId;
+    byte* Username;
+    byte* Password;
+ } MQTT_PROFILE;
+
+ typedef struct {
+    byte Taken;             // producer side, at enqueue
+    volatile byte Released; // consumer side, once the request is gone
+    bool Pinned;            // index known to the application, never reused
+ } MQTT_REFS;
+
+ static MQTT_PROFILE MqttProfiles[Mqtt_Max_Profiles];
+ static MQTT_REFS ProfileRefs[Mqtt_Max_Profiles];
+ static byte ProfileCount = 0;
+ static byte* MqttTopics[Mqtt_Max_Topics];
+ static MQTT_REFS TopicRefs[Mqtt_Max_Topics];
+ static byte TopicCount = 0;
+
+ // Failover brokers, used by the profiles without a server of their own
+ #ifndef Mqtt_Max_Brokers
+ #define Mqtt_Max_Brokers 4
+ #endif
+ #define Mqtt_Broker_Rtt_Unknown TICK_SECOND       // ranks a broker never connected to
+ #define Mqtt_Broker_Hold_Down (MQTT_KEEPALIVE_LONG*TICK_SECOND)
+
+ typedef struct {
+    byte* Server;
+    WORD Port;
+    MQTT_BROKER_STATS Stats;
+    DWORD DownUntil;        // failed last time, skipped until then
+    MQTT_RTT Estimator;     // the stack's RTT estimator while another broker has it
+ } MQTT_BROKER;
+
+ static MQTT_BROKER MqttBrokers[Mqtt_Max_Brokers];
+ static byte BrokerCount = 0;
+ static byte SessionBroker = MQTT_NO_INDEX;
+ static DWORD ConnectStart;
+ static bool SessionConnected = 0;
+ static bool ConnAckWait = 0;          // pipelined: connected, the CONNACK still to be timed
+ static bool ConnectTimed = 0;         // the session's ConnectTime is a sample
+ static bool ConnAckSeen = 0;          // the broker took the CONNECT, a later failure keeps what was written
+ static byte* RttServer = NULL;        // server whose round trips the stack's estimator holds
+ static byte RttBroker = MQTT_NO_INDEX;
+
+ typedef struct {
+    byte* Msg;
+    MQTT_COMPLETION_CB Done;
+    DWORD Queued;           // TickGet() at enqueue
+    DWORD Tick;             // TickGet() once written/acked, then the end of the retry backoff
+    WORD Len;               // payload bytes, for the byte limit
+    byte Profile;           // MqttProfiles index
+    byte Topic;             // MqttTopics index
+    byte Attempts;
+ } MQTT_REQUEST;
+
+ MQTT_REQUEST MqttClientRequests[Mqtt_Max_Client_Requests];
+
+ typedef struct {
+    volatile byte Head;     // consumer side
+    volatile byte Tail;     // producer side
+    byte Base;              // the lane owns MqttClientRequests[Base..Base+Size-1]
+    byte Size;
+    byte Weight;
+    byte Credit;            // sessions left in this round
+    MQTT_LANE_STATS Stats;
+ } MQTT_LANE;
+
+ // Indexed by MQTT_PRIORITY_*
+ static MQTT_LANE MqttLanes[MQTT_LANES] = {
+    {0, 0, 0, Mqtt_Lane_Low_Size, Mqtt_Lane_Low_Weight, Mqtt_Lane_Low_Weight, {0, 0, 0, 0}},
+    {0, 0, Mqtt_Lane_Low_Size, Mqtt_Lane_Normal_Size, Mqtt_Lane_Normal_Weight, Mqtt_Lane_Normal_Weight, {0, 0, 0, 0}},
+    {0, 0, Mqtt_Lane_Low_Size+Mqtt_Lane_Normal_Size, Mqtt_Lane_High_Size, Mqtt_Lane_High_Weight, Mqtt_Lane_High_Weight, {0, 0, 0, 0}}
+ };
+
+ // Slot of row i of a lane, 0 being its oldest request
+ #define MqttLaneSlot(L,i) ((L)->Base + ((byte)((L)->Head+(i)) & ((L)->Size-1)))
+
+ static MQTT_LANE* SessionLane = NULL;     // lane of the current session, NULL from the retry area
+
+ // Completions of the last session, handed to the app together
+ static MQTT_COMPLETION MqttCompletions[Mqtt_Max_Client_Requests];
+ static void (*CompletionHandler)(const MQTT_COMPLETION *, byte) = NULL;
+ static byte SessionDone = 0;          // requests of the session written without error
+
+ // Payloads formatted here live in the buffer of their ring slot, so they
+ // stay valid until the request is dequeued
+ #define Mqtt_Msg_Size 160
+ static char MqttMsgBuffers[Mqtt_Max_Client_Requests][Mqtt_Msg_Size];
+
+ // Retry area, consumer side only: failed requests wait out their backoff
+ // here, served before the ring or, with RetryAtTail, once it is empty
+ #define Mqtt_Max_Retry_Requests 4
+ static MQTT_REQUEST MqttRetryRequests[Mqtt_Max_Retry_Requests];
+ static char MqttRetryBuffers[Mqtt_Max_Retry_Requests][Mqtt_Msg_Size];
+ static byte RetryOrder[Mqtt_Max_Retry_Requests];     // entries in the order they are served
+ static byte RetryCount = 0;
+
+ static byte RetryMaxAttempts = 1;     // 1 = no retry
+ static DWORD RetryBackoff = 0;        // ticks before the first retry, doubled for each next one
+ static bool RetryAtTail = 0;
+ static bool SessionFromRetry = 0;     // the current session is served from the retry area
+
+ // Dead letters: requests out of attempts, the oldest is overwritten
+ #define Mqtt_Max_Dead_Letters 4
+ static MQTT_REQUEST MqttDeadLetters[Mqtt_Max_Dead_Letters];
+ static char MqttDeadBuffers[Mqtt_Max_Dead_Letters][Mqtt_Msg_Size];
+ static byte DeadHead = 0;
+ static byte DeadCount = 0;
+
+ static MQTT_CLIENT_COUNTERS MqttCounters;
+
+ // Link adaptation: AIMD on the batch size and the TX window, the flush
+ // delay follows the RTT since every session pays for a connect
+ #define Mqtt_Link_Window_Min  64
+ #define Mqtt_Link_Window_Step 64
+ #define Mqtt_Link_Flush_Max   (2*TICK_SECOND)
+
+ static MQTT_LINK_PARAMS Link = {Mqtt_Max_Client_Requests, 0, 0xFFFF, 0, 100, 0xFFFF, 0};
+
+ // Admission: past QueueLimit requests or ByteLimit payload bytes, or once
+ // its lane is down to its last slot, the DropPolicy applies.  Drop-oldest/
+ // lowest admit the new request into the room left above QueueLimit, or
+ // into that last slot, and ask MQTTClientTask to shed one, so the ring
+ // keeps a single writer per side
+ static byte DropPolicy = MQTT_DROP_NEWEST;
+ static byte QueueLimit = Mqtt_Max_Client_Requests;
+ static WORD ByteLimit = 0;            // 0 = no limit
+ static volatile DWORD BytesIn = 0;    // producer side
+ static volatile DWORD BytesOut = 0;   // consumer side
+ static volatile byte ShedWanted = 0;  // producer side
+ static byte ShedDone = 0;             // consumer side
+
+ static byte WatermarkHigh = 0;        // 0 = no watermarks
+ static byte WatermarkLow = 0;
+ static bool AboveHigh = 0;
+ static void (*WatermarkHandler)(bool) = NULL;
+
+ // Aggregated variables: min/max/mean/count over tumbling windows
+ #define Mqtt_Max_Aggregated_Vars 8
+
+ typedef struct {
+    byte* Name;
+    DWORD Window;           // ticks, 0 = free entry
+    DWORD Start;            // TickGet() of the first sample of the window
+    double Min, Max, Sum;
+    word Count;
+    double Low, High;       // samples outside [Low,High] are also sent raw, Low > High: never
+ } MQTT_AGGREGATE;
+
+ static MQTT_AGGREGATE MqttAggregates[Mqtt_Max_Aggregated_Vars];
+
+ // Report by exception: last value sent of each filtered variable
+ #define Mqtt_Max_Deadband_Vars 16
+
+ typedef struct {
+    byte* Name;             // NULL = free entry
+    float Last;
+    float Abs, Pct;         // a change beyond either band is sent, both 0: any change
+    DWORD LastTick;         // TickGet() of the last send
+    DWORD MaxSilence;       // ticks, sent anyway after this long; 0 = never
+    bool Valid;             // Last holds a value
+ } MQTT_DEADBAND;
+
+ static MQTT_DEADBAND MqttDeadbands[Mqtt_Max_Deadband_Vars];
+
+ static enum	{
+		MQTT_HOME = 0,
+		MQTT_BEGIN,
+		MQTT_CONNECT,
+		MQTT_CONNECT_WAIT,
+		MQTT_PUBLISH,
+		MQTT_PUBLISH_WAIT,
+		MQTT_FINISHING,
+		MQTT_DONE
+		} MQTTState = MQTT_HOME;
+
+#if MQTT_TRACE_SIZE
+ static byte TraceState = MQTT_HOME;   // MQTTState last traced
+ static bool TraceDumping = 0;         // MqttPublishTrace is part way through a dump
+#endif
+
+static void MqttArmTimeout(DWORD Ticks){
+    RequestDeadline = TickGet() + Ticks;
+}
+
+static bool MqttTimedOut(){
+    return (LONG)(TickGet() - RequestDeadline) > 0;
+}
 
 void MqttSendTestPacket(){
     RequestPending = 1;
 }
 
 void MqttSetDefaultCred(byte* Username, byte* Password, byte* DeviceId){
+    (void)Username;
+    (void)Password;
+    (void)DeviceId;
+}
+
+// Requests queued in a lane; the barrier makes the slots counted visible to the caller
+static byte MqttLanePending(MQTT_LANE* L){
+    byte n = (byte)(L->Tail - L->Head);
+    MQTT_MEMORY_BARRIER();
+    return n;
+}
+
+// Requests queued in all lanes
+static byte MqttPendingRequests(){
+    byte l, n = 0;
+
+    for (l = 0; l < MQTT_LANES; l++)
+        n += MqttLanePending(&MqttLanes[l]);
+    return n;
+}
+
+// Payload bytes queued in the ring
+static DWORD MqttQueuedBytes(){
+    return BytesIn - BytesOut;
+}
+
+/***********    Producer side: safe from an ISR as long as only one context enqueues    ************/
+static MQTT_QUEUE_STATUS MqttEnqueue(byte Profile, byte Topic, byte* Msg, MQTT_COMPLETION_CB Done, byte Priority){
+    MQTT_LANE* L = &MqttLanes[Priority < MQTT_LANES ? Priority : MQTT_LANES-1];
+    byte n = MqttPendingRequests();
+    WORD Len = Msg ? strlen((const char*)Msg) : 0;
+    byte Depth = MqttLanePending(L);
+    MQTT_QUEUE_STATUS Status = MQTT_QUEUE_OK;
+    MQTT_REQUEST* Req;
+
+    if (Profile >= ProfileCount || Topic >= TopicCount){
+        MqttCounters.Rejected++;
+        return MQTT_QUEUE_NO_INDEX;
+    }
+    if (Depth >= L->Size){
+        MqttCounters.Rejected++;
+        return MQTT_QUEUE_FULL;
+    }
+    if (n >= QueueLimit || (ByteLimit && MqttQueuedBytes() + Len > ByteLimit)
+        || (DropPolicy != MQTT_DROP_NEWEST && Depth >= L->Size-1)){
+        if (DropPolicy == MQTT_DROP_NEWEST || (ByteLimit && Len > ByteLimit)){
+            MqttCounters.Rejected++;
+            return MQTT_QUEUE_FULL;
+        }
+        ShedWanted++;
+        Status = MQTT_QUEUE_DROPPED;
+    }
+    Req = &MqttClientRequests[L->Base + (L->Tail & (L->Size-1))];
+    Req->Done = Done;
+    Req->Queued = TickGet();
+    Req->Len = Len;
+    Req->Attempts = 0;
+    Req->Profile = Profile;
+    Req->Topic = Topic;
+    Req->Msg = Msg;
+    ProfileRefs[Profile].Taken++;
+    TopicRefs[Topic].Taken++;
+    BytesIn += Len;
+    MQTT_MEMORY_BARRIER();      // the whole slot, and the table entries it uses, before the consumer sees it
+    L->Tail++;
+    if (Status == MQTT_QUEUE_OK && WatermarkHigh && n+1 >= WatermarkHigh)
+        Status = MQTT_QUEUE_HIGH;
+    return Status;
+}
+
+static bool MqttSameString(byte* a, byte* b){
+    return a == b || (a && b && !strcmp((const char*)a, (const char*)b));
+}
+
+// Table entry no request holds and the application does not know of
+static bool MqttRefsFree(MQTT_REFS* R){
+    return !R->Pinned && R->Taken == R->Released;
+}
+
+// A matching entry, else a new one, else a free one reused; Pin keeps it
+static byte MqttProfileIndex(byte* Server, WORD Port, byte* ClientId, byte* Username, byte* Password, bool Pin){
+    MQTT_PROFILE* P;
+    byte i;
+
+    for (i = 0; i < ProfileCount; i++){
+        P = &MqttProfiles[i];
+        if (P->Port == Port && MqttSameString(P->Server, Server) && MqttSameString(P->ClientId, ClientId)
+            && MqttSameString(P->Username, Username) && MqttSameString(P->Password, Password))
+            break;
+    }
+    if (i == ProfileCount){
+        if (ProfileCount < Mqtt_Max_Profiles)
+            ProfileCount++;
+        else{
+            for (i = 0; i < ProfileCount && !MqttRefsFree(&ProfileRefs[i]); i++)
+                ;
+            if (i == ProfileCount)
+                return MQTT_NO_INDEX;
+        }
+        P = &MqttProfiles[i];
+        P->Server = Server;
+        P->Port = Port;
+        P->ClientId = ClientId;
+        P->Username = Username;
+        P->Password = Password;
+    }
+    if (Pin)
+        ProfileRefs[i].Pinned = 1;
+    return i;
+}
+
+static byte MqttTopicIndex(byte* Topic, bool Pin){
+    byte i;
+
+    for (i = 0; i < TopicCount; i++)
+        if (MqttSameString(MqttTopics[i], Topic))
+            break;
+    if (i == TopicCount){
+        if (TopicCount < Mqtt_Max_Topics)
+            TopicCount++;
+        else{
+            for (i = 0; i < TopicCount && !MqttRefsFree(&TopicRefs[i]); i++)
+                ;
+            if (i == TopicCount)
+                return MQTT_NO_INDEX;
+        }
+        MqttTopics[i] = Topic;
+    }
+    if (Pin)
+        TopicRefs[i].Pinned = 1;
+    return i;
+}
+
+/***********    Profile index for a connection, registered on first use; MQTT_NO_INDEX once the table is full    ************/
+// The strings are referenced, not copied, and must stay valid.  The index
+// stays valid as well, the entry is never reused
+byte MqttAddProfile(byte* Server, WORD Port, byte* ClientId, byte* Username, byte* Password){
+    return MqttProfileIndex(Server, Port, ClientId, Username, Password, 1);
+}
+
+/***********    Topic index, interned on first use; MQTT_NO_INDEX once the table is full    ************/
+byte MqttInternTopic(byte* Topic){
+    return MqttTopicIndex(Topic, 1);
+}
 
+static MQTT_QUEUE_STATUS MqttEnqueueStrings(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr, MQTT_COMPLETION_CB Done, byte Priority){
+    return MqttEnqueue(MqttProfileIndex(serverAddr, 1883, Id, Username, Password, 0), MqttTopicIndex(Topic, 0), Msg, Done, Priority);
+}
+
+/***********    Compact form: Profile from MqttAddProfile, Topic from MqttInternTopic    ************/
+MQTT_QUEUE_STATUS MqttQueueMsgForProfile(byte Profile, byte Topic, byte* Msg, byte Priority, MQTT_COMPLETION_CB Done){
+    return MqttEnqueue(Profile, Topic, Msg, Done, Priority);
 }
 
 /***********    Send message without credentials    ************/
-void MqttQueueMsg(byte* Msg, byte* Topic, byte* Id, byte* serverAddr){
-    if (PendingRequests < Mqtt_Max_Client_Requests){
-        MqttClientRequests[PendingRequests][Mqtt_Request_DevId_Pos] = Id;
-        MqttClientRequests[PendingRequests][Mqtt_Request_ServerAddr_Pos] = serverAddr;
-        MqttClientRequests[PendingRequests][Mqtt_Request_TopicName_Pos] = Topic;
-        MqttClientRequests[PendingRequests][Mqtt_Request_MsgBuff_Pos] = Msg;
-        PendingRequests++;
+MQTT_QUEUE_STATUS MqttQueueMsg(byte* Msg, byte* Topic, byte* Id, byte* serverAddr){
+    return MqttEnqueueStrings(Msg, Topic, Id, NULL, NULL, serverAddr, NULL, MQTT_PRIORITY_NORMAL);
+}
+
+MQTT_QUEUE_STATUS MqttQueueMsgWithCred(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr){
+    return MqttEnqueueStrings(Msg, Topic, Id, Username, Password, serverAddr, NULL, MQTT_PRIORITY_NORMAL);
+}
+
+/***********    Done is called from MQTTClientTask once the request is sent or given up    ************/
+MQTT_QUEUE_STATUS MqttQueueMsgWithCallback(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr, MQTT_COMPLETION_CB Done){
+    return MqttEnqueueStrings(Msg, Topic, Id, Username, Password, serverAddr, Done, MQTT_PRIORITY_NORMAL);
+}
+
+/***********    Priority: the MQTT_PRIORITY_* lane; higher lanes are served first, within their weights    ************/
+MQTT_QUEUE_STATUS MqttQueueMsgWithPriority(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr, byte Priority){
+    return MqttEnqueueStrings(Msg, Topic, Id, Username, Password, serverAddr, NULL, Priority);
+}
+
+/***********    Queue time per lane, sampled when a request is picked for sending    ************/
+const MQTT_LANE_STATS* MqttGetLaneStats(byte Lane){
+    MQTT_LANE* L = &MqttLanes[Lane < MQTT_LANES ? Lane : MQTT_LANES-1];
+
+    L->Stats.Depth = MqttLanePending(L);
+    return &L->Stats;
+}
+
+/***********    TRUE if a request with a payload of Bytes would be queued without dropping anything    ************/
+bool MqttCanQueue(WORD Bytes){
+    return MqttPendingRequests() < QueueLimit && (!ByteLimit || MqttQueuedBytes() + Bytes <= ByteLimit);
+}
+
+/***********    Admission: MaxRequests (0 = all slots) and MaxBytes (0 = no limit) before Policy applies    ************/
+// Drop-oldest/lowest keep the last slot of each lane, and the slots above
+// MaxRequests, for new requests until MQTTClientTask sheds the victims: a
+// lane that fills up loses its own oldest request, the lowest priority in
+// it, since only that makes room in the lane; past MaxRequests or MaxBytes
+// the oldest of all lanes, or of the lowest lane in use, goes
+void MqttSetQueuePolicy(byte Policy, byte MaxRequests, WORD MaxBytes){
+    DropPolicy = Policy;
+    QueueLimit = MaxRequests && MaxRequests < Mqtt_Max_Client_Requests ? MaxRequests : Mqtt_Max_Client_Requests;
+    ByteLimit = MaxBytes;
+}
+
+/***********    Watermarks: Handler(1) once High requests are queued, Handler(0) once back to Low    ************/
+void MqttSetWatermarks(byte High, byte Low, void (*Handler)(bool Above)){
+    WatermarkHigh = High;
+    WatermarkLow = Low;
+    WatermarkHandler = Handler;
+    AboveHigh = 0;
+}
+
+/***********    Consumer side: MQTTClientTask only    ************/
+// Highest lane with requests and credit left; a new round starts once the
+// waiting lanes are out of credit, so a flood only delays the lower lanes
+static MQTT_LANE* MqttPickLane(){
+    MQTT_LANE* L;
+    byte l, round;
+
+    for (round = 0; round < 2; round++){
+        for (l = MQTT_LANES; l-- > 0; ){
+            L = &MqttLanes[l];
+            if (L->Credit > 0 && MqttLanePending(L) > 0)
+                return L;
+        }
+        for (l = 0; l < MQTT_LANES; l++)
+            MqttLanes[l].Credit = MqttLanes[l].Weight;
     }
+    return NULL;
 }
 
-void MqttQueueMsgWithCred(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr){
-    if (PendingRequests < Mqtt_Max_Client_Requests){
-    MqttQueueMsg(Msg, Topic, Id, serverAddr);
-    SetCredForRequest( Username, Password, PendingRequests-1);
+// Next request to send, NULL if none is due: a retry whose backoff is over
+// goes first, or only once the lanes are empty with RetryAtTail, and is
+// moved to the front of RetryOrder; retries still waiting block no lane.
+// *Lane is NULL for a retry
+static MQTT_REQUEST* MqttNextRequest(MQTT_LANE** Lane){
+    byte i, e;
+
+    *Lane = NULL;
+    if (RetryCount > 0 && (!RetryAtTail || MqttPendingRequests() == 0)){
+        for (i = 0; i < RetryCount; i++)
+            if ((LONG)(TickGet() - MqttRetryRequests[RetryOrder[i]].Tick) >= 0)
+                break;
+        if (i < RetryCount){
+            e = RetryOrder[i];
+            memmove(RetryOrder+1, RetryOrder, i);
+            RetryOrder[0] = e;
+            return &MqttRetryRequests[e];
+        }
     }
+    *Lane = MqttPickLane();
+    return *Lane ? &MqttClientRequests[MqttLaneSlot(*Lane, 0)] : NULL;
+}
+
+// Books the queue time of a request picked for sending
+static void MqttLaneWait(MQTT_LANE* L, MQTT_REQUEST* Req){
+    DWORD Wait = TickGet() - Req->Queued;
+
+    L->Stats.Served++;
+    L->Stats.WaitSum += Wait;
+    if (Wait > L->Stats.WaitMax)
+        L->Stats.WaitMax = Wait;
+}
+
+// Request i of the current session; a session is served from one place only
+static MQTT_REQUEST* MqttSessionRow(byte i){
+    return SessionFromRetry ? &MqttRetryRequests[RetryOrder[i]] : &MqttClientRequests[MqttLaneSlot(SessionLane, i)];
+}
+
+static byte MqttSessionAvailable(){
+    return SessionFromRetry ? RetryCount : MqttLanePending(SessionLane);
 }
 
 void MqttDequeueCurrentRequest(){
-    byte reqinc = 0;
-    for (reqinc =0; reqinc <PendingRequests-1; reqinc++){
-        memcpy(&MqttClientRequests[reqinc],&MqttClientRequests[reqinc+1],Mqtt_Request_Size*4);
+    if (SessionFromRetry){
+        memmove(RetryOrder, RetryOrder+1, --RetryCount);
+    }
+    else{
+        BytesOut += MqttClientRequests[MqttLaneSlot(SessionLane, 0)].Len;
+        memset(&MqttClientRequests[MqttLaneSlot(SessionLane, 0)],0x00,sizeof(MqttClientRequests[0]));
+        MQTT_MEMORY_BARRIER();      // done with the slot before the producer may reuse it
+        SessionLane->Head++;
     }
-    memset(&MqttClientRequests[PendingRequests-1],0x00,Mqtt_Request_Size*4); //clear last
     RequestPending = 0;
-    PendingRequests--;
 }
 
-void SetCredForRequest(byte* Username, byte* Password, word ReqId){
-    MqttClientRequests[ReqId][Mqtt_Request_Username_Pos] = Username;
-    MqttClientRequests[ReqId][Mqtt_Request_Password_Pos] = Password;
+// Copies a request, and its payload if it lives in a buffer of ours that is about to be reused
+static void MqttCopyRequest(MQTT_REQUEST* Dst, MQTT_REQUEST* Src, char* Buf){
+    char* Msg = (char*)Src->Msg;
+
+    *Dst = *Src;
+    if ((Msg >= MqttMsgBuffers[0] && Msg < MqttMsgBuffers[Mqtt_Max_Client_Requests])
+        || (Msg >= MqttRetryBuffers[0] && Msg < MqttRetryBuffers[Mqtt_Max_Retry_Requests])){
+        strncpy(Buf, Msg, Mqtt_Msg_Size-1);
+        Buf[Mqtt_Msg_Size-1] = 0;
+        Dst->Msg = (byte*)Buf;
+    }
+}
+
+// The request is gone for good: its table entries may be reused
+static void MqttReleaseRefs(MQTT_REQUEST* Req){
+    MQTT_MEMORY_BARRIER();      // done with the entries before the producer sees them free
+    ProfileRefs[Req->Profile].Released++;
+    TopicRefs[Req->Topic].Released++;
+}
+
+// Removes the oldest request of a lane, reporting it as dropped
+static void MqttShedHead(MQTT_LANE* L){
+    MQTT_REQUEST* Req = &MqttClientRequests[MqttLaneSlot(L, 0)];
+    MQTT_COMPLETION c;
+
+    c.Msg = Req->Msg;
+    c.Topic = MqttTopics[Req->Topic];
+    c.Result = MQTT_REQUEST_DROPPED;
+    c.Attempts = Req->Attempts;
+    c.Latency = TickGet() - Req->Queued;
+    if (Req->Done)
+        Req->Done(&c);
+    MqttCounters.Dropped++;
+    MqttReleaseRefs(Req);
+    BytesOut += Req->Len;
+    memset(Req,0x00,sizeof(MqttClientRequests[0]));
+    MQTT_MEMORY_BARRIER();
+    L->Head++;
+}
+
+// Sheds what the producer asked for, between sessions only: the oldest
+// request of a lane that took its last slot, then, over the limits, the
+// oldest of all lanes or the oldest of the lowest lane in use
+static void MqttShed(){
+    byte Wanted = ShedWanted;
+    MQTT_LANE* L;
+    MQTT_LANE* Victim;
+    byte l;
+
+    if (Wanted == ShedDone)
+        return;
+    for (l = 0; l < MQTT_LANES; l++)
+        if (MqttLanePending(&MqttLanes[l]) >= MqttLanes[l].Size)
+            MqttShedHead(&MqttLanes[l]);
+    while (MqttPendingRequests() > QueueLimit || (ByteLimit && MqttQueuedBytes() > ByteLimit)){
+        Victim = NULL;
+        for (l = 0; l < MQTT_LANES; l++){
+            L = &MqttLanes[l];
+            if (MqttLanePending(L) == 0)
+                continue;
+            if (!Victim || (LONG)(MqttClientRequests[MqttLaneSlot(L, 0)].Queued
+                    - MqttClientRequests[MqttLaneSlot(Victim, 0)].Queued) < 0)
+                Victim = L;
+            if (DropPolicy == MQTT_DROP_LOWEST)
+                break;
+        }
+        if (!Victim)
+            break;
+        MqttShedHead(Victim);
+    }
+    ShedDone = Wanted;
+}
+
+static void MqttWatermarkPoll(){
+    byte n;
+
+    if (!WatermarkHigh || !WatermarkHandler)
+        return;
+    n = MqttPendingRequests();
+    if (!AboveHigh && n >= WatermarkHigh){
+        AboveHigh = 1;
+        WatermarkHandler(1);
+    }
+    else if (AboveHigh && n <= WatermarkLow){
+        AboveHigh = 0;
+        WatermarkHandler(0);
+    }
+}
+
+/***********    Retry: MaxAttempts sessions per request, Backoff ticks doubled each time; AtTail serves retries after the ring    ************/
+void MqttSetRetryPolicy(byte MaxAttempts, DWORD Backoff, bool AtTail){
+    RetryMaxAttempts = MaxAttempts ? MaxAttempts : 1;
+    RetryBackoff = Backoff;
+    RetryAtTail = AtTail;
+}
+
+const MQTT_CLIENT_COUNTERS* MqttGetCounters(){
+    return &MqttCounters;
+}
+
+// Moves the first request of the session to the back of the retry area;
+// 0 if the area is full, the request then fails for good
+static bool MqttRetry(MQTT_REQUEST* Req){
+    byte e, used, k;
+
+    k = Req->Attempts > 0 ? Req->Attempts-1 : 0;
+    Req->Tick = TickGet() + (RetryBackoff << (k < 8 ? k : 8));
+    if (SessionFromRetry){
+        e = RetryOrder[0];
+        memmove(RetryOrder, RetryOrder+1, RetryCount-1);
+        RetryOrder[RetryCount-1] = e;
+        return 1;
+    }
+    if (RetryCount >= Mqtt_Max_Retry_Requests)
+        return 0;
+    for (e = 0; e < Mqtt_Max_Retry_Requests; e++){
+        for (used = 0; used < RetryCount && RetryOrder[used] != e; used++)
+            ;
+        if (used == RetryCount)
+            break;
+    }
+    MqttCopyRequest(&MqttRetryRequests[e], Req, MqttRetryBuffers[e]);
+    RetryOrder[RetryCount++] = e;
+    MqttDequeueCurrentRequest();
+    return 1;
+}
+
+static void MqttDeadLetter(MQTT_REQUEST* Req){
+    byte e = (DeadHead + DeadCount) % Mqtt_Max_Dead_Letters;
+
+    if (DeadCount == Mqtt_Max_Dead_Letters){
+        MqttReleaseRefs(&MqttDeadLetters[DeadHead]);
+        DeadHead = (DeadHead + 1) % Mqtt_Max_Dead_Letters;
+        MqttCounters.DeadDropped++;
+    }
+    else
+        DeadCount++;
+    MqttCopyRequest(&MqttDeadLetters[e], Req, MqttDeadBuffers[e]);
+}
+
+// Oldest dead letter, 0 if there is none.  Msg and Topic stay valid until
+// MQTTClientTask runs again
+bool MqttTakeDeadLetter(byte** Msg, byte** Topic){
+    if (DeadCount == 0)
+        return 0;
+    *Msg = MqttDeadLetters[DeadHead].Msg;
+    *Topic = MqttTopics[MqttDeadLetters[DeadHead].Topic];
+    MqttReleaseRefs(&MqttDeadLetters[DeadHead]);
+    DeadHead = (DeadHead + 1) % Mqtt_Max_Dead_Letters;
+    DeadCount--;
+    return 1;
+}
+
+/***********    Completions: Handler gets each session's completions in one call, after the per-request callbacks    ************/
+void MqttSetCompletionHandler(void (*Handler)(const MQTT_COMPLETION *, byte)){
+    CompletionHandler = Handler;
+}
+
+// Takes the requests of the session that just ended off the queue: those
+// with attempts left go to the retry area, the others are reported
+static void MqttCompleteSession(){
+    WORD Failure = MQTTResponseCode != MQTT_SUCCESS ? MQTTResponseCode : MQTT_OPERATION_FAILED;
+    MQTT_COMPLETION* c;
+    MQTT_REQUEST* Req;
+    byte i, n = 0;
+    bool ok;
+
+    for (i = 0; i < SessionRequests && MqttSessionAvailable() > 0; i++){
+        Req = MqttSessionRow(0);
+        // what was written before a failure stands, unless the CONNACK refused
+        // the session or never came: then the broker dropped all of it
+        ok = i < SessionDone && (MQTTResponseCode == MQTT_SUCCESS || ConnAckSeen);
+        if (!ok && Req->Attempts < RetryMaxAttempts && MqttRetry(Req)){
+            MqttCounters.Retried++;
+            continue;
+        }
+        c = &MqttCompletions[n++];
+        c->Msg = Req->Msg;
+        c->Topic = MqttTopics[Req->Topic];
+        c->Result = ok ? MQTT_SUCCESS : Failure;
+        c->Latency = (ok ? Req->Tick : TickGet()) - Req->Queued;
+        c->Attempts = Req->Attempts;
+        if (ok)
+            MqttCounters.Delivered++;
+        else{
+            MqttCounters.Failed++;
+            MqttDeadLetter(Req);
+        }
+        if (Req->Done)
+            Req->Done(c);
+        if (ok)
+            MqttReleaseRefs(Req);       // a failed one holds them on as a dead letter
+        MqttDequeueCurrentRequest();
+    }
+    if (CompletionHandler && n > 0)
+        CompletionHandler(MqttCompletions, n);
+}
+
+/***********    Pipelining: CONNECT and every queued publish for the same session in one flight    ************/
+void MqttSetPipelining(bool Enable){
+    Pipelining = Enable;
+}
+
+/***********    Persistent session: the broker keeps subscriptions and QOS1 messages across reconnects    ************/
+void MqttSetPersistentSession(bool Enable){
+    Persistent = Enable;
+}
+
+/***********    Protocol level: MQTT_VERSION_5 sends the long IBM topics once, then as a topic alias    ************/
+void MqttSetProtocolVersion(byte Ver){
+    ProtocolVersion = Ver;
+}
+
+/***********    Adaptive link: batch size, flush delay and TX window follow the measured link, see MqttGetLinkParams    ************/
+void MqttSetAdaptive(bool Enable){
+    Adaptive = Enable;
+}
+
+// Link parameters to keep, or with MqttSetAdaptive the ones to start from
+void MqttSetLinkParams(byte BatchMax, DWORD FlushDelay, WORD Window){
+    Link.BatchMax = BatchMax ? BatchMax : 1;
+    Link.FlushDelay = FlushDelay;
+    Link.Window = Window;
+    LinkFixed = 1;
+}
+
+const MQTT_LINK_PARAMS* MqttGetLinkParams(){
+    return &Link;
+}
+
+// TX FIFO bytes the broker has not acknowledged yet
+static WORD MqttLinkInFlight(){
+    WORD Free = MQTTTxFree();
+
+    return Link.TxSize > Free ? Link.TxSize - Free : 0;
+}
+
+// Follows the TX FIFO during a session: its size, and how full it got
+static void MqttLinkSample(){
+    WORD Free = MQTTTxFree();
+
+    if (Free > Link.TxSize)
+        Link.TxSize = Free;
+    if (Free < Link.TxFree)
+        Link.TxFree = Free;
+}
+
+// Adjusts the parameters once a session of Total requests delivered Sent:
+// a loss or a FIFO that hardly drained halves batch and window, a clean
+// session grows them by a step
+static void MqttLinkAdapt(byte Sent, byte Total){
+    DWORD Flush;
+
+    if (Total == 0)
+        return;
+    Link.AckRate = Link.AckRate - Link.AckRate/8 + (100*Sent/Total)/8;
+    Link.Rtt = MQTTSmoothedRtt();
+    if (Link.Window > Link.TxSize && Link.TxSize)
+        Link.Window = Link.TxSize;
+    if (Sent < Total || Link.TxFree < Link.TxSize/4){
+        Link.BatchMax = Link.BatchMax > 1 ? Link.BatchMax/2 : 1;
+        Link.Window = Link.Window/2 > Mqtt_Link_Window_Min ? Link.Window/2 : Mqtt_Link_Window_Min;
+    }
+    else{
+        if (Link.BatchMax < Mqtt_Max_Client_Requests)
+            Link.BatchMax++;
+        if (Link.TxSize && Link.Window < Link.TxSize)
+            Link.Window = Link.TxSize - Link.Window > Mqtt_Link_Window_Step ? Link.Window + Mqtt_Link_Window_Step : Link.TxSize;
+    }
+    // waiting up to 2 RTT for company is cheaper than another connect
+    Flush = Link.AckRate >= 50 ? 2*Link.Rtt : 0;
+    Link.FlushDelay = Flush < Mqtt_Link_Flush_Max ? Flush : Mqtt_Link_Flush_Max;
+    Link.TxFree = 0xFFFF;
+}
+
+/***********    Compression: repetitive payloads go out LZ compressed, see MQTTPublishCompressed    ************/
+void MqttSetCompression(bool Enable){
+    Compression = Enable;
+}
+
+// A refused CONNACK voids the whole batch: until it is in, the session
+// writes no more than the retry area takes back, the rest waits for it
+static bool MqttConnAckHold(byte ReqId){
+    return !SessionFromRetry && RetryMaxAttempts > 1 && MQTTConnAckPending()
+        && ReqId + RetryCount >= Mqtt_Max_Retry_Requests;
+}
+
+static bool MqttSameSession(byte ReqId){
+    MQTT_REQUEST* Req;
+    MQTT_REQUEST* First = MqttSessionRow(0);
+    byte l;
+
+    if (ReqId >= MqttSessionAvailable())
+        return 0;
+    Req = MqttSessionRow(ReqId);
+    if (SessionFromRetry && (LONG)(TickGet() - Req->Tick) < 0)
+        return 0;
+    // end the session when a higher lane is waiting, so it is scheduled next
+    for (l = SessionFromRetry ? MQTT_LANES : SessionLane - MqttLanes + 1; l < MQTT_LANES; l++)
+        if (MqttLanePending(&MqttLanes[l]) > 0)
+            return 0;
+    return Req->Profile == First->Profile;
+}
+
+
+// Payload buffer of the next request to be queued in a lane, NULL if the lane is full
+static char* MqttSlotBuffer(byte Lane){
+    MQTT_LANE* L = &MqttLanes[Lane];
+
+    if (MqttLanePending(L) >= L->Size)
+        return NULL;
+    return MqttMsgBuffers[L->Base + (L->Tail & (L->Size-1))];
+}
+
+static MQTT_QUEUE_STATUS MqttQueueIbmMsg(char* msgBF){
+    return MqttQueueMsgWithCred((byte*)msgBF,(byte*)"<topic>",(byte*)"<serverid>:<device>",(byte*)"use-token-auth",(byte*)"<key>",(byte*)"<serveraddr");
+}
+
+/***********    Link metrics: the chosen parameters as a LOW priority publish    ************/
+void MqttPublishLinkMetrics(){
+    char* msgBF = MqttSlotBuffer(MQTT_PRIORITY_LOW);
+
+    if (msgBF){
+        GetAsJSONLink(msgBF, Link.BatchMax, Link.FlushDelay/(TICK_SECOND/1000), Link.Window,
+            Link.Rtt/(TICK_SECOND/1000), Link.AckRate);
+        MqttQueueMsgWithPriority((byte*)msgBF,(byte*)"<topic>",(byte*)"<serverid>:<device>",(byte*)"use-token-auth",(byte*)"<key>",(byte*)"<serveraddr",MQTT_PRIORITY_LOW);
+    }
+}
+
+#if MQTT_TRACE_SIZE
+/***********    Trace upload: the event recorder as hex, in LOW priority publishes    ************/
+// Queues as much of the dump as the LOW lane has room for and picks up
+// where it left off on the next call; returns 1 once the whole dump is queued.
+// A piece the queue refused is kept and goes first next time, so the dump
+// has no holes.  Chunks concatenate to the MQTTTraceReadDump stream
+// (tools/mqtttrace2json)
+bool MqttPublishTrace(){
+    static const char Hex[] = "0123456789ABCDEF";
+    static BYTE Raw[(Mqtt_Msg_Size-1)/2];
+    static WORD n = 0;          // bytes of Raw read from the dump, not queued yet
+    char* msgBF;
+    WORD i;
+
+    if (!TraceDumping){
+        MQTTTraceBeginDump();
+        TraceDumping = 1;
+        n = 0;
+    }
+    while ((msgBF = MqttSlotBuffer(MQTT_PRIORITY_LOW)) != NULL){
+        if (!n)
+            n = MQTTTraceReadDump(Raw, sizeof(Raw));
+        if (!n){
+            TraceDumping = 0;
+            return 1;
+        }
+        for (i = 0; i < n; i++){
+            msgBF[2*i] = Hex[Raw[i] >> 4];
+            msgBF[2*i+1] = Hex[Raw[i] & 0x0F];
+        }
+        msgBF[2*n] = 0;
+        if (MqttQueueMsgWithPriority((byte*)msgBF,(byte*)"<topic>",(byte*)"<serverid>:<device>",(byte*)"use-token-auth",(byte*)"<key>",(byte*)"<serveraddr",MQTT_PRIORITY_LOW) >= MQTT_QUEUE_FULL)
+            return 0;
+        n = 0;
+    }
+    return 0;
+}
+#endif
+
+/***********    Aggregation: one summary publish per window instead of one per sample    ************/
+static MQTT_AGGREGATE* MqttFindAggregate(byte* varname){
+    byte i;
+    for (i = 0; i < Mqtt_Max_Aggregated_Vars; i++)
+        if (MqttAggregates[i].Window && !strcmp((const char*)MqttAggregates[i].Name, (const char*)varname))
+            return &MqttAggregates[i];
+    return NULL;
+}
+
+// Window of 0 stops aggregating the variable; returns 0 if the table is full
+bool MqttSetAggregation(byte* varname, DWORD Window, double Low, double High){
+    MQTT_AGGREGATE* Agg = MqttFindAggregate(varname);
+    byte i;
+
+    if (!Agg){
+        if (!Window)
+            return 1;
+        for (i = 0; i < Mqtt_Max_Aggregated_Vars && MqttAggregates[i].Window; i++)
+            ;
+        if (i == Mqtt_Max_Aggregated_Vars)
+            return 0;
+        Agg = &MqttAggregates[i];
+        Agg->Count = 0;
+    }
+    Agg->Name = varname;
+    Agg->Window = Window;
+    Agg->Low = Low;
+    Agg->High = High;
+    return 1;
+}
+
+static void MqttAggregateEmit(MQTT_AGGREGATE* Agg){
+    char* msgBF = MqttSlotBuffer(MQTT_PRIORITY_NORMAL);
+
+    if (msgBF){
+        GetAsJSONStats(msgBF, (const char*)Agg->Name, Agg->Min, Agg->Max, Agg->Sum/Agg->Count, Agg->Count);
+        MqttQueueIbmMsg(msgBF);
+    }
+    Agg->Count = 0;         // the window is closed even if the queue was full
+}
+
+// Adds a sample to its window; returns 0 if it must also be sent raw
+static bool MqttAggregateSample(byte* varname, double val){
+    MQTT_AGGREGATE* Agg = MqttFindAggregate(varname);
+
+    if (!Agg)
+        return 0;
+    if (Agg->Count > 0 && (TickGet() - Agg->Start >= Agg->Window || Agg->Count == 0xFFFF))
+        MqttAggregateEmit(Agg);
+    if (Agg->Count == 0){
+        Agg->Start = TickGet();
+        Agg->Min = Agg->Max = val;
+        Agg->Sum = 0;
+    }
+    if (val < Agg->Min)
+        Agg->Min = val;
+    if (val > Agg->Max)
+        Agg->Max = val;
+    Agg->Sum += val;
+    Agg->Count++;
+    return Agg->Low > Agg->High || (val >= Agg->Low && val <= Agg->High);
+}
+
+// Closes the windows that ran out without a new sample.  Call it from the
+// context that queues the samples, the queue has a single producer
+void MqttAggregatePoll(){
+    byte i;
+    for (i = 0; i < Mqtt_Max_Aggregated_Vars; i++)
+        if (MqttAggregates[i].Window && MqttAggregates[i].Count > 0
+            && TickGet() - MqttAggregates[i].Start >= MqttAggregates[i].Window)
+            MqttAggregateEmit(&MqttAggregates[i]);
+}
+
+/***********    Deadband: unchanged readings are dropped before encoding    ************/
+static MQTT_DEADBAND* MqttFindDeadband(byte* varname){
+    byte i;
+    for (i = 0; i < Mqtt_Max_Deadband_Vars; i++)
+        if (MqttDeadbands[i].Name && !strcmp((const char*)MqttDeadbands[i].Name, (const char*)varname))
+            return &MqttDeadbands[i];
+    return NULL;
 }
 
+// Abs in the unit of the variable, Pct in percent of the last value sent;
+// Pct < 0 stops filtering the variable.  Returns 0 if the table is full
+bool MqttSetDeadband(byte* varname, float Abs, float Pct, DWORD MaxSilence){
+    MQTT_DEADBAND* Db = MqttFindDeadband(varname);
+    byte i;
+
+    if (Pct < 0){
+        if (Db)
+            Db->Name = NULL;
+        return 1;
+    }
+    if (!Db){
+        for (i = 0; i < Mqtt_Max_Deadband_Vars && MqttDeadbands[i].Name; i++)
+            ;
+        if (i == Mqtt_Max_Deadband_Vars)
+            return 0;
+        Db = &MqttDeadbands[i];
+        Db->Name = varname;
+        Db->Valid = 0;
+    }
+    Db->Abs = Abs;
+    Db->Pct = Pct;
+    Db->MaxSilence = MaxSilence;
+    return 1;
+}
+
+// 1 if the value moved out of the band, or the variable was silent too long
+static bool MqttDeadbandPass(MQTT_DEADBAND* Db, float val){
+    float d, Last;
+
+    if (!Db || !Db->Valid)
+        return 1;
+    if (Db->MaxSilence && TickGet() - Db->LastTick >= Db->MaxSilence)
+        return 1;
+    Last = Db->Last;
+    d = val > Last ? val - Last : Last - val;
+    if (Db->Abs == 0 && Db->Pct == 0)
+        return d != 0;
+    if (Db->Abs > 0 && d >= Db->Abs)
+        return 1;
+    if (Last < 0)
+        Last = -Last;
+    // d > 0: from a zero Last any change is beyond the band, no change is not
+    return Db->Pct > 0 && d > 0 && d * 100 >= Db->Pct * Last;
+}
 
 void MqttSendSampleIbmPublishVarWithName(byte* varname, double val ){
-    char msgBF[64];
-    GetAsJSONValue(msgBF,varname,val);
-    MqttQueueMsgWithCred(msgBF,"<topic>","<serverid>:<device>","use-token-auth","<key>","<serveraddr");
+    MQTT_DEADBAND* Db;
+    char* msgBF;
+
+    if (MqttAggregateSample(varname, val))
+        return;
+    Db = MqttFindDeadband(varname);
+    if (!MqttDeadbandPass(Db, val))
+        return;
+    msgBF = MqttSlotBuffer(MQTT_PRIORITY_NORMAL);
+    if (msgBF){
+        GetAsJSONValue(msgBF,(const char*)varname,val);
+        if (MqttQueueIbmMsg(msgBF) < MQTT_QUEUE_FULL && Db){   // only once queued, a full queue retries with the next sample
+            Db->Last = val;
+            Db->LastTick = TickGet();
+            Db->Valid = 1;
+        }
+    }
 }
 
 void MqttSendSampleGnatPublishMsgForTopic(byte* val,  byte* topic ){
-    MqttQueueMsgWithCred(val,topic,"sconnGKP40","user",ServerPasswd,ServerName);
+    MqttQueueMsgWithCred(val,topic,(byte*)"sconnGKP40",(byte*)"user",ServerPasswd,NULL);     // any broker of the list
 }
 
 void MqttClientInit(){
      byte* servbuff = ipcGetHostServerHostname();
-     memcpy(ServerName,servbuff,strlen(servbuff));
+     memcpy(ServerName,servbuff,strlen((const char*)servbuff));
 
      byte* passbuff = ipcGetHostServerPasswd();
-     memcpy(ServerPasswd,passbuff,strlen(passbuff));
+     memcpy(ServerPasswd,passbuff,strlen((const char*)passbuff));
+
+     MqttAddBroker(ServerName, 1883);
+}
+
+/***********    Failover: requests queued without a server go to the fastest broker of this list that is up    ************/
+bool MqttAddBroker(byte* Server, WORD Port){
+    MQTT_BROKER* B;
+
+    if (BrokerCount >= Mqtt_Max_Brokers)
+        return 0;
+    B = &MqttBrokers[BrokerCount];
+    memset(B, 0x00, sizeof(*B));
+    B->Server = Server;
+    B->Port = Port;
+    BrokerCount++;
+    return 1;
+}
+
+const MQTT_BROKER_STATS* MqttGetBrokerStats(byte Broker){
+    return Broker < BrokerCount ? &MqttBrokers[Broker].Stats : NULL;
+}
+
+// A broker is up unless it failed its last session and the hold-down
+// has not run out; one that mostly fails ranks as if it were very slow
+static DWORD MqttBrokerRank(MQTT_BROKER* B){
+    DWORD Rtt = B->Stats.Rtt ? B->Stats.Rtt : Mqtt_Broker_Rtt_Unknown;
+
+    if (B->Stats.Tries >= 4 && B->Stats.Successes*2 < B->Stats.Tries)
+        Rtt += Mqtt_Broker_Hold_Down;
+    return Rtt;
+}
+
+// Broker for the next session: the best ranked one up, else the first back up
+static byte MqttPickBroker(){
+    MQTT_BROKER* B;
+    byte i, Best = MQTT_NO_INDEX, Soonest = MQTT_NO_INDEX;
+
+    for (i = 0; i < BrokerCount; i++){
+        B = &MqttBrokers[i];
+        if (B->Stats.Fails && (LONG)(TickGet() - B->DownUntil) < 0){
+            if (Soonest == MQTT_NO_INDEX || (LONG)(B->DownUntil - MqttBrokers[Soonest].DownUntil) < 0)
+                Soonest = i;
+        }
+        else if (Best == MQTT_NO_INDEX || MqttBrokerRank(B) < MqttBrokerRank(&MqttBrokers[Best]))
+            Best = i;
+    }
+    return Best != MQTT_NO_INDEX ? Best : Soonest;
+}
+
+// Books the outcome of the session's connection: refused or never up
+// puts the broker on hold so the next session fails over right away
+static void MqttBrokerResult(){
+    MQTT_BROKER* B;
+    DWORD Rtt;
+
+    if (SessionBroker == MQTT_NO_INDEX)
+        return;
+    B = &MqttBrokers[SessionBroker];
+    if (B->Stats.Tries == 0xFFFF){      // keep the rate recent
+        B->Stats.Tries >>= 1;
+        B->Stats.Successes >>= 1;
+    }
+    B->Stats.Tries++;
+    if (SessionConnected && (MQTTResponseCode < MQTT_RESOLVE_ERROR || MQTTResponseCode >= MQTT_OPERATION_FAILED)){
+        B->Stats.Successes++;
+        B->Stats.Fails = 0;
+        if (ConnectTimed){      // not if the pipelined CONNACK was never seen
+            Rtt = B->Stats.ConnectTime;
+            B->Stats.Rtt = B->Stats.Rtt ? B->Stats.Rtt - (B->Stats.Rtt >> 2) + (Rtt >> 2) : Rtt;
+        }
+    }
+    else{
+        if (B->Stats.Fails < 0xFF)
+            B->Stats.Fails++;
+        B->DownUntil = TickGet() + Mqtt_Broker_Hold_Down;
+    }
+    SessionBroker = MQTT_NO_INDEX;
+}
+
+// Pipelining does not wait in MQTT_CONNECT_WAIT: the connect is timed when
+// the CONNACK is in, whatever the state of the session by then
+static void MqttConnAckPoll(){
+    if (!ConnAckWait || MQTTConnAckPending())
+        return;
+    ConnAckWait = 0;
+    ConnAckSeen = MQTTClient.bConnected;
+    if (MQTTClient.bConnected && SessionBroker != MQTT_NO_INDEX){
+        MqttBrokers[SessionBroker].Stats.ConnectTime = TickGet() - ConnectStart;
+        ConnectTimed = 1;
+    }
+}
+
+// The stack has one RTT estimator: it is handed over to the broker of the
+// session, so that each broker's round trips, pings included, set its own
+// ack timeouts.  A profile with a server of its own starts from scratch
+static void MqttRttSwitch(){
+    static const MQTT_RTT None = {0, 0, 0};
+    byte* Server = (byte*)MQTTClient.Server.szRAM;
+
+    if (Server == RttServer && SessionBroker == RttBroker)
+        return;
+    if (RttBroker != MQTT_NO_INDEX)
+        MQTTRttSave(&MqttBrokers[RttBroker].Estimator);
+    MQTTRttRestore(SessionBroker != MQTT_NO_INDEX ? &MqttBrokers[SessionBroker].Estimator : &None);
+    RttServer = Server;
+    RttBroker = SessionBroker;
 }
 
 void MqttSetPublishRxCallback(){
@@ -141,105 +1230,208 @@ void MqttSetPublishRxCallback(){
   	None
   ***************************************************************************/
 void MQTTClientTask(void) {
-	static enum	{
-		MQTT_HOME = 0,
-		MQTT_BEGIN,
-		MQTT_CONNECT,
-		MQTT_CONNECT_WAIT,
-		MQTT_PUBLISH,
-		MQTT_PUBLISH_WAIT,
-		MQTT_FINISHING,
-		MQTT_DONE
-		} MQTTState = MQTT_HOME;
-
-	static DWORD WaitTime;
+	MQTT_REQUEST* Next;
+	MQTT_LANE* Lane;
+	MQTT_PROFILE* Profile;
 
+	MqttWatermarkPoll();
+	MqttConnAckPoll();
 	switch(MQTTState)	{
 		case MQTT_HOME:
-		  if(PendingRequests > 0)	{
-                                RequestTimeoutCounter = 0;
+		  MqttShed();
+		  if((Next = MqttNextRequest(&Lane)) != NULL)	{
+                                // adaptive: hold the session back for a fuller batch, alarms excepted;
+                                // a full lane gets no fuller, waiting then only costs time
+                                if((Adaptive || LinkFixed) && Pipelining && Lane && Lane != &MqttLanes[MQTT_PRIORITY_HIGH]
+                                    && MqttLanePending(Lane) < Link.BatchMax && MqttLanePending(Lane) < Lane->Size
+                                    && (LONG)(TickGet() - Next->Queued) < (LONG)Link.FlushDelay)
+                                    break;
+                                SessionFromRetry = Lane == NULL;
+                                SessionLane = Lane;
+                                if(Lane){
+                                    Lane->Credit--;
+                                    MqttLaneWait(Lane, Next);
+                                }
+                                MqttSessionRow(0)->Attempts++;
+                                MqttArmTimeout(MQTTAckTimeout());
+                                SessionRequests = 1;
+                                SessionDone = 0;
 				MQTTState++;
                     }
 			break;
 		case MQTT_BEGIN:
 			if(MQTTBeginUsage()) {
                             RequestPending = 0; //clear request
-				MQTTClient.Server.szRAM = MqttClientRequests[0][Mqtt_Request_ServerAddr_Pos];
-                                MQTTClient.ServerPort = 1883;
-				MQTTClient.ConnectId.szRAM = MqttClientRequests[0][Mqtt_Request_DevId_Pos];
-				MQTTClient.Username.szRAM = MqttClientRequests[0][Mqtt_Request_Username_Pos];
-                                MQTTClient.Password.szRAM = MqttClientRequests[0][Mqtt_Request_Password_Pos];
+                            Profile = &MqttProfiles[MqttSessionRow(0)->Profile];
+				MQTTClient.Server.szRAM = (char*)Profile->Server;
+                                MQTTClient.ServerPort = Profile->Port;
+                                SessionConnected = 0;
+                                ConnAckWait = ConnectTimed = ConnAckSeen = 0;
+                                SessionBroker = Profile->Server ? MQTT_NO_INDEX : MqttPickBroker();
+                                if(SessionBroker != MQTT_NO_INDEX){
+                                    MQTTClient.Server.szRAM = (char*)MqttBrokers[SessionBroker].Server;
+                                    MQTTClient.ServerPort = MqttBrokers[SessionBroker].Port;
+                                }
+                                MqttRttSwitch();
+				MQTTClient.ConnectId.szRAM = (char*)Profile->ClientId;
+				MQTTClient.Username.szRAM = (char*)Profile->Username;
+                                MQTTClient.Password.szRAM = (char*)Profile->Password;
 				MQTTClient.bSecure=FALSE;
                                // MQTTClient.m_Callback = callback;
 				MQTTClient.QOS=0;
 				MQTTClient.KeepAlive=MQTT_KEEPALIVE_LONG;
-                                MQTTClient.Topic.szRAM =  MqttClientRequests[0][Mqtt_Request_TopicName_Pos];
-                                MQTTClient.Payload.szRAM =  MqttClientRequests[0][Mqtt_Request_MsgBuff_Pos];
+				MQTTClient.bPipeline=Pipelining;
+				MQTTClient.bPersistent=Persistent;
+				MQTTClient.Ver=ProtocolVersion;
+                                MQTTClient.Topic.szRAM =  (char*)MqttTopics[MqttSessionRow(0)->Topic];
+                                MQTTClient.Payload.szRAM =  MqttSessionRow(0)->Msg;
 				//  MQTTClient.Stream = stream;
 				MQTTState++;
 				}
-                        else{
-                            RequestTimeoutCounter++;
-                            if ( RequestTimeoutCounter > REQ_TIMEOUT_CYCLES )
-                                MQTTState = MQTT_DONE;
-                        }
+                        else if(MqttTimedOut())
+                            MQTTState = MQTT_DONE;
 			break;
 		case MQTT_CONNECT:
 			MQTTConnect(MQTTClient.ConnectId.szRAM,MQTTClient.Username.szRAM,MQTTClient.Password.szRAM,
 				NULL,0,0,NULL);
+			ConnectStart = TickGet();
+			MqttArmTimeout(REQ_DNS_TIMEOUT + 3*MQTTAckTimeout());     // DNS, TCP with one lost SYN, CONNACK
 			MQTTState++;
 			break;
 
 		case MQTT_CONNECT_WAIT:
 			if(MQTTConnected())
                         {
+                                            SessionConnected = 1;
+                                            ConnAckWait = 1;        // timed now, or once a pipelined CONNACK is in
+                                            MqttConnAckPoll();
+                                            MqttArmTimeout(2*MQTTAckTimeout());      // written and, for QOS 1, acked
                                             MQTTState++;
                         }
-                        else
-                        {
-                            RequestTimeoutCounter++;
-                            if ( RequestTimeoutCounter > REQ_TIMEOUT_CYCLES )
-                                MQTTState = MQTT_DONE;
-                        }
+                        // refused, the stack is idle; given up on the server, it is home again:
+                        // either way the session is over, the next one can try another broker
+                        else if(MqttTimedOut() || MQTTIsIdle() || !MQTTIsBusy())
+                            MQTTState = MQTT_DONE;
 			break;
 
 		case MQTT_PUBLISH:
-			MQTTPublish(MQTTClient.Topic.szRAM,MQTTClient.Payload.szRAM,strlen(MQTTClient.Payload.szRAM),0);
-			MQTTState++;
+			// a lost persistent session is resubscribed first, the publish waits for it
+			if(Compression ? MQTTPublishCompressed(MQTTClient.Topic.szRAM,MQTTClient.Payload.szRAM,strlen((const char*)MQTTClient.Payload.szRAM),0)
+				: MQTTPublish(MQTTClient.Topic.szRAM,MQTTClient.Payload.szRAM,strlen((const char*)MQTTClient.Payload.szRAM),0))
+				MQTTState++;
+			else if(MQTTSessionRestoring())
+				;
+			// so does a keep-alive PING or a PUBACK in flight: busy is not failed
+			else if(MQTTClient.bConnected && !MQTTIsIdle() && !MqttTimedOut())
+				;
+			else {
+				MQTTResponseCode=MQTT_OPERATION_FAILED;		// not sent, don't report it as done
+				MQTTState++;
+				}
 			break;
 
 		case MQTT_PUBLISH_WAIT:
+			MqttLinkSample();
 			if(MQTTIsIdle()) {
-				if(MQTTResponseCode == MQTT_SUCCESS)
+                            if(MQTTResponseCode == MQTT_SUCCESS && SessionDone < SessionRequests){
+                                MqttSessionRow(SessionRequests-1)->Tick = TickGet();
+                                SessionDone = SessionRequests;
+                            }
+                            // Pipelining: next request for the same session goes right behind
+                            if(Pipelining && MQTTResponseCode == MQTT_SUCCESS
+                                && (!(Adaptive || LinkFixed) || SessionRequests < Link.BatchMax)
+                                && MqttSameSession(SessionRequests)){
+                              if(((Adaptive || LinkFixed) && MqttLinkInFlight() >= Link.Window) || MqttConnAckHold(SessionRequests)){
+                                // the window holds it back until the TX FIFO drains, the retry area until the CONNACK
+                                MQTTFlush();
+                                if(!MqttTimedOut())
+                                    break;
+                              }
+                              else{
+                                MQTTClient.Topic.szRAM = (char*)MqttTopics[MqttSessionRow(SessionRequests)->Topic];
+                                MQTTClient.Payload.szRAM = MqttSessionRow(SessionRequests)->Msg;
+                                MqttSessionRow(SessionRequests)->Attempts++;
+                                if(!SessionFromRetry)
+                                    MqttLaneWait(SessionLane, MqttSessionRow(SessionRequests));
+                                SessionRequests++;
+                                MqttArmTimeout(2*MQTTAckTimeout());
+                                MQTTState = MQTT_PUBLISH;
+                                break;
+                              }
+                            }
+                            MQTTFlush();
+				if(MQTTResponseCode == MQTT_SUCCESS) {
+					MqttArmTimeout(MQTTAckTimeout());
 					MQTTState=MQTT_FINISHING;
+					}
 				else
-					MQTTState=MQTT_FINISHING;
+					MQTTState=MQTT_DONE;		// nothing to wait for, report the failure
 			}
-                        else{
-                            RequestTimeoutCounter++;
-                            if ( RequestTimeoutCounter > REQ_TIMEOUT_CYCLES )
-                                MQTTState = MQTT_DONE;
-                        }
+                        // or the CONNACK refused it while the session waited, the stack went home
+                        else if(MqttTimedOut() || !MQTTIsBusy())
+                            MQTTState = MQTT_DONE;
 			break;
 
 		case MQTT_FINISHING:
-			if(!MQTTIsBusy())	{
+			// done once the stack is idle and the broker confirmed the session
+			// and, for QOS 1, the last PUBLISH; the timer only bounds a failure
+			if(MQTTIsIdle() && !MQTTConnAckPending() && !MQTTPubAckPending())
 				MQTTState++;
-         
-			}
-                        else{
-                            RequestTimeoutCounter++;
-                            if ( RequestTimeoutCounter > REQ_TIMEOUT_CYCLES )
-                                MQTTState = MQTT_DONE;
-                        }
+			else if(!MQTTClient.bConnected || MqttTimedOut()) {
+				if(MQTTResponseCode == MQTT_SUCCESS)
+					MQTTResponseCode = MQTT_OPERATION_FAILED;
+				MQTTState = MQTT_DONE;
+				}
 			break;
 
 		case MQTT_DONE:
                         MQTTEndUsage();
 			MQTTState = MQTT_HOME;
-                        MqttDequeueCurrentRequest();
+                        MqttBrokerResult();
+                        if(Adaptive)
+                            MqttLinkAdapt(MQTTResponseCode == MQTT_SUCCESS ? SessionDone : 0, SessionRequests);
+                        MqttCompleteSession();
 			break;
 		}
+#if MQTT_TRACE_SIZE
+	if(MQTTState != TraceState) {
+		TraceState = MQTTState;
+		MQTT_TRACE(MQTT_TRACE_CLIENT, MQTTState, MQTTResponseCode);
+		}
+#endif
+	}
+
+// One MQTTClientTask pass for MQTTTaskBudget, TRUE if the state moved on
+static BOOL MQTTClientStep(void) {
+	BYTE state = MQTTState;
+
+	MQTTClientTask();
+	return state != MQTTState;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTClientTaskBudget(MQTT_BUDGET *Budget)
+
+  Summary:
+	Runs the request state machine and MQTTTask until the budget is used up.
+
+  Description:
+	Call this instead of MQTTClientTask and MQTTTask from the main loop to
+	drain queued requests and inbound frames in one pass, see MQTTTaskBudget.
+
+  Precondition:
+	The MQTT client is initialized.
+
+  Parameters:
+	Budget - frame, byte and time limits for this pass
+
+  Returns:
+  	TRUE if requests are still queued or the MQTT client has work left
+  ***************************************************************************/
+BOOL MQTTClientTaskBudget(MQTT_BUDGET *Budget) {
+
+	return MQTTTaskBudget(Budget, MQTTClientStep) || MqttPendingRequests() > 0 || RetryCount > 0;
 	}
 
 
@@ -1,2 +1,123 @@
+/*********************************************************************
+ *
+ *  MQTT Client Demonstrations
+ *
+ *********************************************************************
+ * FileName:        MQTTClient.h
+ * Dependencies:    MQTT.h
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ ********************************************************************/
+#ifndef __MQTTCLIENT_H
+#define __MQTTCLIENT_H
 
-void MQTTClientTask(void);
\ No newline at end of file
+// Outcome of a queued request, see MqttQueueMsgWithCallback
+typedef struct {
+    byte* Msg;              // as queued
+    byte* Topic;
+    WORD Result;            // MQTT_SUCCESS or the MQTTResponseCode of the failure
+    byte Attempts;          // sessions the request was tried in
+    DWORD Latency;          // ticks from enqueue to written (QOS 0) or given up
+} MQTT_COMPLETION;
+
+typedef void (*MQTT_COMPLETION_CB)(const MQTT_COMPLETION *);
+
+// MQTT_COMPLETION Result of a request shed by the drop policy
+#define MQTT_REQUEST_DROPPED    (0x8301u)
+
+// Enqueue outcome
+typedef enum {
+    MQTT_QUEUE_OK = 0,
+    MQTT_QUEUE_HIGH,        // queued, at or above the high watermark
+    MQTT_QUEUE_DROPPED,     // queued, an older or lower priority request is shed
+    MQTT_QUEUE_FULL,        // not queued, from here on
+    MQTT_QUEUE_NO_INDEX     // not queued, the profile or topic table is full
+} MQTT_QUEUE_STATUS;
+
+// Drop policies, see MqttSetQueuePolicy
+#define MQTT_DROP_NEWEST        0       // refuse the new request
+#define MQTT_DROP_OLDEST        1
+#define MQTT_DROP_LOWEST        2       // lowest priority, the oldest of them
+
+// MqttAddProfile / MqttInternTopic result when the table is full, every
+// entry pinned by these two or held by a queued request
+#define MQTT_NO_INDEX           0xFF
+
+// Health of a failover broker, see MqttGetBrokerStats
+typedef struct {
+    WORD Tries;             // sessions, halved with Successes when full
+    WORD Successes;         // sessions that connected
+    DWORD Rtt;              // smoothed connect time (DNS, TCP and CONNACK), ticks; 0 = not measured
+    DWORD ConnectTime;      // last one
+    byte Fails;             // consecutive failed sessions
+} MQTT_BROKER_STATS;
+
+// Link parameters of the adaptive client, see MqttGetLinkParams
+typedef struct {
+    byte BatchMax;          // requests per pipelined session
+    DWORD FlushDelay;       // ticks a session start waits for a fuller batch
+    WORD Window;            // TX FIFO bytes a pipelined session may have unacknowledged
+    DWORD Rtt;              // MQTTSmoothedRtt() at the last adjustment
+    byte AckRate;           // % of requests delivered, smoothed
+    WORD TxFree;            // least TX FIFO space seen in the current session
+    WORD TxSize;            // most TX FIFO space seen, taken as the FIFO size
+} MQTT_LINK_PARAMS;
+
+// Priorities, each with its own lane of the queue
+#define MQTT_PRIORITY_LOW       0
+#define MQTT_PRIORITY_NORMAL    1       // requests queued without a priority
+#define MQTT_PRIORITY_HIGH      2       // alarms, command responses
+#define MQTT_LANES              3
+
+// Queue time of a lane, see MqttGetLaneStats; WaitSum/Served is the mean
+typedef struct {
+    DWORD Served;           // requests picked for sending
+    DWORD WaitSum;          // ticks from enqueue to pick, summed
+    DWORD WaitMax;
+    byte Depth;             // requests queued now
+} MQTT_LANE_STATS;
+
+// Request outcomes since start-up, see MqttGetCounters
+typedef struct {
+    DWORD Delivered;
+    DWORD Failed;           // out of attempts, moved to the dead letters
+    DWORD Retried;
+    DWORD DeadDropped;      // dead letters overwritten before MqttTakeDeadLetter
+    DWORD Dropped;          // shed by the drop policy
+    DWORD Rejected;         // refused at enqueue, counted by the producer
+} MQTT_CLIENT_COUNTERS;
+
+void MqttClientInit(void);
+void MQTTClientTask(void);
+BOOL MQTTClientTaskBudget(MQTT_BUDGET *);
+void MqttSetPipelining(bool Enable);
+void MqttSetPersistentSession(bool Enable);
+void MqttSetProtocolVersion(byte Ver);
+bool MqttSetAggregation(byte* varname, DWORD Window, double Low, double High);
+void MqttAggregatePoll(void);
+bool MqttSetDeadband(byte* varname, float Abs, float Pct, DWORD MaxSilence);
+void MqttSetCompression(bool Enable);
+void MqttSetAdaptive(bool Enable);
+void MqttSetLinkParams(byte BatchMax, DWORD FlushDelay, WORD Window);
+const MQTT_LINK_PARAMS* MqttGetLinkParams(void);
+void MqttPublishLinkMetrics(void);
+bool MqttPublishTrace(void);
+byte MqttAddProfile(byte* Server, WORD Port, byte* ClientId, byte* Username, byte* Password);
+byte MqttInternTopic(byte* Topic);
+MQTT_QUEUE_STATUS MqttQueueMsgForProfile(byte Profile, byte Topic, byte* Msg, byte Priority, MQTT_COMPLETION_CB Done);
+bool MqttAddBroker(byte* Server, WORD Port);
+const MQTT_BROKER_STATS* MqttGetBrokerStats(byte Broker);
+MQTT_QUEUE_STATUS MqttQueueMsg(byte* Msg, byte* Topic, byte* Id, byte* serverAddr);
+MQTT_QUEUE_STATUS MqttQueueMsgWithCred(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr);
+MQTT_QUEUE_STATUS MqttQueueMsgWithCallback(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr, MQTT_COMPLETION_CB Done);
+MQTT_QUEUE_STATUS MqttQueueMsgWithPriority(byte* Msg, byte* Topic, byte* Id, byte* Username, byte* Password, byte* serverAddr, byte Priority);
+bool MqttCanQueue(WORD Bytes);
+const MQTT_LANE_STATS* MqttGetLaneStats(byte Lane);
+void MqttSetQueuePolicy(byte Policy, byte MaxRequests, WORD MaxBytes);
+void MqttSetWatermarks(byte High, byte Low, void (*Handler)(bool Above));
+void MqttSetCompletionHandler(void (*Handler)(const MQTT_COMPLETION *, byte));
+void MqttSetRetryPolicy(byte MaxAttempts, DWORD Backoff, bool AtTail);
+const MQTT_CLIENT_COUNTERS* MqttGetCounters(void);
+bool MqttTakeDeadLetter(byte** Msg, byte** Topic);
+
+#endif
@@ -57,6 +57,10 @@
 #include "TCPIP Stack/TCPIP.h"
 
 #include "generictypedefs.h"
+#include "TCPIP Stack/MQTTLZ.h"
+#include "TCPIP Stack/MQTTTrace.h"
+#include "TCPIP Stack/MQTTProf.h"
+#include "TCPIP Stack/MQTTCapture.h"
 
 /****************************************************************************
   Section:
@@ -64,7 +68,9 @@
   ***************************************************************************/
 #define MQTT_PORT					1883					// Default port to use when unspecified
 #define MQTT_PORT_SECURE	8883					// Default port to use when unspecified
-#define MQTT_SERVER_REPLY_TIMEOUT	(TICK_SECOND*8)		// How long to wait before assuming the connection has been dropped (default 8 seconds)
+#define MQTT_SERVER_REPLY_TIMEOUT	(TICK_SECOND*8)		// How long to wait before assuming the connection has been dropped (default 8 seconds), until the RTT is measured
+#define MQTT_RTO_MIN				(TICK_SECOND/2)		// Bounds of the RTT based ack timeout, see MQTTAckTimeout
+#define MQTT_RTO_MAX				(TICK_SECOND*30)
 
 
 /****************************************************************************
@@ -84,14 +90,79 @@ static TCP_SOCKET MySocket = INVALID_SOCKET;	// Socket currently in use by the M
 
 WORD MQTTResponseCode;
 
-BYTE MQTTBuffer[MQTT_MAX_PACKET_SIZE];
-
-static BYTE rxBF[200];
-static word bytesRecieved = 0;
+BYTE MQTTTxBuffer[MQTT_TX_BUFFER_SIZE];		// outbound frames are built here
+BYTE MQTTRxBuffer[MQTT_RX_BUFFER_SIZE];		// inbound frames are reassembled here
 
 static WORD lastInActivity=0,lastOutActivity=0;
 
-static word LastPingTick = 0;
+static DWORD LastPingTick = 0;
+
+// Round trip time, TCP style (Jacobson/Karels), sampled from CONNACK,
+// PINGRESP and PUBACK; it sets the ack timeouts, see MQTTAckTimeout
+static DWORD rttSmoothed = 0;			// SRTT*8 in ticks, 0 = no sample yet
+static DWORD rttVar = 0;				// RTTVAR*4 in ticks
+static BYTE rtoBackoff = 0;				// timeouts since the last sample, each doubles the timeout
+static DWORD connectSent, pingSent, pubSent;
+static WORD pubSentId;					// QOS1 PUBLISH timed for its PUBACK, 0 = none
+
+// Gather list of the PUBLISH being streamed: pubHead, topic, pubId, pubProps, payload
+static BYTE pubHead[7];					// fixed header, remaining length, topic length
+static BYTE pubHeadLen;
+static BYTE pubId[2];					// message id, QOS>0 only
+static BYTE pubProps[4+3+sizeof(MQTT_LZ_CONTENT_TYPE)-1];	// MQTT 5 properties: length, topic alias, content type
+static BYTE pubPropsLen;
+static WORD pubTopicLen;
+static DWORD pubOffset;					// bytes of the frame already in the TX FIFO
+static MQTT_LZ_ENCODER pubLZ;			// MQTTPublishCompressed payload
+static BOOL pubCompressed;				// the PUBLISH goes out marked MQTT_LZ_CONTENT_TYPE
+static BYTE lzPlain[MQTT_RX_BUFFER_SIZE];	// an inbound compressed payload, expanded
+
+// SUBSCRIBE/UNSUBSCRIBE batch in progress
+static MQTT_TOPIC_FILTER *batchFilters;
+static BYTE batchCount;
+static BYTE batchNext;					// first filter not sent yet
+static struct {
+	WORD MsgId;
+	MQTT_TOPIC_FILTER *First;
+	BYTE Count;
+	DWORD Sent;					// TickGet() when written, the ack is due MQTTAckTimeout() later
+	} batchChunks[MQTT_MAX_BATCH_CHUNKS];		// frames sent, waiting for their ack
+static BYTE batchChunksOut;
+static MQTT_TOPIC_FILTER singleFilter;			// MQTTSubscribe/MQTTUnsubscribe
+
+// Persistent session (MQTTClient.bPersistent): kept across MQTTBeginUsage
+// so that the next connection can pick up where the last one stopped, the
+// unacknowledged QOS1 PUBLISHes included
+static MQTT_TOPIC_FILTER subTable[MQTT_MAX_SUBSCRIPTIONS];	// acknowledged filters, Topic NULL = free slot
+static BYTE subCount;					// slots in use, free ones included
+static struct {
+	WORD Id;
+	BOOL Dup;							// sent on an earlier connection, goes again with DUP
+	const char *Topic;
+	const BYTE *Payload;				// NULL if generated, it can't be sent again
+	DWORD Plength;
+	BOOL Retained;
+	} inflight[MQTT_MAX_INFLIGHT];		// QOS1 PUBLISHes waiting for their PUBACK
+static BYTE inflightCount;
+static WORD pubDupId;					// MQTT_PUBLISH sends inflight entry pubDupId again, 0 = a new one
+static BYTE resendQos;					// MQTTClient.QOS of the application while resending
+
+// Replies to the broker that could not go out when their frame came in:
+// the TX FIFO was full or a PUBLISH was half written.  MQTTPutOwed sends
+// them, the state machine is left alone
+static WORD ackOwed[MQTT_MAX_OWED_ACKS];		// QOS1 PUBLISH ids, PUBACK not sent yet
+static BYTE ackOwedCount;
+static WORD nextMsgId;
+
+// MQTT 5 topic aliases of this connection, alias = index+1
+static char aliasTopic[MQTT_MAX_TOPIC_ALIAS][MQTT_ALIAS_TOPIC_SIZE];	// "" = free
+static BYTE aliasMax;					// Topic Alias Maximum of the CONNACK, capped
+
+static WORD rxFrames = 0;				// inbound frames completed, for MQTTTaskBudget
+static WORD ioBytes = 0;				// socket bytes read + written, for MQTTTaskBudget
+#if MQTT_TRACE_SIZE
+static BYTE traceState = 0;				// MQTTState last traced
+#endif
 
 // Message state machine for the MQTT Client
 static enum {
@@ -129,12 +200,11 @@ static enum {
         MQTT_CONNECT,
         MQTT_CONNECT_ACK,
         MQTT_PING,
-        MQTT_PING_ACK,
         MQTT_PUBLISH,
+        MQTT_PUBLISH_STREAM,
         MQTT_PUBLISH_ACK,
         MQTT_SUBSCRIBE,
         MQTT_SUBSCRIBE_ACK,
-        MQTT_PUBACK,
         MQTT_UNSUBSCRIBE,
         MQTT_UNSUBSCRIBE_ACK,
         MQTT_DISCONNECT_INIT,
@@ -152,7 +222,10 @@ static union {
 		unsigned char ReceivedSuccessfully:1;
 		unsigned char ConnectedOnce:1;
 		unsigned char PingOutstanding:1;
-		unsigned char filler:5;
+		unsigned char ConnAckPending:1;		// pipelined CONNECT not acknowledged yet
+		unsigned char RestorePending:1;		// broker lost the session, resubscribe from MQTT_IDLE
+		unsigned char PingRespOwed:1;		// PINGREQ received, PINGRESP not sent yet
+		unsigned char ResendPending:1;		// unacked PUBLISHes go again if the CONNACK keeps the session
 		} bits;
 	} MQTTFlags = {0x00};
 	
@@ -161,6 +234,25 @@ static union {
   Section:
 	MQTT Client Internal Function Prototypes
   ***************************************************************************/
+static BOOL MQTTReceive(void);
+static void MQTTDispatch(WORD len, BYTE llen);
+static BOOL MQTTPutControl(BYTE header, WORD msgId, BYTE idLen);
+static BOOL MQTTMidFrame(void);
+static void MQTTPutOwed(void);
+static BOOL MQTTPutPublish(void);
+static BOOL MQTTPutBatchChunk(WORD msgId);
+static void MQTTBatchAck(WORD msgId, const BYTE *codes, WORD n);
+static void MQTTBatchExpire(void);
+static BOOL MQTTStartBatch(MQTT_TOPIC_FILTER *filters, BYTE count, BYTE state);
+static WORD MQTTNewMsgId(void);
+static BOOL MQTTResendNext(void);
+static void MQTTSubTableSet(const MQTT_TOPIC_FILTER *f, BOOL keep);
+static BYTE MQTTSubTableCompact(void);
+static WORD MQTTProperties(const BYTE *p, WORD avail, WORD *first);
+static BOOL MQTTGetProperty(const BYTE *p, WORD avail, BYTE id, DWORD *value);
+static BYTE MQTTTopicAlias(const char *topic, BOOL *known);
+static void MQTTRttSample(DWORD r);
+static void MQTTRttTimeout(void);
 
 
 /****************************************************************************
@@ -208,6 +300,8 @@ BOOL MQTTBeginUsage(void) {
 	MQTTClient.Ver=MQTTPROTOCOLVERSION;
 	MQTTClient.KeepAlive=MQTT_KEEPALIVE_LONG;
 	MQTTClient.MsgId=1;
+	batchCount = batchNext = batchChunksOut = 0;
+	ackOwedCount = 0;
 		
 	return TRUE;
 	}
@@ -263,7 +357,7 @@ WORD MQTTEndUsage(void) {
 		return MQTT_SUCCESS;
 		}
 	else {
-//		return MQTTResponseCode;
+		return MQTTResponseCode;
 		}
 	}
 
@@ -295,11 +389,27 @@ WORD MQTTEndUsage(void) {
   ***************************************************************************/
 void MQTTTask(void) {
 	WORD			i;
-	WORD			w;
 	static DWORD	Timer;
-	static WORD nextMsgId;
-	static ROM BYTE *ROMStrPtr;
-	static BYTE 	*RAMStrPtr;
+
+	// A pipelined session whose CONNACK never came is rolled back
+	if(MQTTFlags.bits.ConnAckPending && TickGet()-Timer > MQTTAckTimeout()) {
+		MQTTRttTimeout();
+		MQTTFlags.bits.ConnAckPending = FALSE;
+		MQTTClient.bConnected=FALSE;
+		MQTTResponseCode=MQTT_CONNECT_ERROR;
+		MQTTState=MQTT_CLOSE;
+		}
+	// A SUBSCRIBE/UNSUBSCRIBE batch with an ack overdue is given up
+	if(batchChunksOut)
+		MQTTBatchExpire();
+
+	// Inbound frames land in MQTTRxBuffer and are handled whatever the
+	// outbound state, so sending and receiving progress in the same pass
+	if(MQTTClient.bConnected && (MQTTState == MQTT_IDLE ||
+		(MQTTState >= MQTT_PING && MQTTState <= MQTT_UNSUBSCRIBE_ACK)))
+		MQTTReceive();
+	if(MQTTClient.bConnected && !MQTTMidFrame())
+		MQTTPutOwed();
 
 	switch(MQTTState)	{
 		case MQTT_HOME:
@@ -320,7 +430,7 @@ void MQTTTask(void) {
 					DNSResolveROM(MQTTClient.Server.szROM, DNS_TYPE_A);
 				else
 #endif
-					DNSResolve(MQTTClient.Server.szRAM, DNS_TYPE_A);
+					DNSResolve((BYTE *)MQTTClient.Server.szRAM, DNS_TYPE_A);
 				}
 			else {
 				MQTTState=MQTT_HOME;		// can't do anything
@@ -353,7 +463,7 @@ void MQTTTask(void) {
 				}
 
 			MQTTState++;
-			// No need to break here
+			// fall through
 
 		case MQTT_OBTAIN_SOCKET:
 			// Connect a TCP socket to the remote MQTT server
@@ -367,7 +477,7 @@ void MQTTTask(void) {
 
 			MQTTState++;
 			Timer = TickGet();
-			// No break; fall into MQTT_SOCKET_OBTAINED
+			// fall through - into MQTT_SOCKET_OBTAINED
 			
 		
 		case MQTT_SOCKET_OBTAINED:
@@ -375,7 +485,8 @@ void MQTTTask(void) {
 				// Don't stick around in the wrong state if the
 				// server was connected, but then disconnected us.
 				// Also time out if we can't establish the connection to the MQTT server
-				if(MQTTFlags.bits.ConnectedOnce || ((LONG)(TickGet()-Timer) > (LONG)(MQTT_SERVER_REPLY_TIMEOUT)))	{
+				// a lost SYN costs the TCP stack one retransmission
+				if(MQTTFlags.bits.ConnectedOnce || ((LONG)(TickGet()-Timer) > (LONG)(2*MQTTAckTimeout())))	{
 					MQTTResponseCode = MQTT_CONNECT_ERROR;
 					MQTTState = MQTT_CLOSE;
 					}
@@ -383,28 +494,45 @@ void MQTTTask(void) {
 				break;
 				}
 			MQTTFlags.bits.ConnectedOnce = TRUE;
+			// fall through
 
 
 		case MQTT_CONNECT:
 			if(!MQTTConnected()) {
 
 				if(MQTTFlags.bits.ConnectedOnce) {
-					nextMsgId = 1;
-					BYTE d[9] = {0x00,0x06,'M','Q','I','s','d','p',MQTTPROTOCOLVERSION};
+					if(!MQTTClient.bPersistent)
+						MQTTForgetSession();		// clean session, the broker drops its copy too
+					if(MQTTFlags.bits.ResendPending)
+						MQTTClient.QOS = resendQos;
+					for(i=0; i<inflightCount; i++)
+						inflight[i].Dup = TRUE;		// what this connection has yet to send again
+					// ahead of any new PUBLISH, pipelined ones included, or they
+					// would push the old ones out of the table; a CONNACK without
+					// the session empties it
+					MQTTFlags.bits.ResendPending = inflightCount > 0;
+					resendQos = MQTTClient.QOS;
+					batchChunksOut = 0;		// acks of an older connection will never come
+					ackOwedCount = 0;		// nor are replies owed to it wanted
+					MQTTFlags.bits.PingRespOwed = FALSE;
+					aliasMax = 0;			// aliases only live as long as the connection
+					for(i=0; i<MQTT_MAX_TOPIC_ALIAS; i++)
+						aliasTopic[i][0] = 0;
 					// Leave room in the buffer for header and variable length field
-					WORD length = 5;
-					unsigned int j;
+					WORD length = MQTT_HEADER_RESERVE;
 
-					for(j=0; j<9; j++) 
-						MQTTBuffer[length++] = d[j];
+					if(MQTTClient.Ver >= MQTT_VERSION_3_1_1)
+						length = MQTTWriteString("MQTT",MQTTTxBuffer,length);
+					else
+						length = MQTTWriteString("MQIsdp",MQTTTxBuffer,length);
+					MQTTTxBuffer[length++] = MQTTClient.Ver;
 
 					BYTE v;
+					v = MQTTClient.bPersistent ? 0x00 : 0x02;		// clean session
 					if(MQTTClient.WillTopic.szRAM) {
 						MQTTClient.QOS=MQTTClient.WillQOS;
-						v = 0x06 | (MQTTClient.WillQOS<<3) | (MQTTClient.WillRetain<<5);
+						v |= 0x04 | (MQTTClient.WillQOS<<3) | (MQTTClient.WillRetain<<5);
 						}
-					else 
-						v = 0x02;
 
 					if(MQTTClient.Username.szRAM) {
 						v |= 0x80;
@@ -412,65 +540,83 @@ void MQTTTask(void) {
 							v = v | (0x80>>1);
  						}
 
-					MQTTBuffer[length++] = v;
+					MQTTTxBuffer[length++] = v;
 
-					MQTTBuffer[length++] = HIBYTE(MQTTClient.KeepAlive);
-					MQTTBuffer[length++] = LOBYTE(MQTTClient.KeepAlive);
+					MQTTTxBuffer[length++] = HIBYTE(MQTTClient.KeepAlive);
+					MQTTTxBuffer[length++] = LOBYTE(MQTTClient.KeepAlive);
+					if(MQTTClient.Ver >= MQTT_VERSION_5)
+						MQTTTxBuffer[length++] = 0;		// no properties
 
 #if defined(__18CXX)
 					if(MQTTClient.ROMPointers.ConnectId) 
-						length = MQTTWriteROMString(MQTTClient.ConnectId.szROM,MQTTBuffer,length);
+						length = MQTTWriteROMString(MQTTClient.ConnectId.szROM,MQTTTxBuffer,length);
 					else
 #endif
-						length = MQTTWriteString(MQTTClient.ConnectId.szRAM,MQTTBuffer,length);
+						length = MQTTWriteString(MQTTClient.ConnectId.szRAM,MQTTTxBuffer,length);
 					if(MQTTClient.WillTopic.szRAM) {
+						if(MQTTClient.Ver >= MQTT_VERSION_5)
+							MQTTTxBuffer[length++] = 0;		// no will properties
 #if defined(__18CXX)
 						if(MQTTClient.ROMPointers.WillTopic) 
-							length = MQTTWriteString(MQTTClient.WillTopic.szROM,MQTTBuffer,length);
+							length = MQTTWriteString(MQTTClient.WillTopic.szROM,MQTTTxBuffer,length);
 						else
 #endif
-							length = MQTTWriteString(MQTTClient.WillTopic.szRAM,MQTTBuffer,length);
+							length = MQTTWriteString(MQTTClient.WillTopic.szRAM,MQTTTxBuffer,length);
 #if defined(__18CXX)
 						if(MQTTClient.ROMPointers.WillMessage) 
-							length = MQTTWriteROMString(MQTTClient.WillMessage.szROM,MQTTBuffer,length);
+							length = MQTTWriteROMString(MQTTClient.WillMessage.szROM,MQTTTxBuffer,length);
 						else
 #endif
-							length = MQTTWriteString(MQTTClient.WillMessage.szRAM,MQTTBuffer,length);
+							length = MQTTWriteString(MQTTClient.WillMessage.szRAM,MQTTTxBuffer,length);
 						}
 
 					if(MQTTClient.Username.szRAM) {		// il check su union  ok!
 #if defined(__18CXX)
 						if(MQTTClient.ROMPointers.Username) {
-							length = MQTTWriteROMString(MQTTClient.Username.szROM,MQTTBuffer,length);
+							length = MQTTWriteROMString(MQTTClient.Username.szROM,MQTTTxBuffer,length);
 							if(MQTTClient.Password.szRAM) {
 								if(MQTTClient.ROMPointers.Password) {
-									length = MQTTWriteROMString(MQTTClient.Password.szROM,MQTTBuffer,length);
+									length = MQTTWriteROMString(MQTTClient.Password.szROM,MQTTTxBuffer,length);
 									}	
 								else {
-									length = MQTTWriteString(MQTTClient.Password.szRAM,MQTTBuffer,length);
+									length = MQTTWriteString(MQTTClient.Password.szRAM,MQTTTxBuffer,length);
 									}	
 								}
 							}	
 						else {
 #endif
-							length = MQTTWriteString(MQTTClient.Username.szRAM,MQTTBuffer,length);
+							length = MQTTWriteString(MQTTClient.Username.szRAM,MQTTTxBuffer,length);
 							if(MQTTClient.Password.szRAM) {
 #if defined(__18CXX)
 								if(MQTTClient.ROMPointers.Password)
-									length = MQTTWriteROMString(MQTTClient.Password.szROM,MQTTBuffer,length);
+									length = MQTTWriteROMString(MQTTClient.Password.szROM,MQTTTxBuffer,length);
 								else
 #endif
-									length = MQTTWriteString(MQTTClient.Password.szRAM,MQTTBuffer,length);
+									length = MQTTWriteString(MQTTClient.Password.szRAM,MQTTTxBuffer,length);
 								}
 #if defined(__18CXX)
 							}
 #endif
 						}
-                                                    MQTTWrite(MQTTCONNECT,MQTTBuffer,length-5);
-                                                    MQTTState=MQTT_CONNECT_ACK;
+                                                    // Pipelining: no flush, SUBSCRIBE/PUBLISH follow right behind
+                                                    MQTTFlags.bits.ConnAckPending = MQTTClient.bPipeline;
+                                                    if(!MQTTWrite(MQTTCONNECT,MQTTTxBuffer,length-MQTT_HEADER_RESERVE)) {
+                                                        MQTTFlags.bits.ConnAckPending = FALSE;
+                                                        break;      // TX FIFO full, build it again next pass
+                                                        }
+                                                    Timer = connectSent = TickGet();
+                                                    pubSentId = 0;
                                                     MQTTResponseCode=MQTT_SUCCESS;
-					//if(MQTTWrite(MQTTCONNECT,MQTTBuffer,length-5)){		// si potrebbe spezzare in 2 per non rifare tutto il "prepare" qua sopra...
-                                       // TCPPutArray(MySocket, MQTTBuffer, length-5);
+                                                    if(MQTTClient.bPipeline) {
+                                                        // Optimistically connected, MQTTDispatch
+                                                        // reconciles the CONNACK later
+                                                        MQTTClient.bConnected=TRUE;
+                                                        MQTTState=MQTT_IDLE;
+                                                        }
+                                                    else
+                                                        MQTTState=MQTT_CONNECT_ACK;
+					//if(MQTTWrite(MQTTCONNECT,MQTTTxBuffer,length-5)){		// si potrebbe spezzare in 2 per non rifare tutto il "prepare" qua sopra...
+                                       // TCPPutArray(MySocket, MQTTTxBuffer, length-5);
                                        // TCPFlush(MySocket);
                                         //			MQTTState++;
 //					lastOutActivity = TickGet();	// gi in write
@@ -483,94 +629,19 @@ void MQTTTask(void) {
 				}
 			break;
 		case MQTT_CONNECT_ACK:
-			lastInActivity =TickGet();
-                     /*
-                    if(TCPIsConnected(MySocket)) {
-
-
-                        int rec = TCPIsGetReady(MySocket);
-                        if ( rec <= 0 )
-                        {
-                            return;
-                        }
-                        int length = TCPGetArray(MySocket, &rxBF[bytesRecieved], rec);
-                        bytesRecieved += length;
-                              */
-			while(!MQTTAvailable()) {
-				WORD t = TickGet();
-//								theApp.PumpMessage();
-				if(t-lastInActivity > TICK_SECOND*10) {
-					MQTTStop();
-					//MQTTState=MQTT_IDLE;
-					break;
-					}
-				}
-
-			//BYTE llen[4];
-			WORD len= MQTTReadPacket();
-                         
- 
-//			char myBuf[128];
-//			wsprintf(myBuf,"Connect: len=%u, %02X,%02X,%02X,%02X",len,buffer[0],buffer[1],buffer[2],buffer[3]);
-//			AfxMessageBox(myBuf);
-			if(len >= 2) { //len    bytesRecieved
- 				switch(rxBF[1]) {   //MQTTBuffer
-					case 0:
-						lastInActivity = TickGet();
-						MQTTFlags.bits.PingOutstanding = FALSE;
-						MQTTClient.bConnected=TRUE;
-						break;
-					case 1:		// unacceptable protocol version
-						MQTTClient.bConnected=FALSE;		// 
-						MQTTResponseCode=MQTT_BAD_PROTOCOL;
-						break;
-					case 2:		// identifier rejected
-						MQTTClient.bConnected=FALSE;		// 
-						MQTTResponseCode=MQTT_IDENT_REJECTED;
-						break;
-					case 3:		// server unavailable
-						MQTTClient.bConnected=FALSE;		// 
-						MQTTResponseCode=MQTT_SERVER_UNAVAILABLE;
-						break;
-					case 4:		// bad user o password
-						MQTTClient.bConnected=FALSE;		// 
-						MQTTResponseCode=MQTT_BAD_USER_PASW;
-						break;
-					case 5:		// unauthorized
-#ifdef _DEBUG
-						AfxMessageBox("unauthorized");
-#endif
-						MQTTClient.bConnected=FALSE;		// 
-						MQTTResponseCode=MQTT_UNAUTHORIZED;
-						break;
+			// The CONNACK is handled by MQTTDispatch, which moves on to MQTT_IDLE
+			if(!MQTTReceive()) {
+				if(TickGet()-Timer > MQTTAckTimeout()) {
+					MQTTRttTimeout();
+					MQTTResponseCode=MQTT_CONNECT_ERROR;
+					MQTTState=MQTT_IDLE;
 					}
-
-                                        MQTTState=MQTT_IDLE;    //go to idle now
 				}
-                        /*
-                    }
-                    else{
-                         MQTTState=MQTT_HOME;
-                    }
-                         * */
 			break;
 
 		case MQTT_PING:
-			MQTTBuffer[0]=MQTTPINGREQ;
-			MQTTBuffer[1]=0;
-			if(TCPIsPutReady(MySocket) >= 2) {
-				MQTTPutArray(MQTTBuffer,2);
-				lastOutActivity = TickGet();
-				MQTTState=MQTT_IDLE;			// 
-				}
-			break;
-
-		case MQTT_PING_ACK:					// Pingback, 
-			MQTTBuffer[0]=MQTTPINGRESP;
-			MQTTBuffer[1]=0;
-			if(TCPIsPutReady(MySocket)>=2) {
-				MQTTPutArray(MQTTBuffer,2);
-				lastOutActivity = TickGet();
+			if(MQTTPutControl(MQTTPINGREQ,0,0)) {
+				pingSent = TickGet();
 				MQTTState=MQTT_IDLE;			// 
 				}
 			break;
@@ -578,23 +649,76 @@ void MQTTTask(void) {
 		case MQTT_PUBLISH:	
 			//publish				
 			if(MQTTConnected()) {
-				// Leave room in the buffer for header and variable length field
-				WORD length = 5;
-#if defined(__18CXX)
-				if(MQTTClient.ROMPointers.Topic)
-					length = MQTTWriteString(MQTTClient.Topic.szROM, MQTTBuffer,length);
-				else
-#endif
-					length = MQTTWriteString(MQTTClient.Topic.szRAM, MQTTBuffer,length);
-				WORD i;
-				for(i=0;i<MQTTClient.Plength;i++)
-					MQTTBuffer[length++] = MQTTClient.Payload.szRAM[i];		// idem ROM/RAM ..
+				// Only the fixed header, topic length and message id are
+				// built here, topic and payload are sent from where they are
+				DWORD length;
 				BYTE header = MQTTPUBLISH | (MQTTClient.QOS ? (MQTTClient.QOS==2 ? MQTTQOS2 : MQTTQOS1) : MQTTQOS0);
 				if(MQTTClient.Retained) 
 					header |= 1;
+				if(pubDupId)
+					header |= 0x08;				// DUP
+
+				pubTopicLen = strlen(MQTTClient.Topic.szRAM);
+				pubPropsLen = 0;
+				if(MQTTClient.Ver >= MQTT_VERSION_5) {
+					// a topic already aliased goes as its alias alone
+					BOOL known;
+					pubPropsLen = 1;
+					pubProps[3] = MQTTTopicAlias(MQTTClient.Topic.szRAM, &known);
+					if(pubProps[3]) {
+						pubProps[1] = 0x23;				// Topic Alias
+						pubProps[2] = 0;
+						pubPropsLen = 4;
+						if(known)
+							pubTopicLen = 0;
+						}
+					if(pubCompressed) {
+						pubProps[pubPropsLen++] = 0x03;	// Content Type
+						pubProps[pubPropsLen++] = 0;
+						pubProps[pubPropsLen++] = sizeof(MQTT_LZ_CONTENT_TYPE)-1;
+						memcpy(pubProps+pubPropsLen, MQTT_LZ_CONTENT_TYPE, sizeof(MQTT_LZ_CONTENT_TYPE)-1);
+						pubPropsLen += sizeof(MQTT_LZ_CONTENT_TYPE)-1;
+						}
+					pubProps[0] = pubPropsLen-1;
+					}
+				length = 2 + pubTopicLen + pubPropsLen + MQTTClient.Plength + (MQTTClient.QOS ? 2 : 0);
+				pubHead[0] = header;
+				pubHeadLen = MQTTEncodeLength(length, pubHead+1);
+				if(pubHeadLen == MQTT_LENGTH_MALFORMED) {
+					// too long for MQTT: refused, nor has the broker heard of a new alias
+					if(pubPropsLen > 1 && pubProps[1] == 0x23 && pubTopicLen)
+						aliasTopic[pubProps[3]-1][0] = 0;
+					MQTTResponseCode=MQTT_OPERATION_FAILED;
+					MQTTState=MQTT_IDLE;
+					break;
+					}
+				pubHeadLen++;
+				if(pubDupId) {
+					pubId[0] = HIBYTE(pubDupId);		// already in the table
+					pubId[1] = LOBYTE(pubDupId);
+					}
+				else if(MQTTClient.QOS) {
+					MQTTNewMsgId();
+					if(MQTTClient.bPersistent) {
+						if(inflightCount >= MQTT_MAX_INFLIGHT) {		// the oldest is given up
+							inflightCount--;
+							memmove(inflight, inflight+1, inflightCount*sizeof(inflight[0]));
+							}
+						inflight[inflightCount].Id = nextMsgId;
+						inflight[inflightCount].Dup = FALSE;
+						inflight[inflightCount].Topic = MQTTClient.Topic.szRAM;
+						inflight[inflightCount].Payload = MQTTClient.m_Producer ? NULL : MQTTClient.Payload.szRAM;
+						inflight[inflightCount].Plength = MQTTClient.Plength;
+						inflight[inflightCount].Retained = MQTTClient.Retained;
+						inflightCount++;
+						}
+					pubId[0] = HIBYTE(nextMsgId);
+					pubId[1] = LOBYTE(nextMsgId);
+					}
 
-				//if(MQTTWrite(header,MQTTBuffer,length-5))		// si potrebbe spezzare in 2 per non rifare tutto il "prepare" qua sopra...
-				MQTTWrite(header,MQTTBuffer,length-5);
+				pubHead[pubHeadLen++] = HIBYTE(pubTopicLen);
+				pubHead[pubHeadLen++] = LOBYTE(pubTopicLen);
+				pubOffset = 0;
                                 MQTTState++;
 				MQTTResponseCode=MQTT_SUCCESS;
 
@@ -603,121 +727,43 @@ void MQTTTask(void) {
 				MQTTResponseCode=MQTT_OPERATION_FAILED;
 			break;
 
-		case MQTT_PUBLISH_ACK:				// Publish command accepted (if QOS)
-			if(MQTTClient.QOS>0) {			// FINIRE...
-
-				//BYTE llen;
-			WORD len= MQTTReadPacket(); //&llen
-
-                        /*
-                        int rec = TCPIsGetReady(MySocket);
-                        if ( rec <= 0 )
-                        {
-                                        break;
-                        }
-                        int length = TCPGetArray(MySocket, rxBF, rec);
-                            */
-
-//			char myBuf[128];
-//			wsprintf(myBuf,"publish: len=%u, %02X,%02X,%02X,%02X",len,buffer[0],buffer[1],buffer[2],buffer[3]);
-//			AfxMessageBox(myBuf);
-				if(len >= 2) {		// finire!
-					MQTTState=MQTT_IDLE;
-					}
-				}
-			else
+		case MQTT_PUBLISH_STREAM:
+			// Carries on over as many passes as the TX FIFO space requires
+			if(!TCPIsConnected(MySocket)) {
+				MQTTClient.bConnected=FALSE;
+				MQTTResponseCode=MQTT_OPERATION_FAILED;
 				MQTTState=MQTT_IDLE;
-			break;
-
-		case MQTT_SUBSCRIBE:	
-		//			subscribe(const char *topic, BYTE qos
-
-		// mmm no	m_QOS=qos;
-		// ma cmq usiamo lo stesso, per praticit...
-			if(/*MQTTClient.QOS < 0 || boh */ MQTTClient.QOS > 1)
 				break;
-
-			if(MQTTConnected()) {
-				// Leave room in the buffer for header and variable length field
-				WORD length = 5;
-				nextMsgId++;
-				if(nextMsgId == 0) 
-					 nextMsgId = 1;
-
-				MQTTBuffer[length++] = HIBYTE(nextMsgId);
-				MQTTBuffer[length++] = LOBYTE(nextMsgId);
-#if defined(__18CXX)
-				if(MQTTClient.ROMPointers.Topic)
-					length = MQTTWriteString(MQTTClient.Topic.szROM, MQTTBuffer,length);
-				else
-#endif
-					length = MQTTWriteString(MQTTClient.Topic.szRAM, MQTTBuffer,length);
-				MQTTBuffer[length++] = MQTTClient.QOS;
-
-				if(MQTTWrite(MQTTSUBSCRIBE | (MQTTClient.QOS ? (MQTTClient.QOS==2 ? MQTTQOS2 : MQTTQOS1) : MQTTQOS0),MQTTBuffer,length-5))		// si potrebbe spezzare in 2 per non rifare tutto il "prepare" qua sopra...
-					MQTTState++;
-				MQTTResponseCode=MQTT_SUCCESS;
 				}
-			else
-				MQTTResponseCode=MQTT_OPERATION_FAILED;
-
-			break;
-
-		case MQTT_SUBSCRIBE_ACK:			// Subscribe command accepted (if QOS)
-			if(MQTTClient.QOS>0) {			// FINIRE...
-				BYTE llen;
-				WORD len= MQTTReadPacket(&llen);
-   
-//			char myBuf[128];
-//			wsprintf(myBuf,"subscribe: len=%u, %02X,%02X,%02X,%02X",len,buffer[0],buffer[1],buffer[2],buffer[3]);
-//			AfxMessageBox(myBuf);
-				if(len==4) {
-					MQTTState=MQTT_IDLE;
+			if(MQTTPutPublish()) {
+				lastOutActivity = TickGet();
+				if(MQTTClient.QOS) {
+					pubSent = lastOutActivity;
+					pubSentId = MAKEWORD(pubId[1],pubId[0]);
 					}
+				MQTTState++;
 				}
-			else
-				MQTTState=MQTT_IDLE;
 			break;
 
-		case MQTT_PUBACK:	
-		// puback(WORD msgId) 
-
-			if(MQTTConnected()) {
-				// Leave room in the buffer for header and variable length field
-				WORD length = 5;
-				MQTTBuffer[length++] = HIBYTE(MQTTClient.MsgId);
-				MQTTBuffer[length++] = LOBYTE(MQTTClient.MsgId);
-				if(MQTTWrite(MQTTPUBACK,MQTTBuffer,length-5))
-					MQTTState=MQTT_IDLE;
-
-				// per in loop() faceva 			
-//			MQTTBuffer[0] = MQTTPUBACK;
-//			MQTTBuffer[1] = 2;
-//			MQTTBuffer[2] = HIBYTE(id);
-//			MQTTBuffer[3] = LOBYTE(id);
-//			MQTTPutArray(MQTTBuffer,4);
-//			lastOutActivity = t;
-
+		case MQTT_PUBLISH_ACK:				// Publish command accepted (if QOS)
+			// the PUBACK is handled by MQTTDispatch, pipelining does not wait for it
+			if(MQTTClient.QOS==0 || MQTTClient.bPipeline)
+				MQTTState=MQTT_IDLE;
+			else if(TickGet()-pubSent > MQTTAckTimeout()) {
+				MQTTRttTimeout();
+				pubSentId = 0;
+				MQTTResponseCode=MQTT_OPERATION_FAILED;
+				MQTTState=MQTT_IDLE;
 				}
 			break;
 
+		case MQTT_SUBSCRIBE:	
 		case MQTT_UNSUBSCRIBE:	
-				//unsubscribe(const char *topic) 
+			// one frame carries as many filters of the batch as fit
+			if(batchChunksOut >= MQTT_MAX_BATCH_CHUNKS)
+				break;				// wait for an ack to free a slot
 			if(MQTTConnected()) {
-				WORD length = 5;
-				nextMsgId++;
-				if(nextMsgId == 0)
-					 nextMsgId = 1;
-			
-				MQTTBuffer[length++] = HIBYTE(nextMsgId);
-				MQTTBuffer[length++] = LOBYTE(nextMsgId);
-#if defined(__18CXX)
-				if(MQTTClient.ROMPointers.Topic)
-					length = MQTTWriteString(MQTTClient.Topic.szROM, MQTTBuffer,length);
-				else
-#endif
-					length = MQTTWriteString(MQTTClient.Topic.szRAM, MQTTBuffer,length);
-				if(MQTTWrite(MQTTUNSUBSCRIBE | MQTTQOS1,MQTTBuffer,length-5))
+				if(MQTTPutBatchChunk(MQTTNewMsgId()))
 					MQTTState++;
 				MQTTResponseCode=MQTT_SUCCESS;
 				}
@@ -725,8 +771,16 @@ void MQTTTask(void) {
 				MQTTResponseCode=MQTT_OPERATION_FAILED;
 			break;
 
-		case MQTT_UNSUBSCRIBE_ACK:			// Subscribe command accepted (if QOS)
-			MQTTState=MQTT_IDLE;
+		case MQTT_SUBSCRIBE_ACK:			// Subscribe command accepted
+		case MQTT_UNSUBSCRIBE_ACK:
+			// acks are matched to the filters by MQTTDispatch; pipelining keeps
+			// up to MQTT_MAX_BATCH_CHUNKS frames in flight instead of waiting
+			if(batchNext < batchCount) {
+				if(batchChunksOut == 0 || MQTTClient.bPipeline)
+					MQTTState--;
+				}
+			else if(batchChunksOut == 0 || MQTTClient.bPipeline)
+				MQTTState=MQTT_IDLE;
 			break;
 
 		case MQTT_DISCONNECT_INIT:
@@ -735,11 +789,7 @@ void MQTTTask(void) {
 
 		case MQTT_DISCONNECT:	
 				//disconnect() 
-			MQTTBuffer[0] = MQTTDISCONNECT;
-			MQTTBuffer[1] = 0;
-			if(TCPIsPutReady(MySocket) >= 2) {
-				MQTTPutArray(MQTTBuffer,2);
-				lastOutActivity = TickGet();
+			if(MQTTPutControl(MQTTDISCONNECT,0,0)) {
 				MQTTState=MQTT_CLOSE;
 				MQTTStop();
 				}
@@ -761,9 +811,21 @@ void MQTTTask(void) {
 			MQTTState = MQTT_HOME;
 			break;
 		case MQTT_IDLE:	
+			if(MQTTFlags.bits.RestorePending && MQTTConnected() && !MQTTFlags.bits.ConnAckPending) {
+				// subscribe again to what the lost session had
+				MQTTFlags.bits.RestorePending = FALSE;
+				MQTTStartBatch(subTable, MQTTSubTableCompact(), MQTT_SUBSCRIBE);
+				break;
+				}
+			if(MQTTFlags.bits.ResendPending && MQTTConnected() && !MQTTFlags.bits.ConnAckPending) {
+				// the PUBLISHes the kept session never acknowledged, one at a time
+				if(MQTTResendNext())
+					break;
+				MQTTFlags.bits.ResendPending = FALSE;
+				MQTTClient.QOS = resendQos;
+				}
 			if(MQTTConnected()) {
-				WORD t = TickGet();
-				WORD i;
+				DWORD t = TickGet();
 				if(t - LastPingTick >   MQTT_KEEPALIVE_REALTIME*TICK_SECOND) {
 					if( !MQTTFlags.bits.PingOutstanding) {
 						MQTTState=MQTT_PING;
@@ -771,53 +833,89 @@ void MQTTTask(void) {
                                                 LastPingTick = TickGet();
 					 }
 					}
-				if(MQTTAvailable()) {
-					BYTE llen;
-					WORD len = MQTTReadPacket(&llen);
-					WORD msgId = 0;
-					BYTE *payload;
-
-					if(len > 0) {
-						lastInActivity = t;
-						BYTE type = MQTTBuffer[0] & 0xF0;
-
-						switch(type) {
-							case MQTTPUBLISH:
-								if(MQTTClient.m_Callback) {
-									WORD tl = MAKEWORD(MQTTBuffer[llen+2],MQTTBuffer[llen+1]);
-									char *topic=malloc(tl+1);
-
-									for(i=0; i<tl; i++)
-										topic[i] = MQTTBuffer[llen+3+i];
-									topic[tl] = 0;
-									// msgId only present for QOS>0
-									if((MQTTBuffer[0] & 0x06) == MQTTQOS1) {
-										msgId = MAKEWORD(MQTTBuffer[llen+3+tl+1],MQTTBuffer[llen+3+tl]);
-										payload = MQTTBuffer+llen+3+tl+2;
-										MQTTClient.m_Callback(topic,payload,len-llen-3-tl-2);
-
-										MQTTPubACK(msgId);
-										} 
-									else {
-										payload = MQTTBuffer+llen+3+tl;
-										MQTTClient.m_Callback(topic,payload,len-llen-3-tl);
-										}
-									free(topic);
-									}
-								break;
-							case MQTTPINGREQ:
-								MQTTState=MQTT_PING_ACK;
-								break;
-							case MQTTPINGRESP:
-								MQTTFlags.bits.PingOutstanding = FALSE;
-								break;
-							}
-						}
-					}
 				}
 			break;
 	
 		}
+#if MQTT_TRACE_SIZE
+	if(MQTTState != traceState) {
+		traceState = MQTTState;
+		MQTT_TRACE(MQTT_TRACE_STATE, MQTTState, MQTTResponseCode);
+		}
+#endif
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTTaskBudget(MQTT_BUDGET *Budget, BOOL (*Step)(void))
+
+  Summary:
+	Runs MQTTTask repeatedly until the work budget is used up
+
+  Description:
+	MQTTTask performs at most one state transition and reads at most one
+	inbound packet per call.  This function keeps calling it (and Step,
+	if given, before each pass) so that a burst of inbound frames, or a
+	queue of outbound operations, can be handled in a single main loop
+	pass.  It stops when any of the Frames, Bytes or Ticks limits in Budget
+	is reached, or when a pass makes no progress (no state change, no
+	frame received, no byte moved and Step returned FALSE).
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Parameters:
+	Budget - limits for this run, a zero limit means unlimited.  On
+		return Pending holds the bytes still to move: unread in the RX
+		FIFO, replies owed to the broker and what is left of a PUBLISH
+	Step - optional extra task run before each pass, returns TRUE if it
+		made progress (e.g. an application state machine feeding requests)
+
+  Returns:
+	TRUE - work is left over: bytes pending, an operation in progress, or
+		Step still making progress
+	FALSE - the client is settled with nothing to do
+  ***************************************************************************/
+BOOL MQTTTaskBudget(MQTT_BUDGET *Budget, BOOL (*Step)(void)) {
+	DWORD start = TickGet();
+	WORD frames = 0, bytes = 0;
+	WORD f, b;
+	DWORD pending;
+	BYTE state;
+	BOOL progress, stepProgress;
+
+	do {
+		state = MQTTState;
+		f = rxFrames;
+		b = ioBytes;
+
+		stepProgress = Step ? Step() : FALSE;
+		MQTTTask();
+
+		f = rxFrames - f;
+		b = ioBytes - b;
+		frames += f;
+		bytes += b;
+		progress = stepProgress || state != MQTTState || f || b;
+
+		if(Budget->Frames && frames >= Budget->Frames)
+			break;
+		if(Budget->Bytes && bytes >= Budget->Bytes)
+			break;
+		if(Budget->Ticks && TickGet() - start >= Budget->Ticks)
+			break;
+		} while(progress);
+
+	// a reply owed stays owed in MQTT_IDLE, it counts as work all the same
+	pending = MySocket != INVALID_SOCKET ? TCPIsGetReady(MySocket) : 0;
+	pending += 4*ackOwedCount + (MQTTFlags.bits.PingRespOwed ? 2 : 0);
+	if(MQTTState == MQTT_PUBLISH)
+		pending += MQTTClient.Plength;
+	else if(MQTTState == MQTT_PUBLISH_STREAM)
+		pending += pubHeadLen + pubTopicLen + (MQTTClient.QOS ? 2 : 0) + pubPropsLen + MQTTClient.Plength - pubOffset;
+	Budget->Pending = pending < 0xFFFF ? pending : 0xFFFF;
+
+	return Budget->Pending || stepProgress || (MQTTState != MQTT_IDLE && MQTTState != MQTT_HOME);
 	}
 
 
@@ -856,7 +954,205 @@ BOOL MQTTIsBusy(void) {
 
 BOOL MQTTIsIdle(void) {
 
-	return MQTTState != MQTT_IDLE;
+	return MQTTState == MQTT_IDLE;
+	}
+
+// Feeds a round trip time sample to the estimator
+static void MQTTRttSample(DWORD r) {
+	LONG delta;
+
+	if(!rttSmoothed) {
+		rttSmoothed = (r << 3) | 1;		// never 0 once sampled
+		rttVar = r << 1;
+		}
+	else {
+		delta = (LONG)r - (LONG)(rttSmoothed >> 3);
+		rttSmoothed += delta;
+		if(delta < 0)
+			delta = -delta;
+		rttVar += delta - (rttVar >> 2);
+		}
+	rtoBackoff = 0;
+	}
+
+// An ack did not come in time: the next wait is twice as long
+static void MQTTRttTimeout(void) {
+
+	if(rtoBackoff < 6)
+		rtoBackoff++;
+	}
+
+/*****************************************************************************
+  Function:
+	DWORD MQTTAckTimeout(void)
+
+  Summary:
+	How long to wait for the broker to answer
+
+  Description:
+	SRTT + 4*RTTVAR from the CONNACK, PINGRESP and PUBACK round trips,
+	doubled for each timeout since the last sample and kept between
+	MQTT_RTO_MIN and MQTT_RTO_MAX.  Until a first sample it is
+	MQTT_SERVER_REPLY_TIMEOUT.  The RTT outlives the connection, so the
+	next session starts from what was learnt.
+
+  Precondition:
+	None
+
+  Returns:
+	The timeout, in ticks
+  ***************************************************************************/
+DWORD MQTTAckTimeout(void) {
+	DWORD rto;
+
+	rto = rttSmoothed ? (rttSmoothed >> 3) + rttVar : MQTT_SERVER_REPLY_TIMEOUT;
+	if(rto < MQTT_RTO_MIN)
+		rto = MQTT_RTO_MIN;
+	rto <<= rtoBackoff;
+	return rto > MQTT_RTO_MAX ? MQTT_RTO_MAX : rto;
+	}
+
+/*****************************************************************************
+  Function:
+	DWORD MQTTSmoothedRtt(void)
+
+  Summary:
+	The smoothed round trip time to the broker
+
+  Precondition:
+	None
+
+  Returns:
+	SRTT in ticks, 0 before the first sample
+  ***************************************************************************/
+DWORD MQTTSmoothedRtt(void) {
+
+	return rttSmoothed >> 3;
+	}
+
+/*****************************************************************************
+  Function:
+	void MQTTRttSave(MQTT_RTT *rtt)
+	void MQTTRttRestore(const MQTT_RTT *rtt)
+
+  Summary:
+	Takes out or puts back what the RTT estimator learnt
+
+  Description:
+	Call them between sessions when the next one goes to another broker:
+	save for the broker left, restore that of the next one, or a zeroed
+	MQTT_RTT for a broker never measured.
+
+  Precondition:
+	None
+
+  Parameters:
+	rtt - estimator state
+  ***************************************************************************/
+void MQTTRttSave(MQTT_RTT *rtt) {
+
+	rtt->Smoothed = rttSmoothed;
+	rtt->Var = rttVar;
+	rtt->Backoff = rtoBackoff;
+	}
+
+void MQTTRttRestore(const MQTT_RTT *rtt) {
+
+	rttSmoothed = rtt->Smoothed;
+	rttVar = rtt->Var;
+	rtoBackoff = rtt->Backoff;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTConnAckPending(void)
+
+  Summary:
+	Tells whether a pipelined CONNECT is still waiting for its CONNACK
+
+  Description:
+	With MQTTClient.bPipeline set, the client reports itself connected as
+	soon as CONNECT is written, so SUBSCRIBE and PUBLISH can follow in the
+	same flight.  Until this returns FALSE the session is not confirmed:
+	if the broker refuses it, the connection is closed, MQTTConnected
+	turns FALSE and MQTTResponseCode tells why.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Returns:
+	TRUE while the CONNACK is outstanding
+  ***************************************************************************/
+BOOL MQTTConnAckPending(void) {
+
+	return MQTTFlags.bits.ConnAckPending;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTPubAckPending(void)
+
+  Summary:
+	Tells whether the last QOS1 PUBLISH is still waiting for its PUBACK
+
+  Description:
+	Without pipelining the client waits in MQTT_PUBLISH_ACK anyway; with
+	it, MQTTIsIdle is TRUE once the PUBLISH is written and this is how to
+	know that the broker has it.  PUBACKs come in order, so the last one
+	covers the PUBLISHes before it.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Returns:
+	TRUE while the PUBACK is outstanding; a new CONNECT clears it
+  ***************************************************************************/
+BOOL MQTTPubAckPending(void) {
+
+	return pubSentId != 0;
+	}
+
+/*****************************************************************************
+  Function:
+	void MQTTFlush(void)
+
+  Summary:
+	Pushes out whatever has been written to the socket
+
+  Description:
+	While a pipelined CONNECT is pending, writes are not flushed one by
+	one; call this after the last SUBSCRIBE/PUBLISH of the flight so it
+	all leaves in one go.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+  ***************************************************************************/
+void MQTTFlush(void) {
+
+	if(MySocket != INVALID_SOCKET)
+		TCPFlush(MySocket);
+	}
+
+/*****************************************************************************
+  Function:
+	WORD MQTTTxFree(void)
+
+  Summary:
+	Free space in the TX FIFO of the connection
+
+  Description:
+	Bytes written but not yet acknowledged by the broker's TCP stay in
+	the FIFO, so a link that drains slowly shows as little free space.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Returns:
+	TCPIsPutReady of the socket, 0 without one
+  ***************************************************************************/
+WORD MQTTTxFree(void) {
+
+	return MySocket != INVALID_SOCKET ? TCPIsPutReady(MySocket) : 0;
 	}
 
 /*****************************************************************************
@@ -887,8 +1183,13 @@ BOOL MQTTIsIdle(void) {
 WORD MQTTPutArray(BYTE* Data, WORD Len) {
 	WORD result = 0;
 
+        MQTT_PROF_BEGIN(MQTT_PROF_PUT_ARRAY);
         result = TCPPutArray(MySocket, Data, Len);
-        TCPFlush(MySocket);
+        if(!MQTTFlags.bits.ConnAckPending)		// pipelining: hold until MQTTFlush
+            TCPFlush(MySocket);
+        ioBytes += result;
+        MQTT_TRACE(MQTT_TRACE_TX, 0, result);
+        MQTT_CAPTURE(MQTT_CAPTURE_OUT, Data, result);
 
         /*
 	while(Len--) {
@@ -901,6 +1202,7 @@ WORD MQTTPutArray(BYTE* Data, WORD Len) {
 			}
 		}
          */
+        MQTT_PROF_END(MQTT_PROF_PUT_ARRAY);
 
 	return result;
 	}
@@ -988,6 +1290,9 @@ WORD MQTTPutString(BYTE* Data) {
 			break;
 			}
 		}
+	ioBytes += result;
+	MQTT_TRACE(MQTT_TRACE_TX, 0, result);
+	MQTT_CAPTURE(MQTT_CAPTURE_OUT, Data-result, result);
 
 	return result;
 	}
@@ -1040,57 +1345,221 @@ WORD MQTTPutROMString(ROM BYTE* Data) {
 
 
 
-BOOL MQTTWrite(BYTE header, BYTE *buf, WORD length) {
+/*****************************************************************************
+  Function:
+	BOOL MQTTWrite(BYTE header, BYTE *buf, DWORD length)
+
+  Summary:
+	Sends a frame built in buf
+
+  Description:
+	The variable header and payload must start at buf+MQTT_HEADER_RESERVE;
+	the fixed header and the 1 to 4 byte remaining length are filled in
+	right in front of them, so the frame goes out with one TCPPutArray.
+	Nothing is sent unless the whole frame fits the TX FIFO; if it does
+	not, what the FIFO holds is flushed to make room, as MQTTPutPublish
+	does, and the caller writes the frame again on a later pass.  Behind
+	a pipelined CONNECT nothing else would flush it.
+
+  Parameters:
+	header - fixed header byte
+	buf - frame buffer, usually MQTTTxBuffer
+	length - remaining length (bytes after the reserve)
+
+  Returns:
+	TRUE if the frame was sent, FALSE too if it is longer than MQTT
+	allows
+  ***************************************************************************/
+BOOL MQTTWrite(BYTE header, BYTE *buf, DWORD length) {
 	BYTE lenBuf[4];
-	BYTE llen = 0;
-	BYTE digit;
-	BYTE pos = 0;
-	BYTE rc;
-	BYTE len = length;
-	int i;
-
-  do {
-    digit = len % 128;
-    len = len / 128;
-    if(len > 0) {
-      digit |= 0x80;
-      }
-    lenBuf[pos++] = digit;
-    llen++;
-		} while(len>0);
-
-	buf[4-llen] = header;
+	BYTE llen;
+	WORD rc;
+	DWORD txlen;
+	BYTE i;
+
+	MQTT_PROF_BEGIN(MQTT_PROF_WRITE);
+	llen = MQTTEncodeLength(length, lenBuf);
+	if(llen == MQTT_LENGTH_MALFORMED) {
+		MQTT_PROF_END(MQTT_PROF_WRITE);
+		return 0;
+		}
+	buf[MQTT_HEADER_RESERVE-1-llen] = header;
 	for(i=0;i<llen;i++) {
-                buf[5-llen+i] = lenBuf[i];
+                buf[MQTT_HEADER_RESERVE-llen+i] = lenBuf[i];
 		}
-        word txlen = length+1+llen;
+        txlen = length+1+llen;
 	if(TCPIsPutReady(MySocket) >= txlen) {   //length+1+llen
-               // word bsent = TCPPutArray(MySocket, buf+(4-llen), txlen);
-               // TCPFlush(MySocket);
-		rc = MQTTPutArray(buf+(4-llen),txlen);
+		rc = MQTTPutArray(buf+(MQTT_HEADER_RESERVE-1-llen),txlen);
                 lastOutActivity = TickGet();
+		MQTT_PROF_END(MQTT_PROF_WRITE);
 		return (rc==txlen);
 		}
-	else
+	else {
+		TCPFlush(MySocket);
+		MQTT_PROF_END(MQTT_PROF_WRITE);
 		return 0;
+		}
 	}
 
-WORD MQTTWriteString(const char *string, BYTE *buf, WORD pos) {
-  const char *idp = string;
-  WORD i=0;
+/*****************************************************************************
+  Function:
+	BYTE MQTTEncodeLength(DWORD length, BYTE *buf)
 
-  pos += 2;
-  while (*idp) {
-    buf[pos++] = *idp++;
-    i++;
-		}
-	buf[pos-i-2] = HIBYTE(i);
-	buf[pos-i-1] = LOBYTE(i);
-	return pos;
-	}
+  Summary:
+	Encodes an MQTT remaining length field
 
-#if defined(__18CXX)
-WORD MQTTWriteROMString(const ROMchar *string, BYTE *buf, WORD pos) {
+  Parameters:
+	length - remaining length, up to MQTT_MAX_REMAINING_LENGTH
+	buf - receives 1 to 4 bytes
+
+  Returns:
+	The number of bytes written to buf, MQTT_LENGTH_MALFORMED (and
+	nothing written) if length is above MQTT_MAX_REMAINING_LENGTH
+  ***************************************************************************/
+BYTE MQTTEncodeLength(DWORD length, BYTE *buf) {
+	BYTE n = 0;
+	BYTE digit;
+
+	if(length > MQTT_MAX_REMAINING_LENGTH)
+		return MQTT_LENGTH_MALFORMED;
+
+	do {
+		digit = length % 128;
+		length = length / 128;
+		if(length > 0)
+			digit |= 0x80;
+		buf[n++] = digit;
+		} while(length > 0 && n < 4);
+
+	return n;
+	}
+
+/*****************************************************************************
+  Function:
+	BYTE MQTTDecodeLength(const BYTE *buf, BYTE avail, DWORD *length)
+
+  Summary:
+	Decodes an MQTT remaining length field
+
+  Parameters:
+	buf - first byte of the field
+	avail - number of bytes available at buf
+	length - receives the decoded value
+
+  Returns:
+	The field size (1 to 4) once complete, 0 if more bytes are needed,
+	MQTT_LENGTH_MALFORMED if a 4th byte still has the continuation bit
+  ***************************************************************************/
+BYTE MQTTDecodeLength(const BYTE *buf, BYTE avail, DWORD *length) {
+	DWORD value = 0;
+	BYTE n;
+
+	for(n=0; n<avail; n++) {
+		value |= (DWORD)(buf[n] & 127) << (7*n);
+		if(!(buf[n] & 128)) {
+			*length = value;
+			return n+1;
+			}
+		if(n == 3)
+			return MQTT_LENGTH_MALFORMED;
+		}
+
+	return 0;
+	}
+
+/*****************************************************************************
+  Function:
+	static BOOL MQTTPutPublish(void)
+
+  Summary:
+	Streams the current PUBLISH to the TX FIFO
+
+  Description:
+	Walks the gather list (header, topic, message id, MQTT 5 properties,
+	payload) from pubOffset on, putting as much as the TX FIFO takes.  No byte of topic
+	or payload is copied through MQTTTxBuffer, unless the payload comes
+	from MQTTClient.m_Producer.
+
+  Returns:
+	TRUE once the whole frame is in the TX FIFO
+  ***************************************************************************/
+static BOOL MQTTPutPublish(void) {
+	const BYTE *seg[5];
+	DWORD segLen[5];
+	DWORD base = 0, left;
+	WORD n;
+	BYTE k;
+
+	seg[0] = pubHead;
+	segLen[0] = pubHeadLen;
+	seg[1] = (const BYTE *)MQTTClient.Topic.szRAM;
+	segLen[1] = pubTopicLen;
+	seg[2] = pubId;
+	segLen[2] = MQTTClient.QOS ? 2 : 0;
+	seg[3] = pubProps;
+	segLen[3] = pubPropsLen;
+	seg[4] = MQTTClient.Payload.szRAM;		// idem ROM/RAM ..
+	segLen[4] = MQTTClient.Plength;
+
+	for(k=0; k<5; k++) {
+		if(pubOffset < base+segLen[k]) {
+			left = base+segLen[k]-pubOffset;
+			n = TCPIsPutReady(MySocket);
+			if((DWORD)n > left)
+				n = left;
+			if(k == 4 && MQTTClient.m_Producer) {
+				// Generated payload: MQTTTxBuffer is free while streaming,
+				// use it as the chunk the producer fills
+				if(n > MQTT_TX_BUFFER_SIZE)
+					n = MQTT_TX_BUFFER_SIZE;
+				if(n) {
+					WORD got = MQTTClient.m_Producer(MQTTTxBuffer, n, pubOffset-base);
+					MQTT_PROF_BEGIN(MQTT_PROF_PUT_ARRAY);
+					n = TCPPutArray(MySocket, MQTTTxBuffer, got < n ? got : n);
+					MQTT_PROF_END(MQTT_PROF_PUT_ARRAY);
+					MQTT_CAPTURE(MQTT_CAPTURE_OUT, MQTTTxBuffer, n);
+					}
+				}
+			else {
+				MQTT_PROF_BEGIN(MQTT_PROF_PUT_ARRAY);
+				n = TCPPutArray(MySocket, (BYTE *)seg[k]+(pubOffset-base), n);
+				MQTT_PROF_END(MQTT_PROF_PUT_ARRAY);
+				MQTT_CAPTURE(MQTT_CAPTURE_OUT, (BYTE *)seg[k]+(pubOffset-base), n);
+				}
+			pubOffset += n;
+			ioBytes += n;
+			MQTT_TRACE(MQTT_TRACE_TX, 0, n);
+			if(pubOffset < base+segLen[k]) {
+				TCPFlush(MySocket);
+				return FALSE;
+				}
+			}
+		base += segLen[k];
+		}
+
+	if(!MQTTFlags.bits.ConnAckPending)
+		TCPFlush(MySocket);
+	return TRUE;
+	}
+
+WORD MQTTWriteString(const char *string, BYTE *buf, WORD pos) {
+  const char *idp = string;
+  WORD i=0;
+
+  MQTT_PROF_BEGIN(MQTT_PROF_WRITE_STRING);
+  pos += 2;
+  while (*idp) {
+    buf[pos++] = *idp++;
+    i++;
+		}
+	buf[pos-i-2] = HIBYTE(i);
+	buf[pos-i-1] = LOBYTE(i);
+	MQTT_PROF_END(MQTT_PROF_WRITE_STRING);
+	return pos;
+	}
+
+#if defined(__18CXX)
+WORD MQTTWriteROMString(const ROMchar *string, BYTE *buf, WORD pos) {
   const char *idp = string;
   WORD i=0;
 
@@ -1119,92 +1588,376 @@ inline BYTE MQTTReadByte(void) {		// ottimizzare, evitare..?
 	BYTE ch;
 
 	TCPGet(MySocket,&ch);
+	ioBytes++;
+	MQTT_CAPTURE(MQTT_CAPTURE_IN, &ch, 1);
 	return ch;
 	}
 
-WORD MQTTReadPacket() {
-	WORD len = 0;
-	BOOL isPublish = (MQTTBuffer[0] & 0xF0) == MQTTPUBLISH;
-	DWORD multiplier = 1;
-	WORD length = 0;
-	BYTE digit = 0;
-	WORD skip = 0;
-	BYTE start = 0;
-	WORD i;
-	static BYTE m_state=0;
-        static BYTE lengthLength[10];
+/*****************************************************************************
+  Function:
+	WORD MQTTReadPacket(BYTE *llen)
 
-	switch(m_state) {
-		case 0:
-			if(TCPIsGetReady(MySocket) > 4)				// almeno 4 ci devono essere...
+  Summary:
+	Reads the next inbound frame into MQTTRxBuffer
+
+  Description:
+	Reassembles a frame from whatever the RX FIFO currently holds, without
+	waiting: a partial frame is kept and completed on later calls.  Frames
+	larger than MQTTRxBuffer are read and dropped.  MQTTTxBuffer is never
+	touched, so a frame under construction is safe.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Parameters:
+	llen - if not NULL, receives the number of remaining length bytes
+
+  Returns:
+	The total frame length (fixed header included) once a whole frame is
+	in MQTTRxBuffer, 0 otherwise
+  ***************************************************************************/
+WORD MQTTReadPacket(BYTE *llen) {
+	static BYTE m_state=0;
+	static BYTE lengthLength;
+	static BOOL drop;
+	static WORD len;
+	static DWORD length;
+	WORD avail, n;
+
+	avail = TCPIsGetReady(MySocket);
+	while(avail) {
+		switch(m_state) {
+			case 0:			// fixed header
+				len = 0;
+				MQTTRxBuffer[len++] = MQTTReadByte();
+				avail--;
 				m_state++;
-			//break;
-		case 1:
-			MQTTBuffer[len++] = MQTTReadByte();
-   
-			do {
-				digit = MQTTReadByte();
-				MQTTBuffer[len++] = digit;
-				length += (digit & 127) * multiplier;
-				multiplier *= 128;
-				} while ((digit & 128) != 0);
-			lengthLength[0] = len-1;
-			m_state++;
-
-		case 2:
-			if(isPublish) {
-				if(TCPIsGetReady(MySocket) >= 2) {			// almeno 2 ci devono essere...
-					// Read in topic length to calculate bytes to skip over for Stream writing
-					MQTTBuffer[len++] = MQTTReadByte();
-					MQTTBuffer[len++] = MQTTReadByte();
-					skip = MAKEWORD(MQTTBuffer[lengthLength[2]],MQTTBuffer[lengthLength[1]]);
-					start=2;
-					if(MQTTBuffer[0] & MQTTQOS1) {
-						// skip message id
-						skip += 2;
-						}
-					m_state=3;
+				break;
+
+			case 1:			// remaining length, 1 to 4 bytes
+				MQTTRxBuffer[len++] = MQTTReadByte();
+				avail--;
+				lengthLength = MQTTDecodeLength(MQTTRxBuffer+1, len-1, &length);
+				if(lengthLength == MQTT_LENGTH_MALFORMED) {
+					// No way to find the next frame boundary, give up the connection
+					m_state = 0;
+					MQTTClient.bConnected=FALSE;
+					MQTTResponseCode=MQTT_OPERATION_FAILED;
+					MQTTState=MQTT_CLOSE;
+					return 0;
+					}
+				if(lengthLength) {
+					drop = len + length > MQTT_RX_BUFFER_SIZE;
+					m_state++;
+					}
+				break;
+
+			case 2:			// variable header and payload
+				n = (DWORD)avail < length ? avail : (WORD)length;
+				n = TCPGetArray(MySocket, drop ? NULL : MQTTRxBuffer+len, n);
+				if(!n)
+					return 0;
+				ioBytes += n;
+				MQTT_TRACE(MQTT_TRACE_RX, 0, n);
+				MQTT_CAPTURE(MQTT_CAPTURE_IN, drop ? NULL : MQTTRxBuffer+len, n);
+				avail -= n;
+				length -= n;
+				if(!drop)
+					len += n;
+				break;
+			}
+
+		if(m_state == 2 && length == 0) {
+			m_state = 0;
+			if(drop)
+				return 0; // This will cause the packet to be ignored.
+
+			MQTTFlags.bits.ReceivedSuccessfully=TRUE;
+			rxFrames++;
+			if(llen)
+				*llen = lengthLength;
+			return len;
+			}
+		}
+
+	return 0;
+	}
+
+/*****************************************************************************
+  Function:
+	static BOOL MQTTReceive(void)
+
+  Summary:
+	Reads at most one inbound frame and dispatches it
+
+  Returns:
+	TRUE if a frame was handled
+  ***************************************************************************/
+static BOOL MQTTReceive(void) {
+	BYTE llen;
+	WORD len;
+
+	MQTT_PROF_BEGIN(MQTT_PROF_READ_PACKET);
+	len = MQTTReadPacket(&llen);
+	MQTT_PROF_END(MQTT_PROF_READ_PACKET);
+	if(len == 0)
+		return FALSE;
+
+	lastInActivity = TickGet();
+	MQTT_PROF_BEGIN(MQTT_PROF_DISPATCH);
+	MQTTDispatch(len, llen);
+	MQTT_PROF_END(MQTT_PROF_DISPATCH);
+	return TRUE;
+	}
+
+/*****************************************************************************
+  Function:
+	static void MQTTDispatch(WORD len, BYTE llen)
+
+  Summary:
+	Handles a frame just read into MQTTRxBuffer
+
+  Description:
+	Acknowledges of our own requests move the state machine back to
+	MQTT_IDLE; PUBLISH is handed to the callback and PINGREQ or QOS1
+	PUBLISH are answered right away, without going through MQTTTxBuffer,
+	so replies never disturb a frame under construction.
+
+  Parameters:
+	len - total frame length
+	llen - number of remaining length bytes
+  ***************************************************************************/
+static void MQTTDispatch(WORD len, BYTE llen) {
+	BYTE type = MQTTRxBuffer[0] & 0xF0;
+	BYTE *payload;
+	WORD msgId;
+	WORD tl, i, pl, first;
+	DWORD v;
+	BYTE rc;
+	BOOL lz = FALSE;
+
+	MQTT_TRACE(MQTT_TRACE_FRAME, MQTTRxBuffer[0], len);
+	switch(type) {
+		case MQTTCONNACK:
+			if((MQTTState != MQTT_CONNECT_ACK && !MQTTFlags.bits.ConnAckPending) || len < llen+3)
+				break;
+			rc = MQTTRxBuffer[llen+2];
+			if(MQTTClient.Ver >= MQTT_VERSION_5) {
+				// MQTT 5 reason codes, brought back to the 3.x ones
+				switch(rc) {
+					case 0x84:	rc = 1;		break;	// unsupported protocol version
+					case 0x85:	rc = 2;		break;	// client identifier not valid
+					case 0x88:
+					case 0x89:	rc = 3;		break;	// server unavailable, busy
+					case 0x86:	rc = 4;		break;	// bad user name or password
+					case 0x87:	rc = 5;		break;	// not authorized
 					}
+				aliasMax = 0;
+				if(MQTTGetProperty(MQTTRxBuffer+llen+3, len-llen-3, 0x22, &v))		// Topic Alias Maximum
+					aliasMax = v > MQTT_MAX_TOPIC_ALIAS ? MQTT_MAX_TOPIC_ALIAS : v;
+				}
+			MQTTRttSample(TickGet()-connectSent);
+			switch(rc) {
+				case 0:
+					MQTTFlags.bits.PingOutstanding = FALSE;
+					MQTTClient.bConnected=TRUE;
+					// session present is a 3.1.1 flag, 3.1 brokers leave it 0
+					// and so always get the subscriptions again
+					MQTTClient.bSessionPresent = MQTTRxBuffer[llen+1] & 0x01;
+					if(!MQTTClient.bSessionPresent) {
+						inflightCount = 0;			// the broker forgot them as well
+						MQTTFlags.bits.RestorePending = MQTTClient.bPersistent && subCount > 0;
+						}
+					break;
+				case 1:		// unacceptable protocol version
+					MQTTClient.bConnected=FALSE;		// 
+					MQTTResponseCode=MQTT_BAD_PROTOCOL;
+					break;
+				case 2:		// identifier rejected
+					MQTTClient.bConnected=FALSE;		// 
+					MQTTResponseCode=MQTT_IDENT_REJECTED;
+					break;
+				case 3:		// server unavailable
+					MQTTClient.bConnected=FALSE;		// 
+					MQTTResponseCode=MQTT_SERVER_UNAVAILABLE;
+					break;
+				case 4:		// bad user o password
+					MQTTClient.bConnected=FALSE;		// 
+					MQTTResponseCode=MQTT_BAD_USER_PASW;
+					break;
+				case 5:		// unauthorized
+					MQTTClient.bConnected=FALSE;		// 
+					MQTTResponseCode=MQTT_UNAUTHORIZED;
+					break;
+				default:	// any other MQTT 5 refusal
+					MQTTClient.bConnected=FALSE;
+					MQTTResponseCode=MQTT_CONNECT_ERROR;
+					break;
+				}
+			if(MQTTFlags.bits.ConnAckPending) {
+				MQTTFlags.bits.ConnAckPending = FALSE;
+				MQTTFlush();
+				// Refused: everything pipelined behind the CONNECT is void,
+				// drop the connection
+				if(!MQTTClient.bConnected)
+					MQTTState=MQTT_CLOSE;
 				}
 			else
-				m_state++;
+				MQTTState=MQTT_IDLE;    //go to idle now
 			break;
 
-		case 3:
-			if(TCPIsGetReady(MySocket) >= length) {
-				for(i=start; i<length; i++) {
-					digit = MQTTReadByte();
-					if(MQTTClient.Stream) {
-						if(isPublish && len-*lengthLength-2>skip) {
-							}
-						}
-					if(len < MQTT_MAX_PACKET_SIZE) {
-						MQTTBuffer[len]=digit;
+		case MQTTPUBLISH:
+			tl = MAKEWORD(MQTTRxBuffer[llen+2],MQTTRxBuffer[llen+1]);
+			if(llen+3+tl > len)
+				break;
+			payload = MQTTRxBuffer+llen+3+tl;
+			// msgId only present for QOS>0
+			if((MQTTRxBuffer[0] & 0x06) == MQTTQOS1) {
+				msgId = MAKEWORD(payload[1],payload[0]);
+				payload += 2;
+				// owed if a reply is queued already, so they go in order
+				if(ackOwedCount || MQTTMidFrame() || !MQTTPutControl(MQTTPUBACK,msgId,2))
+					MQTTPubACK(msgId);
+				}
+			if(MQTTClient.Ver >= MQTT_VERSION_5) {
+				// we allow no inbound aliases, of the properties only the
+				// content type is looked at: it tells a compressed payload
+				pl = MQTTProperties(payload, len-(payload-MQTTRxBuffer), &first);
+				if(!pl)
+					break;
+				lz = MQTTGetProperty(payload, pl, 0x03, &v)
+					&& MAKEWORD(payload[v+1],payload[v]) == sizeof(MQTT_LZ_CONTENT_TYPE)-1
+					&& !memcmp(payload+v+2, MQTT_LZ_CONTENT_TYPE, sizeof(MQTT_LZ_CONTENT_TYPE)-1);
+				payload += pl;
+				}
+			if(MQTTClient.m_Callback) {
+				char *topic;
+
+				pl = len-(payload-MQTTRxBuffer);
+				// a payload marked compressed is expanded, it can be no larger
+				// than a frame we take in; one that can't be is dropped
+				if(lz) {
+					i = MQTTLZDecodedSize(payload, pl);
+					if(!i || i > sizeof(lzPlain) || MQTTLZDecode(payload, pl, lzPlain, i) != i)
+						break;
+					payload = lzPlain;
+					pl = i;
+					}
+				topic=malloc(tl+1);
+				for(i=0; i<tl; i++)
+					topic[i] = MQTTRxBuffer[llen+3+i];
+				topic[tl] = 0;
+				MQTTClient.m_Callback(topic,payload,pl);
+				free(topic);
+				}
+			break;
+
+		case MQTTPUBACK:
+			if(len >= llen+3) {
+				msgId = MAKEWORD(MQTTRxBuffer[llen+2],MQTTRxBuffer[llen+1]);
+				if(msgId == pubSentId) {
+					MQTTRttSample(TickGet()-pubSent);
+					pubSentId = 0;
+					}
+				for(i=0; i<inflightCount; i++) {
+					if(inflight[i].Id == msgId) {
+						inflight[i] = inflight[--inflightCount];
+						break;
 						}
-					len++;
 					}
-				m_state++;
 				}
-			//break;
+			if(MQTTState == MQTT_PUBLISH_ACK)
+				MQTTState=MQTT_IDLE;
+			break;
 
-		case 4:
-			m_state=0;
-			if(!MQTTClient.Stream && len > MQTT_MAX_PACKET_SIZE) {
-				len = 0; // This will cause the packet to be ignored.
+		case MQTTSUBACK:
+		case MQTTUNSUBACK:
+			if(len < llen+3)
+				break;
+			pl = 0;
+			if(MQTTClient.Ver >= MQTT_VERSION_5) {
+				pl = MQTTProperties(MQTTRxBuffer+llen+3, len-llen-3, &first);
+				if(!pl)
+					break;
 				}
+			// MQTT 5 UNSUBACK reason codes are not looked at, 0 means unsubscribe
+			MQTTBatchAck(MAKEWORD(MQTTRxBuffer[llen+2],MQTTRxBuffer[llen+1]),
+				MQTTRxBuffer+llen+3+pl, type == MQTTSUBACK ? len-llen-3-pl : 0);
+			break;
 
-			MQTTFlags.bits.ReceivedSuccessfully=len>0;		// boh tanto per...
+		case MQTTPINGREQ:
+			if(MQTTMidFrame() || !MQTTPutControl(MQTTPINGRESP,0,0))
+				MQTTFlags.bits.PingRespOwed = TRUE;		// sent by MQTTPutOwed
+			break;
 
-			return len;
+		case MQTTPINGRESP:
+			if(MQTTFlags.bits.PingOutstanding)
+				MQTTRttSample(TickGet()-pingSent);
+			MQTTFlags.bits.PingOutstanding = FALSE;
 			break;
 		}
-   
-	return len;
 	}
 
+/*****************************************************************************
+  Function:
+	static BOOL MQTTPutControl(BYTE header, WORD msgId, BYTE idLen)
+
+  Summary:
+	Sends a short control frame (PINGREQ, PINGRESP, PUBACK, DISCONNECT...)
+
+  Description:
+	The frame is built on the stack, not in MQTTTxBuffer, and is sent only
+	if it fits the TX FIFO as a whole.
+
+  Parameters:
+	header - fixed header byte
+	msgId - message id, sent if idLen is 2
+	idLen - 0 or 2
+
+  Returns:
+	TRUE if the frame was sent
+  ***************************************************************************/
+static BOOL MQTTPutControl(BYTE header, WORD msgId, BYTE idLen) {
+	BYTE f[4];
+
+	if(TCPIsPutReady(MySocket) < 2+idLen)
+		return FALSE;
+
+	f[0] = header;
+	f[1] = idLen;
+	f[2] = HIBYTE(msgId);
+	f[3] = LOBYTE(msgId);
+	MQTTPutArray(f,2+idLen);
+	lastOutActivity = TickGet();
+	return TRUE;
+	}
+
+// TRUE while a PUBLISH is partly in the TX FIFO: nothing may go in between
+static BOOL MQTTMidFrame(void) {
+
+	return MQTTState == MQTT_PUBLISH_STREAM && pubOffset != 0;
+	}
+
+// Sends the replies MQTTDispatch could not, as far as the TX FIFO allows
+static void MQTTPutOwed(void) {
+	BYTE i;
+
+	if(MQTTFlags.bits.PingRespOwed && MQTTPutControl(MQTTPINGRESP,0,0))
+		MQTTFlags.bits.PingRespOwed = FALSE;
+	for(i=0; i<ackOwedCount && MQTTPutControl(MQTTPUBACK,ackOwed[i],2); i++)
+		;
+	if(i) {
+		ackOwedCount -= i;
+		memmove(ackOwed, ackOwed+i, ackOwedCount*sizeof(WORD));
+		}
+	}
 
 void MQTTCallback(const char *topic, const BYTE *payload, WORD length) {
 
+	(void)topic;
+	(void)payload;
+	(void)length;
+
 	  // handle message arrived - we are only subscribing to one topic so assume all are led related
 /*
     BYTE ledOn[] = {0x6F, 0x6E}; // hex for on
@@ -1254,14 +2007,14 @@ void MQTTCallback(const char *topic, const BYTE *payload, WORD length) {
 BOOL MQTTConnect(const char *id, const char *user, const char *pass, const char *willTopic, BYTE willQos, BYTE willRetain, const char *willMessage) {
 
 	if(MQTTState==MQTT_IDLE) {
-		MQTTClient.ConnectId.szRAM=id;
-		MQTTClient.Username.szRAM=user;
-		MQTTClient.Password.szRAM=pass;
+		MQTTClient.ConnectId.szRAM=(char *)id;
+		MQTTClient.Username.szRAM=(char *)user;
+		MQTTClient.Password.szRAM=(char *)pass;
 		MQTTClient.ServerPort=MQTTClient.bSecure ? MQTT_PORT_SECURE : MQTT_PORT;
-		MQTTClient.WillTopic.szRAM=pass;
+		MQTTClient.WillTopic.szRAM=(char *)willTopic;
 		MQTTClient.WillQOS=willQos;
 		MQTTClient.WillRetain=willRetain;
-		MQTTClient.WillMessage.szRAM=willMessage;
+		MQTTClient.WillMessage.szRAM=(char *)willMessage;
 		MQTTState=MQTT_CONNECT;
 		return 1;
 		}
@@ -1302,7 +2055,7 @@ BOOL MQTTPing(void) {
 
 /*****************************************************************************
   Function:
-	void MQTTPublish(const char *topic, BYTE *payload, WORD plength, BOOL retained)
+	void MQTTPublish(const char *topic, BYTE *payload, DWORD plength, BOOL retained)
 
   Summary:
 	Publishes data for a topic
@@ -1312,6 +2065,11 @@ BOOL MQTTPing(void) {
 	transmission of the message.  Call this function after all the fields
 	in MQTTClient have been set.
 
+	Topic and payload are not copied: they are streamed to the TX FIFO
+	straight from the caller's buffers, which must stay valid until the
+	client is back in MQTT_IDLE.  Payloads up to the MQTT limit are
+	accepted, they just take more passes of MQTTTask.
+
   Precondition:
 	MQTTBeginUsage returned TRUE on a previous call.
 
@@ -1321,15 +2079,26 @@ BOOL MQTTPing(void) {
   Returns:
 	None
   ***************************************************************************/
-BOOL MQTTPublish(const char *topic, const BYTE *payload, WORD plength, BOOL retained) {
+BOOL MQTTPublish(const char *topic, const BYTE *payload, DWORD plength, BOOL retained) {
+
+	// topic length, message id and, for MQTT 5, the most properties we add
+	if(plength > MQTT_MAX_REMAINING_LENGTH - 4 - strlen(topic)
+			- (MQTTClient.Ver >= MQTT_VERSION_5 ? sizeof(pubProps) : 0))
+		return 0;
+
+	if(MQTTFlags.bits.ResendPending)
+		return 0;			// the kept session comes first
 
 	//solo per ROM ovvero per C30!
 	if(MQTTState==MQTT_IDLE) {
 		if(MQTTClient.bConnected) {
-			MQTTClient.Topic.szRAM=topic;
-			MQTTClient.Payload.szRAM=payload;
+			MQTTClient.Topic.szRAM=(char *)topic;
+			MQTTClient.Payload.szRAM=(BYTE *)payload;
 			MQTTClient.Plength=plength;
 			MQTTClient.Retained=retained;
+			MQTTClient.m_Producer=NULL;
+			pubCompressed=FALSE;
+			pubDupId=0;
 			MQTTState=MQTT_PUBLISH;
 			return 1;
 			}
@@ -1339,37 +2108,124 @@ BOOL MQTTPublish(const char *topic, const BYTE *payload, WORD plength, BOOL reta
 
 /*****************************************************************************
   Function:
-	void MQTTPubACK(WORD id)
+	BOOL MQTTPublishProducer(const char *topic, DWORD plength, 
+		WORD (*producer)(BYTE *, WORD, DWORD), BOOL retained)
 
   Summary:
-	Replies to Publish if needed
+	Publishes a payload generated on the fly
 
   Description:
-	This function starts the state machine that performs the actual
-	transmission of the message.  Call this function after all the fields
-	in MQTTClient have been set.
+	Like MQTTPublish, but the payload is never held in RAM as a whole.
+	The remaining length is written up front from plength; then, as TX
+	FIFO space becomes available, MQTTTask calls
+		producer(buf, len, offset)
+	to fill buf with up to len bytes of payload starting at offset.  The
+	producer returns how many bytes it wrote, 0 if it has nothing ready
+	yet (it is then called again on a later pass).  It must eventually
+	deliver exactly plength bytes.
 
   Precondition:
 	MQTTBeginUsage returned TRUE on a previous call.
 
   Parameters:
-	None
+	topic - topic to publish to
+	plength - total payload length
+	producer - payload source, see above
+	retained - retain flag
 
   Returns:
-	None
+	TRUE if the publish was started
   ***************************************************************************/
-BOOL MQTTPubACK(WORD id) {
+BOOL MQTTPublishProducer(const char *topic, DWORD plength, WORD (*producer)(BYTE *, WORD, DWORD), BOOL retained) {
 
-	if(MQTTState==MQTT_IDLE) {
-		if(MQTTClient.bConnected) {
-			MQTTClient.MsgId=id;			// uso questo, anche per loop()... (v.)
-			MQTTState=MQTT_PUBACK;
-			return 1;
-			}
+	if(MQTTPublish(topic, NULL, plength, retained)) {
+		MQTTClient.m_Producer=producer;
+		return 1;
 		}
 	return 0;
 	}
 
+// MQTTPublishCompressed payload source: the encoder output is sequential,
+// as MQTTPutPublish asks for it, so offset is always where it stands
+static WORD MQTTLZProducer(BYTE *buf, WORD len, DWORD offset) {
+
+	(void)offset;
+	return MQTTLZEncode(&pubLZ, buf, len);
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTPublishCompressed(const char *topic, const BYTE *payload, 
+		WORD plength, BOOL retained)
+
+  Summary:
+	Publishes a payload compressed with MQTTLZ
+
+  Description:
+	The payload is compressed once to know its size, then again while it
+	is streamed to the TX FIFO, so no output buffer is needed.  Receivers
+	recognize it by its MQTT 5 content type, MQTT_LZ_CONTENT_TYPE; this
+	client expands it before calling m_Callback.  Under MQTT 3.1.1 there
+	is nowhere to mark it, and a payload that would not shrink is no
+	better off compressed: both are sent as they are.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Parameters:
+	topic - topic to publish to
+	payload - data to compress, untouched until MQTTIsIdle
+	plength - its length
+	retained - retain flag
+
+  Returns:
+	TRUE if the publish was started
+  ***************************************************************************/
+BOOL MQTTPublishCompressed(const char *topic, const BYTE *payload, WORD plength, BOOL retained) {
+	DWORD size;
+
+	if(MQTTState!=MQTT_IDLE || !MQTTClient.bConnected)
+		return 0;
+	size = MQTTClient.Ver >= MQTT_VERSION_5 ? MQTTLZCompressedSize(payload, plength) : plength;
+	if(size + 3+sizeof(MQTT_LZ_CONTENT_TYPE)-1 >= plength)
+		return MQTTPublish(topic, payload, plength, retained);
+	MQTTLZEncodeBegin(&pubLZ, payload, plength);
+	if(!MQTTPublishProducer(topic, size, MQTTLZProducer, retained))
+		return 0;
+	pubCompressed = TRUE;
+	return 1;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTPubACK(WORD id)
+
+  Summary:
+	Acknowledges a QOS1 Publish
+
+  Description:
+	The PUBACK goes out as soon as the TX FIFO has room and no PUBLISH is
+	half written, whatever the state of the client.  MQTTDispatch uses it
+	for inbound QOS1 frames it cannot answer on the spot.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Parameters:
+	id - message id of the Publish
+
+  Returns:
+	TRUE if the ack is queued; FALSE if not connected or MQTT_MAX_OWED_ACKS
+	are waiting already, the broker then sends the Publish again
+  ***************************************************************************/
+BOOL MQTTPubACK(WORD id) {
+
+	if(!MQTTClient.bConnected || ackOwedCount >= MQTT_MAX_OWED_ACKS)
+		return 0;
+	ackOwed[ackOwedCount++] = id;
+	return 1;
+	}
+
 /*****************************************************************************
   Function:
 	void MQTTSubscribe(const char topic, BYTE qos)
@@ -1394,17 +2250,486 @@ BOOL MQTTPubACK(WORD id) {
 BOOL MQTTSubscribe(const char *topic, BYTE qos) {
 
 	//solo per ROM ovvero per C30!
-	if(MQTTState==MQTT_IDLE) {
+	if(MQTTState!=MQTT_IDLE)
+		return 0;
+	singleFilter.Topic=topic;
+	singleFilter.QOS=qos;
+	return MQTTSubscribeBatch(&singleFilter, 1);
+	}
+
+// Starts a SUBSCRIBE or UNSUBSCRIBE batch, see MQTTSubscribeBatch
+static BOOL MQTTStartBatch(MQTT_TOPIC_FILTER *filters, BYTE count, BYTE state) {
+	BYTE i;
+
+	if(MQTTState==MQTT_IDLE && count > 0) {
 		if(MQTTClient.bConnected) {
-			MQTTClient.Topic.szRAM=topic;
-			MQTTClient.QOS=qos;
-			MQTTState=MQTT_SUBSCRIBE;
+			for(i=0; i<count; i++)
+				filters[i].Result = MQTT_FILTER_PENDING;
+			batchFilters = filters;
+			batchCount = count;
+			batchNext = 0;
+			MQTTState=state;
 			return 1;
 			}
 		}
 	return 0;
 	}
 
+/*****************************************************************************
+  Function:
+	BOOL MQTTSubscribeBatch(MQTT_TOPIC_FILTER *filters, BYTE count)
+
+  Summary:
+	Subscribes to several topic filters at once
+
+  Description:
+	Packs the filters into as few SUBSCRIBE frames as MQTTTxBuffer allows
+	and matches the SUBACK return codes back to them: each Result is set
+	to MQTT_FILTER_PENDING now, then to the granted QOS or to
+	MQTT_SUBACK_FAILURE.  The client is back in MQTT_IDLE once every
+	filter is acknowledged (with MQTTClient.bPipeline, once every frame
+	is sent; the Results fill in as the acks arrive).  An ack not there
+	within MQTTAckTimeout() fails whatever of the batch is still pending.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Parameters:
+	filters - Topic and QOS of each filter; must stay valid until every
+		Result is known.  With pipelining a new batch may start before
+		the acks of the previous one arrived
+	count - number of filters
+
+  Returns:
+	TRUE if the batch was started
+  ***************************************************************************/
+BOOL MQTTSubscribeBatch(MQTT_TOPIC_FILTER *filters, BYTE count) {
+
+	return MQTTStartBatch(filters, count, MQTT_SUBSCRIBE);
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTUnsubscribeBatch(MQTT_TOPIC_FILTER *filters, BYTE count)
+
+  Summary:
+	Unsubscribes from several topic filters at once
+
+  Description:
+	As MQTTSubscribeBatch, with UNSUBSCRIBE frames.  QOS is not used;
+	Result becomes MQTT_FILTER_DONE when the UNSUBACK arrives.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Parameters:
+	filters - Topic of each filter
+	count - number of filters
+
+  Returns:
+	TRUE if the batch was started
+  ***************************************************************************/
+BOOL MQTTUnsubscribeBatch(MQTT_TOPIC_FILTER *filters, BYTE count) {
+
+	return MQTTStartBatch(filters, count, MQTT_UNSUBSCRIBE);
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTUnsubscribe(const char *topic)
+
+  Summary:
+	Unsubscribes from a topic, a batch of one
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Returns:
+	TRUE if the UNSUBSCRIBE was started
+  ***************************************************************************/
+BOOL MQTTUnsubscribe(const char *topic) {
+
+	if(MQTTState!=MQTT_IDLE)
+		return 0;
+	singleFilter.Topic=topic;
+	return MQTTUnsubscribeBatch(&singleFilter, 1);
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTSessionRestoring(void)
+
+  Summary:
+	Tells if the session is being brought up to date
+
+  Description:
+	With MQTTClient.bPersistent the client connects with clean session
+	off and keeps a table of the filters the broker acknowledged.  If the
+	CONNACK reports that the broker has no session for us any more, the
+	table is sent again as one SUBSCRIBE batch from MQTT_IDLE; MQTTPublish
+	and the other calls that need MQTT_IDLE fail until it is done.
+
+	If instead the broker kept the session, the QOS1 PUBLISHes it never
+	acknowledged are sent again, with DUP set and their own message id,
+	one at a time from MQTT_IDLE.  MQTTPublish fails from the CONNECT
+	until the last one is out.
+
+  Precondition:
+	MQTTBeginUsage returned TRUE on a previous call.
+
+  Returns:
+	TRUE while the resubscription or the resending is pending or in progress
+  ***************************************************************************/
+BOOL MQTTSessionRestoring(void) {
+
+	return MQTTFlags.bits.RestorePending || MQTTFlags.bits.ResendPending ||
+		(batchFilters == subTable && MQTTState >= MQTT_SUBSCRIBE && MQTTState <= MQTT_SUBSCRIBE_ACK);
+	}
+
+/*****************************************************************************
+  Function:
+	void MQTTForgetSession(void)
+
+  Summary:
+	Drops the local copy of the persistent session
+
+  Description:
+	Empties the subscription table and the QOS1 message ids in flight.
+	Called on its own by a clean session CONNECT; the topic strings of
+	the table must stay valid until then, as only the pointers are kept.
+
+  Precondition:
+	None
+  ***************************************************************************/
+void MQTTForgetSession(void) {
+
+	subCount = 0;
+	inflightCount = 0;
+	nextMsgId = 1;
+	}
+
+/*****************************************************************************
+  Function:
+	static BOOL MQTTPutBatchChunk(WORD msgId)
+
+  Summary:
+	Sends the next SUBSCRIBE/UNSUBSCRIBE frame of the batch
+
+  Description:
+	Packs filters from batchNext on into MQTTTxBuffer until the next one
+	would not fit.  A filter too long for the buffer on its own fails
+	with MQTT_SUBACK_FAILURE and is skipped.
+
+  Parameters:
+	msgId - message id of the frame
+
+  Returns:
+	TRUE if a frame was sent (or nothing was left to send)
+  ***************************************************************************/
+static BOOL MQTTPutBatchChunk(WORD msgId) {
+	BOOL sub = MQTTState == MQTT_SUBSCRIBE;
+	WORD length = MQTT_HEADER_RESERVE;
+	BYTE i = batchNext;
+	WORD need;
+
+	MQTTTxBuffer[length++] = HIBYTE(msgId);
+	MQTTTxBuffer[length++] = LOBYTE(msgId);
+	if(MQTTClient.Ver >= MQTT_VERSION_5)
+		MQTTTxBuffer[length++] = 0;		// no properties
+	while(i < batchCount) {
+		need = 2 + strlen(batchFilters[i].Topic) + (sub ? 1 : 0);
+		if(length + need > MQTT_TX_BUFFER_SIZE) {
+			if(i > batchNext)
+				break;
+			batchFilters[i].Result = MQTT_SUBACK_FAILURE;		// can never fit
+			MQTTResponseCode=MQTT_OPERATION_FAILED;
+			batchNext = ++i;
+			continue;
+			}
+		length = MQTTWriteString(batchFilters[i].Topic, MQTTTxBuffer, length);
+		if(sub)
+			MQTTTxBuffer[length++] = batchFilters[i].QOS;
+		i++;
+		}
+	if(i == batchNext)
+		return TRUE;
+
+	if(!MQTTWrite((sub ? MQTTSUBSCRIBE : MQTTUNSUBSCRIBE) | MQTTQOS1,MQTTTxBuffer,length-MQTT_HEADER_RESERVE))
+		return FALSE;			// TX FIFO full, packed again next pass
+
+	batchChunks[batchChunksOut].MsgId = msgId;
+	batchChunks[batchChunksOut].First = batchFilters + batchNext;
+	batchChunks[batchChunksOut].Count = i - batchNext;
+	batchChunks[batchChunksOut].Sent = TickGet();
+	batchChunksOut++;
+	batchNext = i;
+	return TRUE;
+	}
+
+/*****************************************************************************
+  Function:
+	static void MQTTBatchAck(WORD msgId, const BYTE *codes, WORD n)
+
+  Summary:
+	Matches a SUBACK/UNSUBACK to the filters of its frame
+
+  Parameters:
+	msgId - message id of the ack
+	codes - SUBACK return codes, one per filter
+	n - number of return codes (0 for UNSUBACK)
+  ***************************************************************************/
+static void MQTTBatchAck(WORD msgId, const BYTE *codes, WORD n) {
+	BYTE c, i;
+	MQTT_TOPIC_FILTER *f;
+
+	for(c=0; c<batchChunksOut; c++) {
+		if(batchChunks[c].MsgId != msgId)
+			continue;
+
+		f = batchChunks[c].First;
+		for(i=0; i<batchChunks[c].Count; i++, f++) {
+			if(!n)
+				f->Result = MQTT_FILTER_DONE;
+			else
+				f->Result = i < n && codes[i] < 0x80 ? codes[i] : MQTT_SUBACK_FAILURE;
+			if(f->Result == MQTT_SUBACK_FAILURE)
+				MQTTResponseCode=MQTT_OPERATION_FAILED;
+			if(MQTTClient.bPersistent)
+				MQTTSubTableSet(f, n && f->Result != MQTT_SUBACK_FAILURE);
+			}
+		batchChunks[c] = batchChunks[--batchChunksOut];
+		return;
+		}
+	}
+
+/*****************************************************************************
+  Function:
+	static void MQTTBatchExpire(void)
+
+  Summary:
+	Gives up the batch once a SUBACK/UNSUBACK is overdue
+
+  Description:
+	Every frame in flight and every filter not sent yet fails with
+	MQTT_SUBACK_FAILURE, a late ack is then ignored.  The subscription
+	table is left alone: a lost session is resubscribed in full again.
+  ***************************************************************************/
+static void MQTTBatchExpire(void) {
+	BYTE c, i;
+	MQTT_TOPIC_FILTER *f;
+
+	for(c=0; c<batchChunksOut; c++)
+		if(TickGet()-batchChunks[c].Sent > MQTTAckTimeout())
+			break;
+	if(c == batchChunksOut)
+		return;
+
+	MQTTRttTimeout();
+	for(c=0; c<batchChunksOut; c++) {
+		f = batchChunks[c].First;
+		for(i=0; i<batchChunks[c].Count; i++, f++)
+			f->Result = MQTT_SUBACK_FAILURE;
+		}
+	batchChunksOut = 0;
+	for(i=batchNext; i<batchCount; i++)
+		batchFilters[i].Result = MQTT_SUBACK_FAILURE;
+	batchNext = batchCount;
+	MQTTResponseCode=MQTT_OPERATION_FAILED;
+	if(MQTTState >= MQTT_SUBSCRIBE && MQTTState <= MQTT_UNSUBSCRIBE_ACK)
+		MQTTState=MQTT_IDLE;
+	}
+
+// Next message id, skipping 0 and any QOS1 PUBLISH still waiting for its
+// PUBACK from an earlier connection of the session
+static WORD MQTTNewMsgId(void) {
+	BYTE i;
+
+	do {
+		nextMsgId++;
+		if(nextMsgId == 0)
+			 nextMsgId = 1;
+		for(i=0; i<inflightCount; i++)
+			if(inflight[i].Id == nextMsgId)
+				break;
+		} while(i < inflightCount);
+	return nextMsgId;
+	}
+
+// Starts MQTT_PUBLISH for the next QOS1 PUBLISH of the kept session that
+// was sent on an earlier connection and never acknowledged.  A generated
+// payload can't be asked for again, so that entry is given up.
+// Returns FALSE when none is left.
+static BOOL MQTTResendNext(void) {
+	BYTE i;
+
+	for(i=0; i<inflightCount; ) {
+		if(!inflight[i].Dup) {
+			i++;
+			continue;
+			}
+		inflight[i].Dup = FALSE;
+		if(!inflight[i].Payload && inflight[i].Plength) {
+			inflight[i] = inflight[--inflightCount];
+			continue;
+			}
+		MQTTClient.Topic.szRAM=(char *)inflight[i].Topic;
+		MQTTClient.Payload.szRAM=(BYTE *)inflight[i].Payload;
+		MQTTClient.Plength=inflight[i].Plength;
+		MQTTClient.Retained=inflight[i].Retained;
+		MQTTClient.m_Producer=NULL;
+		MQTTClient.QOS=1;
+		pubCompressed=FALSE;
+		pubDupId=inflight[i].Id;
+		MQTTState=MQTT_PUBLISH;
+		return TRUE;
+		}
+	return FALSE;
+	}
+
+// Adds or updates (keep) or removes a filter of the subscription table.
+// Removed slots only lose their Topic, so that a resubscribe batch running
+// over the table itself is not moved under its feet
+static void MQTTSubTableSet(const MQTT_TOPIC_FILTER *f, BOOL keep) {
+	BYTE i, slot = subCount;
+
+	for(i=0; i<subCount; i++) {
+		if(!subTable[i].Topic) {
+			if(slot == subCount)
+				slot = i;
+			}
+		else if(!strcmp(subTable[i].Topic, f->Topic)) {
+			if(keep)
+				subTable[i].QOS = f->QOS;
+			else
+				subTable[i].Topic = NULL;
+			return;
+			}
+		}
+	if(!keep)
+		return;
+	if(slot >= MQTT_MAX_SUBSCRIPTIONS) {
+		MQTTResponseCode=MQTT_OPERATION_FAILED;		// table full, won't be restored
+		return;
+		}
+	subTable[slot].Topic = f->Topic;
+	subTable[slot].QOS = f->QOS;
+	if(slot == subCount)
+		subCount++;
+	}
+
+// Squeezes out the free slots, returns the filters left
+static BYTE MQTTSubTableCompact(void) {
+	BYTE i, n = 0;
+
+	for(i=0; i<subCount; i++)
+		if(subTable[i].Topic)
+			subTable[n++] = subTable[i];
+	subCount = n;
+	return n;
+	}
+
+// MQTT 5 property list at p (length field included): returns its total
+// size and the offset of the first property, 0 if it overruns avail
+static WORD MQTTProperties(const BYTE *p, WORD avail, WORD *first) {
+	DWORD n;
+	BYTE l;
+
+	l = MQTTDecodeLength(p, avail < 4 ? avail : 4, &n);
+	if(l == 0 || l == MQTT_LENGTH_MALFORMED || l+n > avail)
+		return 0;
+	*first = l;
+	return l+n;
+	}
+
+// Looks for a numeric property in a MQTT 5 property list, for a string
+// or binary one its offset in p; FALSE if it is not there or the list
+// can't be walked
+static BOOL MQTTGetProperty(const BYTE *p, WORD avail, BYTE id, DWORD *value) {
+	WORD i, end, size;
+	DWORD v;
+	BYTE pid;
+
+	end = MQTTProperties(p, avail, &i);
+	while(i < end) {
+		pid = p[i++];
+		v = 0;
+		switch(pid) {
+			case 0x01: case 0x17: case 0x19: case 0x24: case 0x25:
+			case 0x28: case 0x29: case 0x2A:				// byte
+				size = 1;
+				if(i < end)
+					v = p[i];
+				break;
+			case 0x13: case 0x21: case 0x22: case 0x23:		// two byte integer
+				size = 2;
+				if(i+2 <= end)
+					v = MAKEWORD(p[i+1],p[i]);
+				break;
+			case 0x02: case 0x11: case 0x18: case 0x27:		// four byte integer
+				size = 4;
+				if(i+4 <= end)
+					v = ((DWORD)MAKEWORD(p[i+1],p[i]) << 16) | MAKEWORD(p[i+3],p[i+2]);
+				break;
+			case 0x0B:										// variable byte integer
+				size = MQTTDecodeLength(p+i, end-i < 4 ? end-i : 4, &v);
+				if(size == 0 || size == MQTT_LENGTH_MALFORMED)
+					return FALSE;
+				break;
+			case 0x26:										// string pair
+				if(i+2 > end)
+					return FALSE;
+				size = 2 + MAKEWORD(p[i+1],p[i]);
+				if(i+size+2 > end)
+					return FALSE;
+				size += 2 + MAKEWORD(p[i+size+1],p[i+size]);
+				break;
+			case 0x03: case 0x08: case 0x09: case 0x12: case 0x15:
+			case 0x16: case 0x1A: case 0x1C: case 0x1F:		// string, binary data
+				if(i+2 > end)
+					return FALSE;
+				size = 2 + MAKEWORD(p[i+1],p[i]);
+				v = i;
+				break;
+			default:
+				return FALSE;
+			}
+		if(i+size > end)
+			return FALSE;
+		if(pid == id) {
+			*value = v;
+			return TRUE;
+			}
+		i += size;
+		}
+	return FALSE;
+	}
+
+// Topic alias for the next PUBLISH, 0 for none: known tells if the broker
+// already has it, otherwise the topic goes along once to set it up.  The
+// first aliasMax topics keep theirs for the connection, later ones go
+// without: taking one over would cost its topic again each time the two
+// take turns
+static BYTE MQTTTopicAlias(const char *topic, BOOL *known) {
+	BYTE i;
+
+	*known = FALSE;
+	if(!aliasMax || !*topic || strlen(topic) >= MQTT_ALIAS_TOPIC_SIZE)
+		return 0;
+	for(i=0; i<aliasMax; i++) {
+		if(!strcmp(aliasTopic[i], topic)) {
+			*known = TRUE;
+			return i+1;
+			}
+		}
+	for(i=0; i<aliasMax; i++)
+		if(!aliasTopic[i][0])
+			break;
+	if(i == aliasMax)
+		return 0;
+	strcpy(aliasTopic[i], topic);
+	return i+1;
+	}
+
 /*****************************************************************************
   Function:
 	void MQTTDisconnect()
@@ -1443,7 +2768,25 @@ BOOL MQTTStop(void) {
 
 char *GetAsJSONValue(char *buf,const char *n,double v) {
 	
+	MQTT_PROF_BEGIN(MQTT_PROF_JSON_VALUE);
 	sprintf(buf,"{\n  \"d\": {\n    \"Device\": \"PIC\",\n    \"%s\": %4.1f\n    }\n  }\n",n ? n : "value",v);
+	MQTT_PROF_END(MQTT_PROF_JSON_VALUE);
+	return buf;
+	}
+
+// Window summary of a variable, kept compact as it carries four numbers
+char *GetAsJSONStats(char *buf,const char *n,double min,double max,double mean,WORD count) {
+
+	sprintf(buf,"{\"d\":{\"Device\":\"PIC\",\"%s\":{\"min\":%.6g,\"max\":%.6g,\"mean\":%.6g,\"count\":%u}}}",
+		n ? n : "value",min,max,mean,count);
+	return buf;
+	}
+
+// Link parameters chosen by the adaptive client, times in ms
+char *GetAsJSONLink(char *buf,WORD batch,DWORD flush,WORD window,DWORD rtt,BYTE ackRate) {
+
+	sprintf(buf,"{\"d\":{\"Device\":\"PIC\",\"link\":{\"batch\":%u,\"flush\":%lu,\"window\":%u,\"rtt\":%lu,\"ack\":%u}}}",
+		batch,(unsigned long)flush,window,(unsigned long)rtt,ackRate);
 	return buf;
 	}
 
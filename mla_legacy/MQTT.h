@@ -60,12 +60,42 @@
 // MQTT_MAX_PACKET_SIZE : Maximum packet size
 #define MQTT_MAX_PACKET_SIZE 256
 
+// MQTT_MAX_REMAINING_LENGTH : protocol limit of the remaining length field
+#define MQTT_MAX_REMAINING_LENGTH 268435455ul
+// MQTT_HEADER_RESERVE : room left in front of a frame for header + 4 length bytes
+#define MQTT_HEADER_RESERVE 5
+// MQTT_LENGTH_MALFORMED : MQTTDecodeLength result for a field longer than 4 bytes,
+// MQTTEncodeLength result for a length above MQTT_MAX_REMAINING_LENGTH
+#define MQTT_LENGTH_MALFORMED 0xFF
+
+// MQTT_TX_BUFFER_SIZE / MQTT_RX_BUFFER_SIZE : outbound and inbound frame
+// buffers, sized independently (override in TCPIPConfig.h)
+#ifndef MQTT_TX_BUFFER_SIZE
+#define MQTT_TX_BUFFER_SIZE MQTT_MAX_PACKET_SIZE
+#endif
+#ifndef MQTT_RX_BUFFER_SIZE
+#define MQTT_RX_BUFFER_SIZE MQTT_MAX_PACKET_SIZE
+#endif
+
 // MQTT_KEEPALIVE : keepAlive interval in Seconds
 #define MQTT_KEEPALIVE_REALTIME 4
 #define MQTT_KEEPALIVE_SHORT 15
 #define MQTT_KEEPALIVE_LONG 120
 
 #define MQTTPROTOCOLVERSION 3
+// MQTTClient.Ver : protocol level sent in the CONNECT
+#define MQTT_VERSION_3_1	3		// "MQIsdp"
+#define MQTT_VERSION_3_1_1	4		// "MQTT"
+#define MQTT_VERSION_5		5		// "MQTT", with properties and topic aliases
+
+// MQTT_MAX_TOPIC_ALIAS : MQTT 5 topic aliases assigned per connection (the
+// broker may allow fewer), MQTT_ALIAS_TOPIC_SIZE : longest topic aliased + 1
+#ifndef MQTT_MAX_TOPIC_ALIAS
+#define MQTT_MAX_TOPIC_ALIAS 4
+#endif
+#ifndef MQTT_ALIAS_TOPIC_SIZE
+#define MQTT_ALIAS_TOPIC_SIZE 64
+#endif
 #define MQTTCONNECT     1 << 4  // Client request to connect to Server
 #define MQTTCONNACK     2 << 4  // Connect Acknowledgment
 #define MQTTPUBLISH     3 << 4  // Publish message
@@ -106,6 +136,17 @@
     bSecure -       Port (method) to use
     ServerPort -    (WORD value) Indicates the port on which to connect to the
                     remote MQTT server.
+    Ver -           MQTT_VERSION_3_1 (default), MQTT_VERSION_3_1_1 or
+                    MQTT_VERSION_5; with 5 PUBLISH topics are replaced by a
+                    topic alias from the second message on
+    bPipeline -     write CONNECT, SUBSCRIBEs and PUBLISHes back to back and
+                    reconcile CONNACK/SUBACK afterwards
+    bPersistent -   connect without clean session; subscriptions and QOS1
+                    message ids are kept across reconnects.  QOS1 PUBLISHes
+                    not acknowledged are sent again with DUP if the broker
+                    kept the session: their topic and payload must stay
+                    valid until the PUBACK
+    bSessionPresent - set from the CONNACK: the broker still had our session
 
   Remarks:
 
@@ -174,7 +215,7 @@ typedef struct {
 		} ROMPointers;
 #endif	
 
-	WORD Plength;
+	DWORD Plength;
 	BYTE Retained;
 	BYTE WillQOS;
 	BYTE WillRetain;
@@ -187,18 +228,110 @@ typedef struct {
 	BYTE bSecure;
 	BYTE bConnected;
 	BYTE bAvailable;
+	BYTE bPipeline;		// don't wait for CONNACK/SUBACK, see MQTTConnAckPending
+	BYTE bPersistent;		// clean session = 0, see MQTTSessionRestoring
+	BYTE bSessionPresent;
 	FILE *Stream;
 	void (*m_Callback)(const char *,const BYTE *,unsigned int);
+	WORD (*m_Producer)(BYTE *,WORD,DWORD);		// payload source, see MQTTPublishProducer
 	
 	} MQTT_POINTERS;
 
+/****************************************************************************
+  Function:
+      typedef struct MQTT_TOPIC_FILTER
+
+  Summary:
+    One topic filter of a SUBSCRIBE/UNSUBSCRIBE batch
+
+  Parameters:
+    Topic -         topic filter
+    QOS -           requested QOS (subscribe only)
+    Result -        MQTT_FILTER_PENDING until acknowledged, then the granted
+                    QOS or MQTT_SUBACK_FAILURE (subscribe), MQTT_FILTER_DONE
+                    (unsubscribe)
+
+  ***************************************************************************/
+
+typedef struct {
+	const char *Topic;
+	BYTE QOS;
+	BYTE Result;
+	} MQTT_TOPIC_FILTER;
+
+#define MQTT_SUBACK_FAILURE	0x80
+#define MQTT_FILTER_DONE	0x00
+#define MQTT_FILTER_PENDING	0xFE
+
+// MQTT_MAX_BATCH_CHUNKS : SUBSCRIBE/UNSUBSCRIBE frames in flight when pipelining
+#ifndef MQTT_MAX_BATCH_CHUNKS
+#define MQTT_MAX_BATCH_CHUNKS 4
+#endif
+
+// MQTT_MAX_SUBSCRIPTIONS : filters remembered for a persistent session
+#ifndef MQTT_MAX_SUBSCRIPTIONS
+#define MQTT_MAX_SUBSCRIPTIONS 16
+#endif
+// MQTT_MAX_INFLIGHT : QOS1 PUBLISHes waiting for their PUBACK, to send again
+#ifndef MQTT_MAX_INFLIGHT
+#define MQTT_MAX_INFLIGHT 8
+#endif
+// MQTT_MAX_OWED_ACKS : inbound QOS1 PUBLISHes whose PUBACK waits for TX FIFO room
+#ifndef MQTT_MAX_OWED_ACKS
+#define MQTT_MAX_OWED_ACKS 4
+#endif
+
+/****************************************************************************
+  Function:
+      typedef struct MQTT_BUDGET
+
+  Summary:
+    Limits the work done by one MQTTTaskBudget call
+
+  Parameters:
+    Frames -        inbound frames to process, 0 for no limit
+    Bytes -         socket bytes (read + written) to move, 0 for no limit
+    Ticks -         TickGet() time to spend, 0 for no limit
+    Pending -       set on return to the bytes still to move: unread in the
+                    RX FIFO, replies owed and the rest of a PUBLISH
+
+  ***************************************************************************/
+
+typedef struct {
+	WORD Frames;
+	WORD Bytes;
+	DWORD Ticks;
+	WORD Pending;
+	} MQTT_BUDGET;
+
+/****************************************************************************
+  Function:
+      typedef struct MQTT_RTT
+
+  Summary:
+    Round trip estimator state, see MQTTRttSave
+
+  Description:
+    Opaque to the application.  A client that fails over between brokers
+    keeps one per broker, so that each one's ack timeouts follow its own
+    round trips; all zero is an estimator without a sample.
+
+  ***************************************************************************/
+
+typedef struct {
+	DWORD Smoothed;
+	DWORD Var;
+	BYTE Backoff;
+	} MQTT_RTT;
+
 
 /****************************************************************************
   Section:
 	Global MQTT Variables
   ***************************************************************************/
 extern MQTT_POINTERS MQTTClient;
-extern BYTE MQTTBuffer[MQTT_MAX_PACKET_SIZE];
+extern BYTE MQTTTxBuffer[MQTT_TX_BUFFER_SIZE];
+extern BYTE MQTTRxBuffer[MQTT_RX_BUFFER_SIZE];
 extern WORD MQTTResponseCode;
 	
 /****************************************************************************
@@ -209,11 +342,28 @@ extern WORD MQTTResponseCode;
 BOOL MQTTBeginUsage(void);
 WORD MQTTEndUsage(void);
 void MQTTTask(void);
+BOOL MQTTTaskBudget(MQTT_BUDGET *, BOOL (*)(void));
 BOOL MQTTConnect(const char *, const char *, const char *, const char *, BYTE , BYTE , const char *);
 BOOL MQTTIsBusy(void);
-BOOL MQTTPublish(const char *, const BYTE *, WORD , BOOL );
+BOOL MQTTIsIdle(void);
+BOOL MQTTConnAckPending(void);
+BOOL MQTTPubAckPending(void);
+DWORD MQTTAckTimeout(void);
+DWORD MQTTSmoothedRtt(void);
+void MQTTRttSave(MQTT_RTT *);
+void MQTTRttRestore(const MQTT_RTT *);
+void MQTTFlush(void);
+WORD MQTTTxFree(void);
+BOOL MQTTPublish(const char *, const BYTE *, DWORD , BOOL );
+BOOL MQTTPublishProducer(const char *, DWORD , WORD (*)(BYTE *, WORD, DWORD), BOOL );
+BOOL MQTTPublishCompressed(const char *, const BYTE *, WORD , BOOL );
 BOOL MQTTPubACK(WORD);
 BOOL MQTTSubscribe(const char *, BYTE);
+BOOL MQTTSubscribeBatch(MQTT_TOPIC_FILTER *, BYTE);
+BOOL MQTTUnsubscribe(const char *);
+BOOL MQTTUnsubscribeBatch(MQTT_TOPIC_FILTER *, BYTE);
+BOOL MQTTSessionRestoring(void);
+void MQTTForgetSession(void);
 BOOL MQTTPing(void);
 BOOL MQTTDisconnect(void);
 BOOL MQTTStop(void);
@@ -221,9 +371,11 @@ BOOL MQTTStop(void);
 void MQTTCallback(const char *, const BYTE *, WORD );
 
 
-BOOL MQTTWrite(BYTE , BYTE *, WORD );
+BOOL MQTTWrite(BYTE , BYTE *, DWORD );
 WORD MQTTWriteString(const char *, BYTE *, WORD );
-WORD MQTTReadPacket();  //BYTE *
+BYTE MQTTEncodeLength(DWORD, BYTE *);
+BYTE MQTTDecodeLength(const BYTE *, BYTE, DWORD *);
+WORD MQTTReadPacket(BYTE *);
 BOOL MQTTPut(BYTE c);
 WORD MQTTPutArray(BYTE *Data, WORD Len);
 WORD MQTTPutString(BYTE *Data);
@@ -247,5 +399,7 @@ BOOL MQTTConnected(void);
 
 
 char *GetAsJSONValue(char *buf,const char *n,double v);
+char *GetAsJSONStats(char *buf,const char *n,double min,double max,double mean,WORD count);
+char *GetAsJSONLink(char *buf,WORD batch,DWORD flush,WORD window,DWORD rtt,BYTE ackRate);
 
 #endif
@@ -0,0 +1,162 @@
+/*********************************************************************
+ *
+ *	MQTT wire capture
+ *	Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTCapture.c
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ ********************************************************************/
+#define __MQTTCAPTURE_C
+
+#include "TCPIPConfig.h"
+
+
+#if defined(STACK_USE_MQTT_CLIENT)
+
+#include "TCPIP Stack/TCPIP.h"
+#include "TCPIP Stack/MQTTCapture.h"
+
+#if MQTT_CAPTURE_SIZE
+
+// Written from the main loop only (MQTTTask)
+static BYTE capBuf[MQTT_CAPTURE_SIZE];
+static DWORD capLen;
+static DWORD capLast;					// start of the last record, it may still grow
+static DWORD capTick;					// TickGet() of the last record
+static BOOL capOn, capFull;
+
+
+/*****************************************************************************
+  Function:
+	void MQTTCaptureStart(void)
+
+  Summary:
+	Throws away what was captured and starts again
+  ***************************************************************************/
+void MQTTCaptureStart(void) {
+
+	capTick = TickGet();
+	capBuf[0] = 'M';
+	capBuf[1] = 'Q';
+	capBuf[2] = 'C';
+	capBuf[3] = 'P';
+	capBuf[4] = MQTT_CAPTURE_VERSION;
+	capBuf[5] = (BYTE)(TICK_SECOND >> 24);
+	capBuf[6] = (BYTE)(TICK_SECOND >> 16);
+	capBuf[7] = (BYTE)(TICK_SECOND >> 8);
+	capBuf[8] = (BYTE)TICK_SECOND;
+	capBuf[9] = (BYTE)(capTick >> 24);
+	capBuf[10] = (BYTE)(capTick >> 16);
+	capBuf[11] = (BYTE)(capTick >> 8);
+	capBuf[12] = (BYTE)capTick;
+	capLen = MQTT_CAPTURE_HEADER;
+	capLast = 0;
+	capFull = FALSE;
+	capOn = TRUE;
+	}
+
+void MQTTCaptureStop(void) {
+
+	capOn = FALSE;
+	}
+
+// TRUE once a record did not fit, capturing stopped there
+BOOL MQTTCaptureFull(void) {
+
+	return capFull;
+	}
+
+/*****************************************************************************
+  Function:
+	void MQTTCaptureRecord(BYTE dir, const BYTE *data, WORD len)
+
+  Summary:
+	Adds a socket read or write to the capture
+
+  Description:
+	Use MQTT_CAPTURE, which compiles to nothing with MQTT_CAPTURE_SIZE 0.
+	Byte by byte reads (MQTTReadByte) are merged into one record as long
+	as the tick does not change.
+
+  Parameters:
+	dir - MQTT_CAPTURE_IN or MQTT_CAPTURE_OUT
+	data - the bytes, NULL for bytes read and dropped
+	len - how many
+  ***************************************************************************/
+void MQTTCaptureRecord(BYTE dir, const BYTE *data, WORD len) {
+	DWORD now = TickGet(), delta, n;
+	WORD old;
+
+	if(!capOn || !len)
+		return;
+	if(!data)
+		dir = MQTT_CAPTURE_SKIPPED;
+
+	// same direction, same tick: grow the last record
+	if(capLast && capBuf[capLast] == dir && now == capTick && capBuf[capLast+1] == 0) {
+		old = MAKEWORD(capBuf[capLast+3], capBuf[capLast+2]);
+		if((DWORD)old + len <= 0xFFFF && capLen + (dir == MQTT_CAPTURE_SKIPPED ? 0 : len) <= MQTT_CAPTURE_SIZE) {
+			old += len;
+			capBuf[capLast+2] = HIBYTE(old);
+			capBuf[capLast+3] = LOBYTE(old);
+			if(dir != MQTT_CAPTURE_SKIPPED) {
+				memcpy(capBuf+capLen, data, len);
+				capLen += len;
+				}
+			return;
+			}
+		}
+
+	n = 1 + 5 + 2 + (dir == MQTT_CAPTURE_SKIPPED ? 0 : len);
+	if(capLen + n > MQTT_CAPTURE_SIZE) {
+		capFull = TRUE;
+		capOn = FALSE;
+		return;
+		}
+	capLast = capLen;
+	capBuf[capLen++] = dir;
+	delta = now - capTick;
+	do {
+		capBuf[capLen++] = (delta & 0x7F) | (delta > 0x7F ? 0x80 : 0);
+		delta >>= 7;
+		} while(delta);
+	capBuf[capLen++] = HIBYTE(len);
+	capBuf[capLen++] = LOBYTE(len);
+	if(dir != MQTT_CAPTURE_SKIPPED) {
+		memcpy(capBuf+capLen, data, len);
+		capLen += len;
+		}
+	capTick = now;
+	}
+
+/*****************************************************************************
+  Function:
+	DWORD MQTTCaptureDump(void (*put)(BYTE))
+
+  Summary:
+	Writes the capture through put, e.g. a UART transmit routine
+
+  Description:
+	Capturing goes on afterwards; stop it first for a consistent copy if
+	the client keeps running while put blocks.
+
+  Parameters:
+	put - called once per byte
+
+  Returns:
+	Bytes written, 0 if MQTTCaptureStart was never called
+  ***************************************************************************/
+DWORD MQTTCaptureDump(void (*put)(BYTE)) {
+	DWORD i, n = capLen;
+
+	for(i=0; i<n; i++)
+		put(capBuf[i]);
+	return n;
+	}
+
+#endif //#if MQTT_CAPTURE_SIZE
+
+#endif //#if defined(STACK_USE_MQTT_CLIENT)
@@ -0,0 +1,51 @@
+/*********************************************************************
+ *
+ *                  MQTT wire capture
+ *									Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTCapture.h
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ *
+ * Capture layout (MQTTCaptureDump), all fields big endian:
+ *   'M' 'Q' 'C' 'P' <version, 1 byte> <ticks per second, 4 bytes>
+ *   <TickGet() at MQTTCaptureStart, 4 bytes>
+ *   then one record per socket read or write, in order:
+ *   <direction, 1 byte> <ticks since the previous record, 1 to 5 bytes,
+ *   7 bits each, low first, bit 7 = more> <length, 2 bytes> <data>
+ * Reads and writes of the same direction in the same tick share a
+ * record.  MQTT_CAPTURE_SKIPPED records carry no data: bytes of an
+ * inbound frame too big for MQTTRxBuffer, read and thrown away.
+ * sim/ReplayMain.c plays a capture back through MQTTReadPacket.
+ ********************************************************************/
+#ifndef __MQTTCAPTURE_H
+#define __MQTTCAPTURE_H
+
+// MQTT_CAPTURE_SIZE : bytes of RAM for the capture, 0 compiles it out.
+// Capturing stops once it is full, the start of a session is what replays
+#ifndef MQTT_CAPTURE_SIZE
+#define MQTT_CAPTURE_SIZE 0
+#endif
+
+#define MQTT_CAPTURE_VERSION	1
+#define MQTT_CAPTURE_HEADER		13
+
+// Record directions
+#define MQTT_CAPTURE_IN			1		// read from the broker
+#define MQTT_CAPTURE_OUT		2		// written to the broker
+#define MQTT_CAPTURE_SKIPPED	3		// read and dropped, length only
+
+#if MQTT_CAPTURE_SIZE
+void MQTTCaptureStart(void);
+void MQTTCaptureStop(void);
+BOOL MQTTCaptureFull(void);
+void MQTTCaptureRecord(BYTE, const BYTE *, WORD);
+DWORD MQTTCaptureDump(void (*)(BYTE));
+#define MQTT_CAPTURE(d,p,n)	MQTTCaptureRecord(d,p,n)
+#else
+#define MQTT_CAPTURE(d,p,n)
+#endif
+
+#endif
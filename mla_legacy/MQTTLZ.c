@@ -0,0 +1,213 @@
+/*********************************************************************
+ *
+ *	MQTT payload compression (LZSS)
+ *	Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTLZ.c
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ ********************************************************************/
+#define __MQTTLZ_C
+
+#include "TCPIPConfig.h"
+
+
+#if defined(STACK_USE_MQTT_CLIENT)
+
+#include "TCPIP Stack/TCPIP.h"
+#include "TCPIP Stack/MQTTLZ.h"
+
+
+/*****************************************************************************
+  Function:
+	void MQTTLZEncodeBegin(MQTT_LZ_ENCODER *e, const BYTE *in, WORD len)
+
+  Summary:
+	Starts compressing a buffer
+
+  Description:
+	The header (marker and original length) is the first thing MQTTLZEncode
+	hands out.  in must stay untouched until the encoder is done with it.
+
+  Parameters:
+	e - encoder state
+	in - data to compress
+	len - its length
+  ***************************************************************************/
+void MQTTLZEncodeBegin(MQTT_LZ_ENCODER *e, const BYTE *in, WORD len) {
+
+	e->In = in;
+	e->InLen = len;
+	e->Pos = 0;
+	e->Group[0] = MQTT_LZ_MAGIC0;
+	e->Group[1] = MQTT_LZ_MAGIC1;
+	e->Group[2] = HIBYTE(len);
+	e->Group[3] = LOBYTE(len);
+	e->GroupLen = MQTT_LZ_HEADER;
+	e->GroupSent = 0;
+	}
+
+// Encodes the next 8 items (fewer at the end of the input) into e->Group
+static void MQTTLZNextGroup(MQTT_LZ_ENCODER *e) {
+	const BYTE *in = e->In;
+	WORD p, l, max, best, bestOff = 0, start;
+	BYTE item, flags = 0;
+
+	e->GroupLen = 1;
+	for(item=0; item<8 && e->Pos < e->InLen; item++) {
+		max = e->InLen - e->Pos;
+		if(max > MQTT_LZ_MAX_MATCH)
+			max = MQTT_LZ_MAX_MATCH;
+		start = e->Pos > MQTT_LZ_WINDOW ? e->Pos - MQTT_LZ_WINDOW : 0;
+		best = 0;
+		// nearest first; a match may run into the bytes it repeats
+		for(p=e->Pos; p-- > start && best < max; ) {
+			for(l=0; l<max && in[p+l] == in[e->Pos+l]; l++)
+				;
+			if(l > best) {
+				best = l;
+				bestOff = e->Pos - p;
+				}
+			}
+		if(best >= MQTT_LZ_MIN_MATCH) {
+			e->Group[e->GroupLen++] = (bestOff-1) >> 4;
+			e->Group[e->GroupLen++] = ((bestOff-1) << 4) | (best - MQTT_LZ_MIN_MATCH);
+			e->Pos += best;
+			}
+		else {
+			flags |= 1 << item;
+			e->Group[e->GroupLen++] = in[e->Pos++];
+			}
+		}
+	e->Group[0] = flags;
+	e->GroupSent = 0;
+	}
+
+/*****************************************************************************
+  Function:
+	WORD MQTTLZEncode(MQTT_LZ_ENCODER *e, BYTE *out, WORD max)
+
+  Summary:
+	Produces the next piece of compressed data
+
+  Parameters:
+	e - encoder state, see MQTTLZEncodeBegin
+	out - where to write
+	max - room at out
+
+  Returns:
+	Bytes written, 0 once everything was produced
+  ***************************************************************************/
+WORD MQTTLZEncode(MQTT_LZ_ENCODER *e, BYTE *out, WORD max) {
+	WORD n = 0;
+
+	while(n < max) {
+		if(e->GroupSent == e->GroupLen) {
+			if(e->Pos >= e->InLen)
+				break;
+			MQTTLZNextGroup(e);
+			}
+		out[n++] = e->Group[e->GroupSent++];
+		}
+	return n;
+	}
+
+/*****************************************************************************
+  Function:
+	DWORD MQTTLZCompressedSize(const BYTE *in, WORD len)
+
+  Summary:
+	Runs the encoder once without output, to know the size up front
+
+  Description:
+	A PUBLISH needs its remaining length before the payload; this costs a
+	second pass of the encoder but no output buffer.
+
+  Returns:
+	Size of the compressed data, header included
+  ***************************************************************************/
+DWORD MQTTLZCompressedSize(const BYTE *in, WORD len) {
+	MQTT_LZ_ENCODER e;
+	DWORD n = MQTT_LZ_HEADER;
+
+	MQTTLZEncodeBegin(&e, in, len);
+	while(e.Pos < e.InLen) {
+		MQTTLZNextGroup(&e);
+		n += e.GroupLen;
+		}
+	return n;
+	}
+
+/*****************************************************************************
+  Function:
+	WORD MQTTLZDecodedSize(const BYTE *in, WORD len)
+
+  Summary:
+	Tells if a payload is compressed, and how big it is once expanded
+
+  Returns:
+	The original length, 0 if in does not start with the marker
+  ***************************************************************************/
+WORD MQTTLZDecodedSize(const BYTE *in, WORD len) {
+
+	if(len < MQTT_LZ_HEADER || in[0] != MQTT_LZ_MAGIC0 || in[1] != MQTT_LZ_MAGIC1)
+		return 0;
+	return MAKEWORD(in[3],in[2]);
+	}
+
+/*****************************************************************************
+  Function:
+	WORD MQTTLZDecode(const BYTE *in, WORD len, BYTE *out, WORD max)
+
+  Summary:
+	Expands a compressed payload
+
+  Parameters:
+	in - compressed data, header included
+	len - its length
+	out - where to expand it
+	max - room at out
+
+  Returns:
+	The expanded length, 0 if in is not valid compressed data or out is
+	too small (an empty payload is never compressed)
+  ***************************************************************************/
+WORD MQTTLZDecode(const BYTE *in, WORD len, BYTE *out, WORD max) {
+	WORD size, i = MQTT_LZ_HEADER, o = 0, off, l;
+	BYTE flags, item;
+
+	size = MQTTLZDecodedSize(in, len);
+	if(!size || size > max)
+		return 0;
+
+	while(o < size) {
+		if(i >= len)
+			return 0;
+		flags = in[i++];
+		for(item=0; item<8 && o<size; item++) {
+			if(flags & (1 << item)) {
+				if(i >= len)
+					return 0;
+				out[o++] = in[i++];
+				}
+			else {
+				if(i+2 > len)
+					return 0;
+				off = (((WORD)in[i] << 4) | (in[i+1] >> 4)) + 1;
+				l = (in[i+1] & 0x0F) + MQTT_LZ_MIN_MATCH;
+				i += 2;
+				if(off > o || o+l > size)
+					return 0;
+				while(l--) {
+					out[o] = out[o-off];
+					o++;
+					}
+				}
+			}
+		}
+	return size;
+	}
+
+#endif //#if defined(STACK_USE_MQTT_CLIENT)
@@ -0,0 +1,68 @@
+/*********************************************************************
+ *
+ *                  MQTT payload compression (LZSS)
+ *									Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTLZ.h
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ *
+ * Compressed payload layout:
+ *   0xFE 'Z' <original length, 2 bytes big endian>
+ *   then groups of a flag byte followed by 8 items, bit 0 first:
+ *   1 = literal byte, 0 = match of 2 bytes
+ *   (12 bits offset-1, 4 bits length-MQTT_LZ_MIN_MATCH)
+ ********************************************************************/
+#ifndef __MQTTLZ_H
+#define __MQTTLZ_H
+
+#define MQTT_LZ_MAGIC0		0xFE		// never the first byte of UTF-8 text
+#define MQTT_LZ_MAGIC1		'Z'
+#define MQTT_LZ_HEADER		4
+#define MQTT_LZ_MIN_MATCH	3
+#define MQTT_LZ_MAX_MATCH	18
+
+// MQTT 5 Content Type of a compressed PUBLISH: only a payload marked so
+// is expanded, whatever its first bytes
+#define MQTT_LZ_CONTENT_TYPE	"application/x-mqttlz"
+
+// MQTT_LZ_WINDOW : how far back the encoder looks for a match (at most
+// 4096).  The window is the payload itself, no RAM is used for it, but
+// the search time grows with it
+#ifndef MQTT_LZ_WINDOW
+#define MQTT_LZ_WINDOW 512
+#endif
+
+/****************************************************************************
+  Function:
+      typedef struct MQTT_LZ_ENCODER
+
+  Summary:
+    State of a compression in progress
+
+  Description:
+    The encoder produces its output a piece at a time, so that it can feed
+    a PUBLISH as TX FIFO space becomes available.  Only the group being
+    emitted is buffered.
+
+  ***************************************************************************/
+
+typedef struct {
+	const BYTE *In;
+	WORD InLen;
+	WORD Pos;				// next input byte to encode
+	BYTE Group[17];			// flag byte + 8 items of up to 2 bytes
+	BYTE GroupLen;
+	BYTE GroupSent;			// bytes of Group already handed out
+	} MQTT_LZ_ENCODER;
+
+
+void MQTTLZEncodeBegin(MQTT_LZ_ENCODER *, const BYTE *, WORD);
+WORD MQTTLZEncode(MQTT_LZ_ENCODER *, BYTE *, WORD);
+DWORD MQTTLZCompressedSize(const BYTE *, WORD);
+WORD MQTTLZDecodedSize(const BYTE *, WORD);
+WORD MQTTLZDecode(const BYTE *, WORD, BYTE *, WORD);
+
+#endif
@@ -0,0 +1,107 @@
+/*********************************************************************
+ *
+ *	MQTT hot path profiling probes
+ *	Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTProf.c
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ ********************************************************************/
+#define __MQTTPROF_C
+
+#include "TCPIPConfig.h"
+
+
+#if defined(STACK_USE_MQTT_CLIENT)
+
+#include "TCPIP Stack/TCPIP.h"
+#include "TCPIP Stack/MQTTProf.h"
+
+#if MQTT_PROFILING
+
+// Probes run from the main loop only (MQTTTask, MQTTClientTask)
+DWORD MQTTProfStart[MQTT_PROF_PROBES];
+
+static struct {
+	DWORD Count;
+	DWORD Min;
+	DWORD Max;
+	QWORD Sum;
+	} profTable[MQTT_PROF_PROBES];
+
+static const char *profNames[MQTT_PROF_PROBES] = {
+	"MQTTReadPacket", "MQTTDispatch", "MQTTWrite", "MQTTWriteString",
+	"MQTTPutArray", "GetAsJSONValue"
+	};
+
+
+/*****************************************************************************
+  Function:
+	void MQTTProfEnd(BYTE probe, DWORD now)
+
+  Summary:
+	Accounts the time since the probe's MQTT_PROF_BEGIN
+
+  Description:
+	Use MQTT_PROF_END, which compiles to nothing with MQTT_PROFILING 0.
+	The counter wraps (about every 107 s for a 80 MHz PIC32); a single
+	call is always far shorter, so the difference stays right.
+
+  Parameters:
+	probe - MQTT_PROF_*
+	now - counter read at the end of the probed code
+  ***************************************************************************/
+void MQTTProfEnd(BYTE probe, DWORD now) {
+	DWORD d = now - MQTTProfStart[probe];
+
+	if(!profTable[probe].Count || d < profTable[probe].Min)
+		profTable[probe].Min = d;
+	if(d > profTable[probe].Max)
+		profTable[probe].Max = d;
+	profTable[probe].Sum += d;
+	profTable[probe].Count++;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL MQTTProfGet(BYTE probe, MQTT_PROF_STAT *s)
+
+  Summary:
+	Reads a probe's figures, in the units of MQTTProf.h
+
+  Parameters:
+	probe - MQTT_PROF_*
+	s - receives name, calls, min, average and max
+
+  Returns:
+	FALSE if probe is out of range
+  ***************************************************************************/
+BOOL MQTTProfGet(BYTE probe, MQTT_PROF_STAT *s) {
+
+	if(probe >= MQTT_PROF_PROBES)
+		return FALSE;
+	s->Name = profNames[probe];
+	s->Count = profTable[probe].Count;
+	s->Min = profTable[probe].Min;
+	s->Max = profTable[probe].Max;
+	s->Avg = s->Count ? (DWORD)(profTable[probe].Sum / s->Count) : 0;
+	return TRUE;
+	}
+
+/*****************************************************************************
+  Function:
+	void MQTTProfReset(void)
+
+  Summary:
+	Clears all probes, e.g. once start-up is over
+  ***************************************************************************/
+void MQTTProfReset(void) {
+
+	memset(profTable, 0, sizeof(profTable));
+	}
+
+#endif //#if MQTT_PROFILING
+
+#endif //#if defined(STACK_USE_MQTT_CLIENT)
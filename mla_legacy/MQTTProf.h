@@ -0,0 +1,74 @@
+/*********************************************************************
+ *
+ *                  MQTT hot path profiling probes
+ *									Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTProf.h
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ *
+ * Counts are core timer ticks on PIC32 (one per 2 system clocks), TSC
+ * cycles on x86 hosts, nanoseconds elsewhere.  A probe's time includes
+ * whatever it calls: MQTT_PROF_DISPATCH covers the MQTTCallback of a
+ * PUBLISH, MQTT_PROF_WRITE covers MQTT_PROF_PUT_ARRAY.
+ ********************************************************************/
+#ifndef __MQTTPROF_H
+#define __MQTTPROF_H
+
+// MQTT_PROFILING : 1 to build the probes in; with 0 they compile to nothing
+#ifndef MQTT_PROFILING
+#define MQTT_PROFILING 0
+#endif
+
+// Probes
+#define MQTT_PROF_READ_PACKET	0		// MQTTReadPacket, called or not a frame is there
+#define MQTT_PROF_DISPATCH		1		// MQTTDispatch, one inbound frame
+#define MQTT_PROF_WRITE			2		// MQTTWrite
+#define MQTT_PROF_WRITE_STRING	3		// MQTTWriteString
+#define MQTT_PROF_PUT_ARRAY		4		// MQTTPutArray, and each TCPPutArray of a streamed PUBLISH
+#define MQTT_PROF_JSON_VALUE	5		// GetAsJSONValue
+#define MQTT_PROF_PROBES		6
+
+typedef struct {
+	const char *Name;
+	DWORD Count;
+	DWORD Min;
+	DWORD Avg;
+	DWORD Max;
+	} MQTT_PROF_STAT;
+
+#if MQTT_PROFILING
+
+#if defined(__C32__) || defined(__PIC32MX__)
+#define MQTT_PROF_NOW()		((DWORD)_CP0_GET_COUNT())
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define MQTT_PROF_NOW()		((DWORD)__rdtsc())
+#else
+#include <time.h>
+static inline DWORD MQTTProfNow(void) {
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (DWORD)t.tv_sec * 1000000000UL + t.tv_nsec;
+	}
+#define MQTT_PROF_NOW()		MQTTProfNow()
+#endif
+
+extern DWORD MQTTProfStart[MQTT_PROF_PROBES];
+
+void MQTTProfEnd(BYTE, DWORD);
+BOOL MQTTProfGet(BYTE, MQTT_PROF_STAT *);
+void MQTTProfReset(void);
+
+// The counter is read before MQTTProfEnd is called, so the call is not timed
+#define MQTT_PROF_BEGIN(p)	(MQTTProfStart[p] = MQTT_PROF_NOW())
+#define MQTT_PROF_END(p)	MQTTProfEnd(p, MQTT_PROF_NOW())
+#else
+#define MQTT_PROF_BEGIN(p)
+#define MQTT_PROF_END(p)
+#endif
+
+#endif
@@ -0,0 +1,162 @@
+/*********************************************************************
+ *
+ *	MQTT event trace recorder
+ *	Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTTrace.c
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ ********************************************************************/
+#define __MQTTTRACE_C
+
+#include "TCPIPConfig.h"
+
+
+#if defined(STACK_USE_MQTT_CLIENT)
+
+#include "TCPIP Stack/TCPIP.h"
+#include "TCPIP Stack/MQTTTrace.h"
+
+#if MQTT_TRACE_SIZE
+
+// The ring is written from the main loop only (MQTTTask, MQTTClientTask)
+static MQTT_TRACE_EVENT traceRing[MQTT_TRACE_SIZE];
+static WORD traceHead;					// next event written
+static WORD traceCount;					// events kept, up to MQTT_TRACE_SIZE
+
+// Dump in progress
+static WORD dumpPos;					// next event read
+static WORD dumpLeft;
+static BOOL dumpHeader;					// header not handed out yet
+
+
+/*****************************************************************************
+  Function:
+	void MQTTTraceRecord(BYTE type, BYTE a, WORD b)
+
+  Summary:
+	Adds an event to the trace, overwriting the oldest once full
+
+  Description:
+	Cheap enough to stay on in production: a tick read and an 8 byte
+	store.  Use MQTT_TRACE, which compiles to nothing with
+	MQTT_TRACE_SIZE 0.
+
+  Parameters:
+	type - MQTT_TRACE_*
+	a, b - event arguments, see MQTT_TRACE_*
+  ***************************************************************************/
+void MQTTTraceRecord(BYTE type, BYTE a, WORD b) {
+	WORD w = traceHead;
+	MQTT_TRACE_EVENT *e = &traceRing[w];
+
+	e->Tick = TickGet();
+	e->Type = type;
+	e->A = a;
+	e->B = b;
+	traceHead = (w + 1) & (MQTT_TRACE_SIZE-1);
+	if(traceCount < MQTT_TRACE_SIZE)
+		traceCount++;
+	else if(dumpLeft && dumpPos == w) {
+		// the dump was overtaken, it goes on from the oldest left
+		dumpPos = traceHead;
+		dumpLeft--;
+		}
+	}
+
+/*****************************************************************************
+  Function:
+	void MQTTTraceBeginDump(void)
+
+  Summary:
+	Starts a dump of the events kept so far
+
+  Description:
+	Recording goes on during the dump; events recorded after this call
+	are left for the next dump, older ones overwritten meanwhile are lost.
+  ***************************************************************************/
+void MQTTTraceBeginDump(void) {
+
+	dumpPos = (traceHead - traceCount) & (MQTT_TRACE_SIZE-1);
+	dumpLeft = traceCount;
+	dumpHeader = TRUE;
+	}
+
+/*****************************************************************************
+  Function:
+	WORD MQTTTraceReadDump(BYTE *buf, WORD max)
+
+  Summary:
+	Hands out the next piece of the dump
+
+  Description:
+	The header first, then whole events, in the layout of MQTTTrace.h.
+
+  Parameters:
+	buf - where to write
+	max - room at buf
+
+  Returns:
+	Bytes written, 0 once the dump is complete
+  ***************************************************************************/
+WORD MQTTTraceReadDump(BYTE *buf, WORD max) {
+	MQTT_TRACE_EVENT *e;
+	WORD n = 0;
+
+	if(dumpHeader) {
+		if(max < MQTT_TRACE_HEADER)
+			return 0;
+		buf[0] = 'M';
+		buf[1] = 'Q';
+		buf[2] = 'T';
+		buf[3] = 'R';
+		buf[4] = MQTT_TRACE_VERSION;
+		buf[5] = MQTT_TRACE_EVENT_SIZE;
+		buf[6] = (BYTE)(TICK_SECOND >> 24);
+		buf[7] = (BYTE)(TICK_SECOND >> 16);
+		buf[8] = (BYTE)(TICK_SECOND >> 8);
+		buf[9] = (BYTE)TICK_SECOND;
+		n = MQTT_TRACE_HEADER;
+		dumpHeader = FALSE;
+		}
+	while(dumpLeft && max - n >= MQTT_TRACE_EVENT_SIZE) {
+		e = &traceRing[dumpPos];
+		buf[n++] = (BYTE)(e->Tick >> 24);
+		buf[n++] = (BYTE)(e->Tick >> 16);
+		buf[n++] = (BYTE)(e->Tick >> 8);
+		buf[n++] = (BYTE)e->Tick;
+		buf[n++] = e->Type;
+		buf[n++] = e->A;
+		buf[n++] = HIBYTE(e->B);
+		buf[n++] = LOBYTE(e->B);
+		dumpPos = (dumpPos + 1) & (MQTT_TRACE_SIZE-1);
+		dumpLeft--;
+		}
+	return n;
+	}
+
+/*****************************************************************************
+  Function:
+	void MQTTTraceDump(void (*put)(BYTE))
+
+  Summary:
+	Writes a whole dump through put, e.g. a UART transmit routine
+
+  Parameters:
+	put - called once per byte
+  ***************************************************************************/
+void MQTTTraceDump(void (*put)(BYTE)) {
+	BYTE chunk[MQTT_TRACE_HEADER+MQTT_TRACE_EVENT_SIZE];
+	WORD i, n;
+
+	MQTTTraceBeginDump();
+	while((n = MQTTTraceReadDump(chunk, sizeof(chunk))) != 0)
+		for(i=0; i<n; i++)
+			put(chunk[i]);
+	}
+
+#endif //#if MQTT_TRACE_SIZE
+
+#endif //#if defined(STACK_USE_MQTT_CLIENT)
@@ -0,0 +1,57 @@
+/*********************************************************************
+ *
+ *                  MQTT event trace recorder
+ *									Module for Microchip TCP/IP Stack
+ *
+ *********************************************************************
+ * FileName:        MQTTTrace.h
+ * Dependencies:    none
+ * Processor:       PIC32
+ * Compiler:        Microchip C32 v1.05 or higher
+ *
+ * Dump layout (MQTTTraceReadDump), all fields big endian:
+ *   'M' 'Q' 'T' 'R' <version, 1 byte> <event size, 1 byte>
+ *   <ticks per second, 4 bytes>
+ *   then the events, oldest first:
+ *   <TickGet(), 4 bytes> <type, 1 byte> <a, 1 byte> <b, 2 bytes>
+ * tools/mqtttrace2json.c turns a dump into Chrome/Perfetto trace JSON.
+ ********************************************************************/
+#ifndef __MQTTTRACE_H
+#define __MQTTTRACE_H
+
+// MQTT_TRACE_SIZE : events kept, a power of two; 0 compiles the recorder
+// out.  Each event takes 8 bytes of RAM
+#ifndef MQTT_TRACE_SIZE
+#define MQTT_TRACE_SIZE 128
+#endif
+
+#define MQTT_TRACE_VERSION		2		// 2: MQTT_PING_ACK and MQTT_PUBACK states gone
+#define MQTT_TRACE_HEADER		10
+#define MQTT_TRACE_EVENT_SIZE	8
+
+// Event types: a and b as given
+#define MQTT_TRACE_STATE		1		// MQTTTask state: new state, MQTTResponseCode
+#define MQTT_TRACE_CLIENT		2		// MQTTClientTask state: new state, MQTTResponseCode
+#define MQTT_TRACE_RX			3		// socket read: 0, bytes
+#define MQTT_TRACE_TX			4		// socket write: 0, bytes
+#define MQTT_TRACE_FRAME		5		// inbound frame: fixed header, length
+#define MQTT_TRACE_MARK			6		// application defined
+
+typedef struct {
+	DWORD Tick;
+	BYTE Type;
+	BYTE A;
+	WORD B;
+	} MQTT_TRACE_EVENT;
+
+#if MQTT_TRACE_SIZE
+void MQTTTraceRecord(BYTE, BYTE, WORD);
+void MQTTTraceBeginDump(void);
+WORD MQTTTraceReadDump(BYTE *, WORD);
+void MQTTTraceDump(void (*)(BYTE));
+#define MQTT_TRACE(t,a,b)	MQTTTraceRecord(t,a,b)
+#else
+#define MQTT_TRACE(t,a,b)
+#endif
+
+#endif
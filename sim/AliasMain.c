@@ -0,0 +1,154 @@
+/*********************************************************************
+ *
+ *                  MQTT 5 topic alias savings
+ *
+ *********************************************************************
+ * FileName:        AliasMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c, MQTTclient.c
+ * Processor:       host
+ *
+ * Publishes over MQTT 5 to a few long topics, as the IBM samples do,
+ * with the simulated broker granting -a topic aliases, and reports the
+ * topic bytes the aliases kept off the link.  The broker resolves every
+ * alias; the exit status is 2 if a message fails, lands on the wrong
+ * topic, or uses an alias the broker does not know, or if the aliases
+ * cost more bytes than they saved, as they would taken over in turn by
+ * more topics than there are aliases (-k above -a).
+ *
+ * Aliases only live as long as the connection and none is granted
+ * before the CONNACK, so a pipelined session writes the PUBLISHes that
+ * fit in the TX FIFO behind the CONNECT with the full topic; only those
+ * sent once the CONNACK is in go as aliases.  -t shows the difference.
+ *
+ *   make -C sim mqttalias
+ *   sim/mqttalias -n 10000 -k 3 -a 4 -p -b 8 -t 128
+ *   sim/mqttalias -n 10000 -k 3 -a 0 -p -b 8 -t 128		the same without aliases
+ ********************************************************************/
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "MQTTclient.h"
+#include "SimStack.h"
+
+#define ALIAS_POOL			64
+#define ALIAS_TOPICS		16
+#define ALIAS_MS			(TICK_SECOND/1000)
+
+static char aliasPayload[ALIAS_POOL][24];
+static char aliasTopic[ALIAS_TOPICS][MQTT_ALIAS_TOPIC_SIZE];
+static DWORD topics = 3;
+static DWORD outstanding, delivered, failed, arrived, misrouted;
+
+
+static void AliasArrived(const char *topic, const BYTE *payload, WORD len) {
+	char num[12];
+	WORD i;
+
+	if(len < 5 || memcmp(payload, "seq=", 4))
+		return;
+	for(i=0; i+4 < len && i < sizeof(num)-1; i++)
+		num[i] = payload[i+4];
+	num[i] = 0;
+	if(strcmp(topic, aliasTopic[strtoul(num, NULL, 10) % topics]))
+		misrouted++;
+	arrived++;
+	}
+
+static void AliasDone(const MQTT_COMPLETION *c) {
+
+	outstanding--;
+	if(c->Result == MQTT_SUCCESS)
+		delivered++;
+	else
+		failed++;
+	}
+
+static void AliasUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttalias [options]\n"
+		"  -n N     messages (10000)\n"
+		"  -k N     topics, in turn (3, at most 16)\n"
+		"  -a N     topic aliases the broker grants (4, 0 = none)\n"
+		"  -b N     messages kept queued (8)\n"
+		"  -d ms    one way delay (20)\n"
+		"  -t N     client TX FIFO bytes (512)\n"
+		"  -p       pipelining, so a connection carries more than one\n"
+		"  -x       fail unless the aliases saved bytes\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	SIM_LINK link;
+	const SIM_STATS *st;
+	DWORD messages = 10000, burst = 8, queued = 0, slot, end, i;
+	long saved;
+	BOOL pipelining = FALSE, expectSaving = FALSE, ok;
+	int c;
+
+	memset(&link, 0, sizeof(link));
+	link.Delay = 20*ALIAS_MS;
+	link.Rto = 200*ALIAS_MS;
+	link.TxFifo = 512;
+	link.RxFifo = 512;
+	link.Seed = 1;
+	link.AliasMax = 4;
+	link.OnPublish = AliasArrived;
+	while((c = getopt(argc, argv, "n:k:a:b:d:t:px")) != -1) {
+		switch(c) {
+			case 'n':	messages = strtoul(optarg, NULL, 10);			break;
+			case 'k':	topics = strtoul(optarg, NULL, 10);				break;
+			case 'a':	link.AliasMax = atoi(optarg);					break;
+			case 'b':	burst = strtoul(optarg, NULL, 10);				break;
+			case 'd':	link.Delay = strtoul(optarg, NULL, 10)*ALIAS_MS;	break;
+			case 't':	link.TxFifo = atoi(optarg);						break;
+			case 'p':	pipelining = TRUE;								break;
+			case 'x':	expectSaving = TRUE;							break;
+			default:	AliasUsage();
+			}
+		}
+	if(!topics || topics > ALIAS_TOPICS || !burst || burst > 16)
+		AliasUsage();
+	for(i=0; i<topics; i++)
+		sprintf(aliasTopic[i], "iot-2/type/simdevice/id/sim%02u/evt/status/fmt/json", i);
+
+	SimInit(&link);
+	MqttClientInit();
+	MqttSetPipelining(pipelining);
+	MqttSetProtocolVersion(MQTT_VERSION_5);
+	while(delivered + failed < messages) {
+		while(queued < messages && outstanding < burst) {
+			slot = queued % ALIAS_POOL;
+			sprintf(aliasPayload[slot], "seq=%u", queued);
+			if(MqttQueueMsgWithCallback((byte*)aliasPayload[slot], (byte*)aliasTopic[queued % topics], (byte*)"simclient",
+				NULL, NULL, NULL, AliasDone) >= MQTT_QUEUE_FULL)
+				break;
+			queued++;
+			outstanding++;
+			}
+		MQTTClientTask();
+		MQTTTask();
+		SimPass(10*ALIAS_MS);
+		}
+	// the last PUBLISH may still be on the wire
+	for(end = TickGet(); arrived < delivered && TickGet() - end < TICK_SECOND; SimPass(10*ALIAS_MS)) {
+		MQTTClientTask();
+		MQTTTask();
+		}
+
+	st = SimGetStats();
+	saved = (long)st->AliasedBytes - (long)st->AliasBytes;
+	printf("messages      %u delivered, %u failed, %u reached the broker, %u on the wrong topic\n",
+		delivered, failed, arrived, misrouted);
+	printf("link          %u connects, %u publishes, %u bytes up, %u frames a broker would reject\n",
+		st->Connects, st->Publishes, st->BytesUp, st->Malformed);
+	printf("topics        %u bytes sent, %u left out for aliases, %u bytes of alias properties\n",
+		st->TopicBytes, st->AliasedBytes, st->AliasBytes);
+	printf("saved         %ld bytes, %.1f per message, %.1f%% of the upstream bytes\n",
+		saved, (double)saved / messages, 100.0 * saved / (st->BytesUp + saved));
+
+	ok = !failed && arrived == delivered && !misrouted && !st->Malformed && saved >= 0 && (!expectSaving || saved > 0);
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 2;
+	}
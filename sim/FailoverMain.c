@@ -0,0 +1,194 @@
+/*********************************************************************
+ *
+ *                  MQTT broker failover test
+ *
+ *********************************************************************
+ * FileName:        FailoverMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c, MQTTclient.c
+ * Processor:       host
+ *
+ * Gives the client a list of brokers, each a SimAddBroker stand-in: the
+ * primary (broker.sim, the one MqttClientInit adds), one that refuses
+ * every CONNECT, a slower backup and a far one.  Publishes at a steady
+ * rate while the primary goes down (-D s) and comes back (-U s), and
+ * reports where the messages went, how long the failover took and how
+ * long the client stayed away from the primary once it was back: a
+ * broker that failed is held down for MQTT_KEEPALIVE_LONG seconds.
+ * The exit status is 2 if a message is lost, the client settles on the
+ * wrong broker or does not go back to the primary once its hold is over,
+ * or the failover takes longer than -m ms.
+ *
+ *   make -C sim mqttfailover
+ *   sim/mqttfailover -T 400 -D 60 -U 120 -m 2000
+ ********************************************************************/
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "MQTTclient.h"
+#include "SimStack.h"
+
+#define FAIL_POOL			64
+#define FAIL_MS				(TICK_SECOND/1000)
+#define FAIL_HOLD			((MQTT_KEEPALIVE_LONG+5)*TICK_SECOND)	// the client's hold down, and the session that hit it
+
+enum { PRIMARY, REFUSING, BACKUP, FAR, BROKERS };
+
+static SIM_BROKER failBroker[BROKERS] = {
+	{ "broker.sim",	20*FAIL_MS,		0,		FALSE,	0, 0 },
+	{ "refuse.sim",	5*FAIL_MS,		100,	FALSE,	0, 0 },
+	{ "backup.sim",	60*FAIL_MS,		0,		FALSE,	0, 0 },
+	{ "far.sim",	150*FAIL_MS,	0,		FALSE,	0, 0 },
+	};
+static BYTE failIndex[BROKERS];			// SimAddBroker index of each
+
+static char failPayload[FAIL_POOL][24];
+static DWORD outstanding, delivered, failed, arrived, refused;
+
+
+static void FailArrived(const char *topic, const BYTE *payload, WORD len) {
+
+	(void)topic;
+	(void)payload;
+	(void)len;
+	arrived++;
+	}
+
+static void FailDone(const MQTT_COMPLETION *c) {
+
+	outstanding--;
+	if(c->Result == MQTT_SUCCESS)
+		delivered++;
+	else
+		failed++;
+	}
+
+// Publishes each stand-in has taken so far
+static void FailCount(DWORD *n) {
+	BYTE i;
+
+	for(i=0; i<BROKERS; i++)
+		n[i] = SimBroker(failIndex[i])->Publishes;
+	}
+
+static void FailUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttfailover [options]\n"
+		"  -T s     run time (400)\n"
+		"  -D s     primary down at (60)\n"
+		"  -U s     primary up again at (120)\n"
+		"  -e ms    one message every (200)\n"
+		"  -R N     attempts per message (4)\n"
+		"  -p       pipelining\n"
+		"  -m ms    fail if the failover took longer (no limit)\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	SIM_LINK link;
+	const MQTT_BROKER_STATS *bs;
+	DWORD runFor = 400, downAt = 60, upAt = 120, every = 200*FAIL_MS, limit = 0, next = 0, slot, end;
+	DWORD queued = 0, seen[BROKERS], last[BROKERS], before[BROKERS], failoverAt = 0, backAt = 0, backBy;
+	BYTE attempts = 4, i;
+	BOOL pipelining = FALSE, ok;
+	int c;
+
+	memset(&link, 0, sizeof(link));
+	link.Delay = 20*FAIL_MS;
+	link.Rto = 200*FAIL_MS;
+	link.TxFifo = 512;
+	link.RxFifo = 512;
+	link.Seed = 1;
+	link.OnPublish = FailArrived;
+	while((c = getopt(argc, argv, "T:D:U:e:R:pm:")) != -1) {
+		switch(c) {
+			case 'T':	runFor = strtoul(optarg, NULL, 10);				break;
+			case 'D':	downAt = strtoul(optarg, NULL, 10);				break;
+			case 'U':	upAt = strtoul(optarg, NULL, 10);				break;
+			case 'e':	every = strtoul(optarg, NULL, 10)*FAIL_MS;		break;
+			case 'R':	attempts = atoi(optarg);						break;
+			case 'p':	pipelining = TRUE;								break;
+			case 'm':	limit = strtoul(optarg, NULL, 10)*FAIL_MS;		break;
+			default:	FailUsage();
+			}
+		}
+	if(!every || !attempts || downAt >= upAt || upAt >= runFor)
+		FailUsage();
+	runFor *= TICK_SECOND;
+	downAt *= TICK_SECOND;
+	upAt *= TICK_SECOND;
+
+	SimInit(&link);
+	for(i=0; i<BROKERS; i++)
+		failIndex[i] = SimAddBroker(&failBroker[i]);
+	MqttClientInit();			// adds broker.sim, the primary
+	for(i=REFUSING; i<BROKERS; i++)
+		MqttAddBroker((byte*)failBroker[i].Name, 1883);
+	MqttSetPipelining(pipelining);
+	MqttSetRetryPolicy(attempts, TICK_SECOND/10, 0);
+	memset(before, 0, sizeof(before));
+	memset(last, 0, sizeof(last));
+
+	while(TickGet() < runFor || outstanding) {
+		if(TickGet() < runFor && (LONG)(TickGet() - next) >= 0) {
+			slot = queued % FAIL_POOL;
+			sprintf(failPayload[slot], "seq=%u", queued);
+			if(MqttQueueMsgWithCallback((byte*)failPayload[slot], (byte*)"sim/failover", (byte*)"simclient",
+				NULL, NULL, NULL, FailDone) < MQTT_QUEUE_FULL) {
+				queued++;
+				outstanding++;
+				}
+			else
+				refused++;
+			next += every;
+			}
+
+		// the primary fails and comes back between sessions of the client
+		SimBroker(failIndex[PRIMARY])->Down = TickGet() >= downAt && TickGet() < upAt;
+		if(!failoverAt && TickGet() >= downAt) {
+			FailCount(seen);
+			if(seen[BACKUP] + seen[FAR] > last[BACKUP] + last[FAR])
+				failoverAt = TickGet();
+			}
+		if(TickGet() < downAt)
+			FailCount(last);
+		if(!backAt && TickGet() >= upAt) {
+			FailCount(seen);
+			if(!before[PRIMARY])
+				memcpy(before, seen, sizeof(before));
+			else if(seen[PRIMARY] > before[PRIMARY])
+				backAt = TickGet();
+			}
+
+		MQTTClientTask();
+		MQTTTask();
+		SimPass(10*FAIL_MS);
+		}
+	for(end = TickGet(); arrived < delivered && TickGet() - end < TICK_SECOND; SimPass(10*FAIL_MS)) {
+		MQTTClientTask();
+		MQTTTask();
+		}
+
+	FailCount(seen);
+	printf("messages      %u queued, %u refused while the queue was full, %u delivered, %u failed, %u reached a broker\n",
+		queued, refused, delivered, failed, arrived);
+	for(i=0; i<BROKERS; i++) {
+		bs = MqttGetBrokerStats(i);
+		printf("%-12s  %5u publishes (%u before the primary went down), %u connects; client: rtt %.1f ms, %u/%u sessions up\n",
+			failBroker[i].Name, seen[i], last[i], SimBroker(failIndex[i])->Connects,
+			bs ? (double)bs->Rtt / FAIL_MS : 0.0, bs ? bs->Successes : 0, bs ? bs->Tries : 0);
+		}
+	if(failoverAt)
+		printf("failover      %.1f ms after the primary went down\n", (double)(failoverAt - downAt) / FAIL_MS);
+	if(backAt)
+		printf("back          %.1f s after the primary came up\n", (double)(backAt - upAt) / TICK_SECOND);
+
+	// all up, the fastest broker that accepts takes the traffic
+	backBy = downAt + FAIL_HOLD > upAt ? downAt + FAIL_HOLD : upAt + 5*TICK_SECOND;
+	ok = !failed && arrived == delivered && failoverAt && backAt && backAt <= backBy
+		&& last[PRIMARY] > (last[BACKUP] + last[FAR] + last[REFUSING]) * 9
+		&& !seen[REFUSING] && (!limit || failoverAt - downAt <= limit);
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 2;
+	}
@@ -0,0 +1,208 @@
+/*********************************************************************
+ *
+ *                  MQTT alarm latency under a telemetry flood
+ *
+ *********************************************************************
+ * FileName:        FloodMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c, MQTTclient.c
+ * Processor:       host
+ *
+ * Keeps the NORMAL lane full of telemetry, as a device does that
+ * samples faster than its link drains, and raises a HIGH priority alarm
+ * every -e ms.  Reports how long the alarms took from enqueue to the
+ * broker next to the unloaded figure, and what the flood lost to the
+ * drop policy.  The exit status is 2 if an alarm is lost or, with -m,
+ * slower than that.
+ *
+ *   make -C sim mqttflood
+ *   sim/mqttflood -n 200 -e 500 -P 1 -p -m 150
+ *   sim/mqttflood -n 200 -e 500 -p -u			the same alarms, no flood
+ ********************************************************************/
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "MQTTclient.h"
+#include "SimStack.h"
+
+#define FLOOD_POOL			64		// telemetry buffers, more than the lane holds
+#define FLOOD_ALARMS		16
+#define FLOOD_HISTOGRAM		2000	// alarm latency buckets of 1 ms, the last one open ended
+#define FLOOD_MS			(TICK_SECOND/1000)
+
+static char floodPayload[FLOOD_POOL][24];
+static BOOL floodBusy[FLOOD_POOL];
+static char alarmPayload[FLOOD_ALARMS][24];
+static DWORD alarmQueuedAt[FLOOD_ALARMS];
+
+static DWORD telemetryQueued, telemetryDelivered, telemetryShed, telemetryFailed, telemetryArrived;
+static DWORD alarmsOut, alarmsArrived, alarmsFailed;
+static DWORD latMin = 0xFFFFFFFF, latMax, latSum;		// alarm enqueue to broker, ticks
+static DWORD latHist[FLOOD_HISTOGRAM];
+
+
+static void FloodArrived(const char *topic, const BYTE *payload, WORD len) {
+	char num[12];
+	DWORD seq, lat;
+	WORD i;
+
+	if(strcmp(topic, "sim/alarm")) {
+		telemetryArrived++;
+		return;
+		}
+	if(len < 7 || memcmp(payload, "alarm=", 6))
+		return;
+	for(i=0; i+6 < len && i < sizeof(num)-1; i++)
+		num[i] = payload[i+6];
+	num[i] = 0;
+	seq = strtoul(num, NULL, 10);
+	lat = TickGet() - alarmQueuedAt[seq % FLOOD_ALARMS];
+	if(lat < latMin)
+		latMin = lat;
+	if(lat > latMax)
+		latMax = lat;
+	latSum += lat;
+	latHist[lat/FLOOD_MS < FLOOD_HISTOGRAM ? lat/FLOOD_MS : FLOOD_HISTOGRAM-1]++;
+	alarmsArrived++;
+	}
+
+static void FloodTelemetryDone(const MQTT_COMPLETION *c) {
+
+	floodBusy[((char (*)[24])c->Msg) - floodPayload] = FALSE;
+	if(c->Result == MQTT_SUCCESS)
+		telemetryDelivered++;
+	else if(c->Result == MQTT_REQUEST_DROPPED)
+		telemetryShed++;
+	else
+		telemetryFailed++;
+	}
+
+static void FloodAlarmDone(const MQTT_COMPLETION *c) {
+
+	alarmsOut--;
+	if(c->Result != MQTT_SUCCESS)
+		alarmsFailed++;
+	}
+
+// Latency under which pct % of the alarms were, ms
+static DWORD FloodPercentile(BYTE pct) {
+	DWORD want = alarmsArrived * pct / 100, seen = 0, i;
+
+	for(i=0; i<FLOOD_HISTOGRAM; i++) {
+		seen += latHist[i];
+		if(seen > want)
+			break;
+		}
+	return i;
+	}
+
+static void FloodUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttflood [options]\n"
+		"  -n N     alarms (200)\n"
+		"  -e ms    one alarm every (500)\n"
+		"  -d ms    one way delay (20)\n"
+		"  -P N     drop policy: 0 newest, 1 oldest, 2 lowest (0)\n"
+		"  -u       no flood, the unloaded alarm latency\n"
+		"  -p       pipelining\n"
+		"  -m ms    fail if an alarm took longer (no limit)\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	SIM_LINK link;
+	const SIM_STATS *st;
+	const MQTT_LANE_STATS *ls;
+	DWORD alarms = 200, every = 500*FLOOD_MS, limit = 0, raised = 0, next, slot, end;
+	BYTE policy = MQTT_DROP_NEWEST, profile, telemetry, alarm;
+	BOOL pipelining = FALSE, flood = TRUE, ok;
+	MQTT_QUEUE_STATUS s;
+	int c;
+
+	memset(&link, 0, sizeof(link));
+	link.Delay = 20*FLOOD_MS;
+	link.Rto = 200*FLOOD_MS;
+	link.TxFifo = 512;
+	link.RxFifo = 512;
+	link.Seed = 1;
+	link.OnPublish = FloodArrived;
+	while((c = getopt(argc, argv, "n:e:d:P:upm:")) != -1) {
+		switch(c) {
+			case 'n':	alarms = strtoul(optarg, NULL, 10);				break;
+			case 'e':	every = strtoul(optarg, NULL, 10)*FLOOD_MS;		break;
+			case 'd':	link.Delay = strtoul(optarg, NULL, 10)*FLOOD_MS;	break;
+			case 'P':	policy = atoi(optarg);							break;
+			case 'u':	flood = FALSE;									break;
+			case 'p':	pipelining = TRUE;								break;
+			case 'm':	limit = strtoul(optarg, NULL, 10)*FLOOD_MS;		break;
+			default:	FloodUsage();
+			}
+		}
+	if(!alarms || !every || policy > MQTT_DROP_LOWEST)
+		FloodUsage();
+
+	SimInit(&link);
+	MqttClientInit();
+	MqttSetPipelining(pipelining);
+	MqttSetQueuePolicy(policy, 0, 0);
+	profile = MqttAddProfile(NULL, 1883, (byte*)"simclient", NULL, NULL);
+	telemetry = MqttInternTopic((byte*)"sim/telemetry");
+	alarm = MqttInternTopic((byte*)"sim/alarm");
+
+	next = TickGet() + every;
+	while(raised < alarms || alarmsOut) {
+		// the sensor: a new reading whenever a buffer is free, the lane stays full
+		for(slot = telemetryQueued % FLOOD_POOL; flood && !floodBusy[slot]; slot = telemetryQueued % FLOOD_POOL) {
+			sprintf(floodPayload[slot], "reading=%u", telemetryQueued);
+			s = MqttQueueMsgForProfile(profile, telemetry, (byte*)floodPayload[slot], MQTT_PRIORITY_NORMAL, FloodTelemetryDone);
+			if(s >= MQTT_QUEUE_FULL)
+				break;
+			floodBusy[slot] = TRUE;
+			telemetryQueued++;
+			}
+
+		if(raised < alarms && (LONG)(TickGet() - next) >= 0) {
+			slot = raised % FLOOD_ALARMS;
+			sprintf(alarmPayload[slot], "alarm=%u", raised);
+			alarmQueuedAt[slot] = TickGet();
+			if(MqttQueueMsgForProfile(profile, alarm, (byte*)alarmPayload[slot], MQTT_PRIORITY_HIGH, FloodAlarmDone) < MQTT_QUEUE_FULL) {
+				raised++;
+				alarmsOut++;
+				}
+			else
+				alarmsFailed++;
+			next += every;
+			}
+
+		MQTTClientTask();
+		MQTTTask();
+		SimPass(FLOOD_MS);
+		}
+	// the last alarm may still be on the wire
+	for(end = TickGet(); alarmsArrived + alarmsFailed < alarms && TickGet() - end < TICK_SECOND; SimPass(FLOOD_MS)) {
+		MQTTClientTask();
+		MQTTTask();
+		}
+
+	st = SimGetStats();
+	printf("alarms        %u raised, %u reached the broker, %u lost\n", raised, alarmsArrived, alarmsFailed);
+	if(alarmsArrived)
+		printf("to broker     min %.1f  avg %.1f  p50 %u  p99 %u  max %.1f ms\n",
+			(double)latMin / FLOOD_MS, (double)latSum / alarmsArrived / FLOOD_MS,
+			FloodPercentile(50), FloodPercentile(99), (double)latMax / FLOOD_MS);
+	ls = MqttGetLaneStats(MQTT_PRIORITY_HIGH);
+	if(ls->Served)
+		printf("alarm lane    waited avg %.1f  max %.1f ms\n",
+			(double)ls->WaitSum / ls->Served / FLOOD_MS, (double)ls->WaitMax / FLOOD_MS);
+	ls = MqttGetLaneStats(MQTT_PRIORITY_NORMAL);
+	if(flood && ls->Served)
+		printf("telemetry     %u queued, %u delivered, %u shed, %u failed, %u reached the broker; waited avg %.1f ms\n",
+			telemetryQueued, telemetryDelivered, telemetryShed, telemetryFailed, telemetryArrived,
+			(double)ls->WaitSum / ls->Served / FLOOD_MS);
+	printf("link          %u connects, %u publishes, %.1f s\n", st->Connects, st->Publishes, (double)TickGet() / TICK_SECOND);
+
+	ok = !alarmsFailed && alarmsArrived == alarms && (!limit || latMax <= limit);
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 2;
+	}
@@ -0,0 +1,156 @@
+/*********************************************************************
+ *
+ *                  MQTT remaining length tests
+ *
+ *********************************************************************
+ * FileName:        LengthMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c
+ * Processor:       host
+ *
+ * Round trips every remaining length from 0 to MQTT_MAX_REMAINING_LENGTH
+ * through MQTTEncodeLength and MQTTDecodeLength, checks the field size
+ * and the edges of each size, that a field cut short asks for more and
+ * that a 5 byte field is refused, as is a length above the limit on
+ * the way out, then times both over a mix of sizes.
+ * The exit status is 2 if any check failed.
+ *
+ *   make -C sim mqttlength
+ *   sim/mqttlength -n 100000000
+ ********************************************************************/
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+
+static DWORD errors;
+static volatile DWORD lengthSink;			// keeps the timed loops from being optimised away
+
+
+static void LengthError(const char *what, DWORD value, DWORD got) {
+
+	if(errors++ < 10)
+		printf("%s: %u gave %u\n", what, value, got);
+	}
+
+// Bytes the spec says the field takes
+static BYTE LengthSize(DWORD value) {
+
+	return value < 128 ? 1 : value < 16384 ? 2 : value < 2097152 ? 3 : 4;
+	}
+
+static void LengthRoundTrip(DWORD value) {
+	BYTE buf[4], n, got;
+	DWORD length = ~value;
+
+	n = MQTTEncodeLength(value, buf);
+	if(n != LengthSize(value))
+		LengthError("encoded size", value, n);
+	got = MQTTDecodeLength(buf, n, &length);
+	if(got != n)
+		LengthError("decoded size", value, got);
+	if(length != value)
+		LengthError("decoded value", value, length);
+	}
+
+// Each size either side of its edges, with every byte short of complete
+static void LengthEdges(void) {
+	static const DWORD edge[] = { 0, 127, 128, 16383, 16384, 2097151, 2097152, MQTT_MAX_REMAINING_LENGTH };
+	BYTE buf[4], n, avail, got;
+	DWORD length;
+	WORD i;
+
+	for(i=0; i<sizeof(edge)/sizeof(edge[0]); i++) {
+		LengthRoundTrip(edge[i]);
+		n = MQTTEncodeLength(edge[i], buf);
+		for(avail=0; avail<n; avail++)
+			if((got = MQTTDecodeLength(buf, avail, &length)) != 0)
+				LengthError("cut short", edge[i], got);
+		}
+	}
+
+// A continuation bit on the 4th byte is malformed, however much follows;
+// a length above the limit has no field at all
+static void LengthMalformed(void) {
+	static const BYTE five[5] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x7F };
+	static const BYTE zeros[5] = { 0x80, 0x80, 0x80, 0x80, 0x00 };
+	DWORD length = 0;
+	BYTE buf[4], avail, got;
+
+	for(avail=4; avail<=5; avail++) {
+		if((got = MQTTDecodeLength(five, avail, &length)) != MQTT_LENGTH_MALFORMED)
+			LengthError("5 byte field", avail, got);
+		if((got = MQTTDecodeLength(zeros, avail, &length)) != MQTT_LENGTH_MALFORMED)
+			LengthError("5 byte zero", avail, got);
+		}
+	if((got = MQTTDecodeLength(five, 3, &length)) != 0)
+		LengthError("5 byte field cut short", 3, got);
+	if((got = MQTTEncodeLength(MQTT_MAX_REMAINING_LENGTH+1, buf)) != MQTT_LENGTH_MALFORMED)
+		LengthError("encoded above the limit", MQTT_MAX_REMAINING_LENGTH+1, got);
+	if((got = MQTTEncodeLength(0xFFFFFFFFu, buf)) != MQTT_LENGTH_MALFORMED)
+		LengthError("encoded above the limit", 0xFFFFFFFFu, got);
+	}
+
+static double LengthElapsed(const struct timespec *t0) {
+	struct timespec t1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	return (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+	}
+
+static void LengthUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttlength [options]\n"
+		"  -n N     values timed (10000000)\n"
+		"  -q       skip the exhaustive round trip\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	struct timespec t0;
+	DWORD passes = 10000000, i, value, length, sum = 0;
+	BYTE buf[4], n;
+	BOOL exhaustive = TRUE;
+	double encode, decode;
+	int c;
+
+	while((c = getopt(argc, argv, "n:q")) != -1) {
+		switch(c) {
+			case 'n':	passes = strtoul(optarg, NULL, 10);	break;
+			case 'q':	exhaustive = FALSE;					break;
+			default:	LengthUsage();
+			}
+		}
+	if(!passes)
+		LengthUsage();
+
+	LengthEdges();
+	LengthMalformed();
+	if(exhaustive) {
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		for(value=0; value<=MQTT_MAX_REMAINING_LENGTH; value++)
+			LengthRoundTrip(value);
+		printf("round trip    %lu values, %.3f s\n", MQTT_MAX_REMAINING_LENGTH+1, LengthElapsed(&t0));
+		}
+
+	// values spread over all four sizes, as frames of every size come in
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i=0; i<passes; i++)
+		sum += MQTTEncodeLength((i * 2654435761u) >> (4 + 7*(i & 3)), buf);
+	encode = LengthElapsed(&t0);
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i=0; i<passes; i++) {
+		n = MQTTEncodeLength((i * 2654435761u) >> (4 + 7*(i & 3)), buf);
+		MQTTDecodeLength(buf, n, &length);
+		sum += length;
+		}
+	decode = LengthElapsed(&t0) - encode;
+	lengthSink = sum;
+	printf("encode        %.1f ns per length\n", encode * 1e9 / passes);
+	printf("decode        %.1f ns per length\n", (decode > 0 ? decode : 0) * 1e9 / passes);
+
+	printf("%u errors\n", errors);
+	return errors ? 2 : 0;
+	}
@@ -0,0 +1,191 @@
+/*********************************************************************
+ *
+ *                  MQTT payload compression figures
+ *
+ *********************************************************************
+ * FileName:        LzMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c
+ * Processor:       host
+ *
+ * Compresses the payloads the client publishes (GetAsJSONValue and
+ * GetAsJSONStats documents, a batch of readings) and data that will not
+ * shrink, plus any files named, the way MQTTPublishCompressed does: one
+ * MQTTLZCompressedSize pass for the length, one MQTTLZEncode pass while
+ * streaming.  Reports the ratio, encode and decode cycles per input byte
+ * and the RAM each side needs: the encoder state, the deepest stack seen
+ * and the decoder's output buffer.  Every payload is expanded again with
+ * MQTTLZDecode; the exit status is 2 if one does not come back intact.
+ *
+ *   make -C sim mqttlz
+ *   sim/mqttlz -n 1000 [file...]
+ *
+ * Cycles are read with rdtsc on x86, elsewhere they are nanoseconds.
+ * Build with -DMQTT_LZ_WINDOW=n to see what the window costs and gains.
+ ********************************************************************/
+#define _XOPEN_SOURCE 600
+#include <time.h>
+#include <ucontext.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "TCPIP Stack/MQTTLZ.h"
+
+#define LZ_MAX				0xFFFF		// longest payload MQTTLZ takes
+#define LZ_STACK			65536		// stack the measured calls run on, painted to find the deepest use
+#define LZ_PAINT			0xA5
+#define LZ_PIECE			64			// TX FIFO room per MQTTLZEncode call
+
+static BYTE lzOut[LZ_MAX + LZ_MAX/8 + 16];
+static BYTE lzBack[LZ_MAX];
+static DWORD passes = 1000, errors;
+
+// LzStackDepth runs a call on its own stack, the arguments go through here
+static BYTE lzStack[LZ_STACK];
+static ucontext_t lzCaller, lzCallee;
+static const BYTE *lzIn;
+static WORD lzLen, lzBackLen;
+static DWORD lzSize;
+
+
+static QWORD LzNow(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (QWORD)t.tv_sec * 1000000000u + t.tv_nsec;
+#endif
+	}
+
+// As MQTTPublishCompressed: the size up front, then the stream in pieces
+static DWORD LzEncode(const BYTE *in, WORD len) {
+	MQTT_LZ_ENCODER e;
+	DWORD size, n = 0;
+	WORD got;
+
+	size = MQTTLZCompressedSize(in, len);
+	MQTTLZEncodeBegin(&e, in, len);
+	while((got = MQTTLZEncode(&e, lzOut + n, LZ_PIECE)) != 0)
+		n += got;
+	if(n != size) {
+		printf("  encoded %u bytes, MQTTLZCompressedSize said %u\n", n, size);
+		errors++;
+		}
+	return n;
+	}
+
+static void LzEncodeCall(void) {
+
+	lzSize = LzEncode(lzIn, lzLen);
+	}
+
+static void LzDecodeCall(void) {
+
+	lzBackLen = MQTTLZDecode(lzOut, lzSize, lzBack, lzLen);
+	}
+
+// Bytes of stack call went through, on a painted stack of its own
+static DWORD LzStackDepth(void (*call)(void)) {
+	DWORD i;
+
+	memset(lzStack, LZ_PAINT, sizeof(lzStack));
+	getcontext(&lzCallee);
+	lzCallee.uc_stack.ss_sp = lzStack;
+	lzCallee.uc_stack.ss_size = sizeof(lzStack);
+	lzCallee.uc_link = &lzCaller;
+	makecontext(&lzCallee, call, 0);
+	swapcontext(&lzCaller, &lzCallee);
+	for(i=0; i<LZ_STACK && lzStack[i] == LZ_PAINT; i++)
+		;
+	return LZ_STACK - i;
+	}
+
+static void LzReport(const char *name, const BYTE *in, WORD len) {
+	QWORD t0, enc, dec;
+	DWORD size, i, encStack, decStack;
+
+	lzIn = in;
+	lzLen = len;
+	encStack = LzStackDepth(LzEncodeCall);
+	size = lzSize;
+	decStack = LzStackDepth(LzDecodeCall);
+	if(lzBackLen != len || memcmp(in, lzBack, len)) {
+		printf("%-12s does not expand back to what was compressed\n", name);
+		errors++;
+		return;
+		}
+
+	t0 = LzNow();
+	for(i=0; i<passes; i++)
+		LzEncode(in, len);
+	enc = LzNow() - t0;
+	t0 = LzNow();
+	for(i=0; i<passes; i++)
+		MQTTLZDecode(lzOut, size, lzBack, len);
+	dec = LzNow() - t0;
+
+	printf("%-12s %6u -> %6u bytes %5.1f%%%s  encode %6.1f  decode %5.1f per byte  stack %u/%u\n",
+		name, len, size, 100.0 * size / len, size >= len ? " (sent as is)" : "             ",
+		(double)enc / passes / len, (double)dec / passes / len, encStack, decStack);
+	}
+
+static void LzUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttlz [options] [file...]\n"
+		"  -n N     passes timed per payload (1000)\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	static BYTE buf[LZ_MAX];
+	DWORD len, i, r = 1;
+	FILE *f;
+	int c;
+
+	while((c = getopt(argc, argv, "n:")) != -1) {
+		switch(c) {
+			case 'n':	passes = strtoul(optarg, NULL, 10);	break;
+			default:	LzUsage();
+			}
+		}
+	if(!passes)
+		LzUsage();
+
+	printf("window %u bytes, encoder state %u bytes static, cycles per input byte, stack encode/decode bytes\n",
+		MQTT_LZ_WINDOW, (unsigned)sizeof(MQTT_LZ_ENCODER));
+
+	GetAsJSONValue((char*)buf, "temperature", 23.5);
+	LzReport("reading", buf, strlen((char*)buf));
+	GetAsJSONStats((char*)buf, "temperature", 21.5, 24.25, 22.8125, 60);
+	LzReport("stats", buf, strlen((char*)buf));
+	for(len = i = 0; i < 16; i++)
+		len += strlen(GetAsJSONValue((char*)buf + len, "temperature", 20.0 + i * 0.3));
+	LzReport("16 readings", buf, len);
+	for(i=0; i<1024; i++) {
+		r ^= r << 13;
+		r ^= r >> 17;
+		r ^= r << 5;
+		buf[i] = (BYTE)r;
+		}
+	LzReport("random", buf, 1024);
+
+	for(c = optind; c < argc; c++) {
+		if(!(f = fopen(argv[c], "rb"))) {
+			perror(argv[c]);
+			return 1;
+			}
+		len = fread(buf, 1, LZ_MAX, f);
+		fclose(f);
+		if(len)
+			LzReport(argv[c], buf, len);
+		}
+
+	printf("decode output buffer: the original length; %u errors\n", errors);
+	return errors ? 2 : 0;
+	}
@@ -0,0 +1,137 @@
+/*********************************************************************
+ *
+ *                  MQTT persistent session resume
+ *
+ *********************************************************************
+ * FileName:        PersistMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c
+ * Processor:       host
+ *
+ * Publishes -n QOS1 messages once each, with clean session off, over a
+ * link whose broker closes the connection after -c % of the PUBLISHes.
+ * The application connects again whenever the client falls idle
+ * without a connection, and never publishes a message twice: what the
+ * broker did not acknowledge before the cut must come from the client,
+ * sent again with DUP when the CONNACK says the session was kept.  The
+ * exit status is 2 if a message never reached the broker or a frame
+ * was malformed.
+ *
+ *   make -C sim mqttpersist
+ *   sim/mqttpersist -n 2000 -c 5 -p
+ ********************************************************************/
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "SimStack.h"
+
+#define PERSIST_MAX			10000
+#define PERSIST_MS			(TICK_SECOND/1000)
+#define PERSIST_TIMEOUT		(60*TICK_SECOND)	// per message, then the run is given up
+
+static char persistPayload[PERSIST_MAX][16];	// valid until the PUBACK, so for the whole run
+static BYTE persistArrived[PERSIST_MAX];
+static DWORD arrivedOnce, arrivedAgain;
+
+
+static void PersistArrived(const char *topic, const BYTE *payload, WORD len) {
+	char num[12];
+	DWORD seq;
+	WORD i;
+
+	if(strcmp(topic, "sim/persist") || len < 5 || memcmp(payload, "seq=", 4))
+		return;
+	for(i=0; i+4 < len && i < sizeof(num)-1; i++)
+		num[i] = payload[i+4];
+	num[i] = 0;
+	seq = strtoul(num, NULL, 10);
+	if(seq >= PERSIST_MAX)
+		return;
+	if(persistArrived[seq]++)
+		arrivedAgain++;
+	else
+		arrivedOnce++;
+	}
+
+// A new MQTTBeginUsage for each connection, the session outlives them
+static void PersistBegin(BOOL pipelining) {
+
+	MQTTBeginUsage();
+	MQTTClient.Server.szRAM = "sim";
+	MQTTClient.ServerPort = 1883;
+	MQTTClient.ConnectId.szRAM = "simpersist";
+	MQTTClient.Ver = MQTT_VERSION_3_1_1;
+	MQTTClient.QOS = 1;
+	MQTTClient.bPersistent = TRUE;
+	MQTTClient.bPipeline = pipelining;
+	}
+
+static void PersistUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttpersist [options]\n"
+		"  -n N     messages (2000, at most %u)\n"
+		"  -c %%     PUBLISHes the broker closes the connection after (5)\n"
+		"  -d ms    one way delay (20)\n"
+		"  -p       pipelining\n", PERSIST_MAX);
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	SIM_LINK link;
+	const SIM_STATS *st;
+	DWORD messages = 2000, published = 0, connects = 0, last;
+	BOOL pipelining = FALSE, ok;
+	int c;
+
+	memset(&link, 0, sizeof(link));
+	link.Delay = 20*PERSIST_MS;
+	link.Rto = 200*PERSIST_MS;
+	link.Cut = 5;
+	link.TxFifo = 512;
+	link.RxFifo = 512;
+	link.Seed = 1;
+	link.OnPublish = PersistArrived;
+	while((c = getopt(argc, argv, "n:c:d:p")) != -1) {
+		switch(c) {
+			case 'n':	messages = strtoul(optarg, NULL, 10);				break;
+			case 'c':	link.Cut = atoi(optarg);							break;
+			case 'd':	link.Delay = strtoul(optarg, NULL, 10)*PERSIST_MS;	break;
+			case 'p':	pipelining = TRUE;									break;
+			default:	PersistUsage();
+			}
+		}
+	if(!messages || messages > PERSIST_MAX)
+		PersistUsage();
+
+	SimInit(&link);
+	PersistBegin(pipelining);
+	connects++;
+	last = TickGet();
+	while(arrivedOnce < messages && TickGet() - last < PERSIST_TIMEOUT) {
+		if(MQTTIsIdle() && !MQTTClient.bConnected) {
+			MQTTEndUsage();
+			PersistBegin(pipelining);
+			connects++;
+			}
+		else if(published < messages && MQTTIsIdle() && MQTTConnected()) {
+			sprintf(persistPayload[published], "seq=%u", published);
+			if(MQTTPublish("sim/persist", (BYTE*)persistPayload[published], strlen(persistPayload[published]), FALSE)) {
+				published++;
+				last = TickGet();
+				}
+			}
+		MQTTTask();
+		SimPass(PERSIST_MS);
+		}
+
+	st = SimGetStats();
+	printf("messages      %u published once, %u reached the broker, %u more than once\n",
+		published, arrivedOnce, arrivedAgain);
+	printf("link          %u connects, %u cuts, %u publishes, %u sent again with DUP, %u malformed, %.1f s\n",
+		st->Connects, st->Cuts, st->Publishes, st->DupPublishes, st->Malformed, (double)TickGet() / TICK_SECOND);
+
+	ok = arrivedOnce == messages && !st->Malformed;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 2;
+	}
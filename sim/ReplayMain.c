@@ -0,0 +1,438 @@
+/*********************************************************************
+ *
+ *                  MQTT capture replay
+ *
+ *********************************************************************
+ * FileName:        ReplayMain.c
+ * Dependencies:    mla_legacy/MQTT*.c
+ * Processor:       host
+ *
+ * Plays a capture (MQTTCapture.h, mqttsim -w or MQTTCaptureDump on a
+ * board) back through the unmodified MQTTTask, so every inbound byte
+ * goes through MQTTReadPacket and MQTTDispatch again, as fast as the
+ * host runs them.  Reports decode throughput and the heap calls made
+ * while replaying; a slower parser shows up here before it ships.
+ *
+ *   make -C sim mqttreplay
+ *   sim/mqttreplay -n 1000 capture.mqcp
+ *
+ * The stack below the client is this file: DNS and TCP connect at once,
+ * writes are counted and thrown away, reads come from the capture and
+ * TickGet() follows the capture timestamps, so keep-alives and timeouts
+ * fire where they did.  Skipped records read as zeros; build with the
+ * MQTT_RX_BUFFER_SIZE of the capturing board so they are dropped again.
+ ********************************************************************/
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "TCPIP Stack/MQTTCapture.h"
+
+#define REPLAY_STALL		64			// passes without a read before the clock moves a second
+#define REPLAY_GIVE_UP		120			// seconds stalled before a pass is abandoned
+
+// The capture, inbound bytes in one stream
+typedef struct {
+	DWORD Pos;				// first byte in the inbound stream
+	DWORD At;				// TickGet() units, from the start of the capture
+	} REPLAY_MARK;
+
+static BYTE *inData;
+static DWORD inLen;
+static REPLAY_MARK *inMark;
+static DWORD inMarks;
+static DWORD inFrames;					// frames in the inbound stream
+static DWORD outCaptured;				// bytes the client wrote when captured
+static DWORD capSpan;
+
+// Where the replay is
+static DWORD rxPos, rxMark;
+static DWORD rxFifo = 512;				// bytes TCPIsGetReady offers at most
+static DWORD tickBase;
+static BOOL sockOpen, sockUsed, dnsBusy;
+static DWORD written, sessions, publishes, stalls;
+
+// Heap calls made by the client, -Wl,--wrap counts them
+static DWORD allocs, frees;
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+void __real_free(void *);
+
+void *__wrap_malloc(size_t n) {
+
+	allocs++;
+	return __real_malloc(n);
+	}
+
+void *__wrap_calloc(size_t n, size_t size) {
+
+	allocs++;
+	return __real_calloc(n, size);
+	}
+
+void *__wrap_realloc(void *p, size_t n) {
+
+	allocs++;
+	return __real_realloc(p, n);
+	}
+
+void __wrap_free(void *p) {
+
+	if(p)
+		frees++;
+	__real_free(p);
+	}
+
+
+// Appends to the inbound stream, a new mark when the time moved
+static void ReplayIn(const BYTE *data, WORD len, DWORD at) {
+
+	if(!inMarks || inMark[inMarks-1].At != at) {
+		inMark = realloc(inMark, (inMarks+1) * sizeof(REPLAY_MARK));
+		inMark[inMarks].Pos = inLen;
+		inMark[inMarks].At = at;
+		inMarks++;
+		}
+	inData = realloc(inData, inLen + len);
+	if(data)
+		memcpy(inData + inLen, data, len);
+	else
+		memset(inData + inLen, 0, len);
+	inLen += len;
+	}
+
+// Frames in the inbound stream, by their remaining length
+static DWORD ReplayCountFrames(void) {
+	DWORD i = 0, n = 0, length;
+	BYTE llen;
+
+	while(i + 1 < inLen) {
+		llen = MQTTDecodeLength(inData+i+1, inLen-i-1 > 4 ? 4 : inLen-i-1, &length);
+		if(!llen || llen == MQTT_LENGTH_MALFORMED)
+			break;
+		i += 1 + llen + length;
+		if(i > inLen)
+			break;
+		n++;
+		}
+	return n;
+	}
+
+/*****************************************************************************
+  Function:
+	static BOOL ReplayLoad(const char *name)
+
+  Summary:
+	Reads a capture into the inbound stream
+
+  Description:
+	A capture that starts in the middle of a session gets a CONNACK in
+	front, the client always connects first.
+  ***************************************************************************/
+static BOOL ReplayLoad(const char *name) {
+	static const BYTE connack[] = { 0x20, 2, 0, 0 };
+	FILE *f;
+	BYTE *buf, dir;
+	long size;
+	DWORD i, rate, delta, at = 0;
+	WORD len;
+	BYTE shift;
+
+	if(!(f = fopen(name, "rb")))
+		return FALSE;
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	rewind(f);
+	buf = malloc(size);
+	if(fread(buf, 1, size, f) != (size_t)size || size < MQTT_CAPTURE_HEADER ||
+		memcmp(buf, "MQCP", 4) || buf[4] != MQTT_CAPTURE_VERSION) {
+		fclose(f);
+		return FALSE;
+		}
+	fclose(f);
+	rate = ((DWORD)buf[5] << 24) | ((DWORD)buf[6] << 16) | ((DWORD)buf[7] << 8) | buf[8];
+	if(!rate)
+		return FALSE;
+
+	for(i=MQTT_CAPTURE_HEADER; i < (DWORD)size; ) {
+		dir = buf[i++];
+		delta = 0;
+		shift = 0;
+		do {
+			if(i >= (DWORD)size || shift > 28)
+				return FALSE;
+			delta |= (DWORD)(buf[i] & 0x7F) << shift;
+			shift += 7;
+			} while(buf[i++] & 0x80);
+		at += delta;
+		if(i + 2 > (DWORD)size)
+			return FALSE;
+		len = MAKEWORD(buf[i+1], buf[i]);
+		i += 2;
+		if(dir != MQTT_CAPTURE_SKIPPED && i + len > (DWORD)size)
+			return FALSE;
+		switch(dir) {
+			case MQTT_CAPTURE_IN:
+				if(!inLen && buf[i] != 0x20)
+					ReplayIn(connack, sizeof(connack), 0);
+				ReplayIn(buf+i, len, (QWORD)at * TICK_SECOND / rate);
+				break;
+			case MQTT_CAPTURE_SKIPPED:
+				ReplayIn(NULL, len, (QWORD)at * TICK_SECOND / rate);
+				break;
+			case MQTT_CAPTURE_OUT:
+				outCaptured += len;
+				break;
+			default:
+				return FALSE;
+			}
+		if(dir != MQTT_CAPTURE_SKIPPED)
+			i += len;
+		}
+	free(buf);
+	capSpan = (QWORD)at * TICK_SECOND / rate;
+	inFrames = ReplayCountFrames();
+	return inLen != 0;
+	}
+
+static void ReplayCallback(const char *topic, const BYTE *payload, unsigned int len) {
+	(void)topic;
+	(void)payload;
+	(void)len;
+
+	publishes++;
+	}
+
+/*****************************************************************************
+  Function:
+	static BOOL ReplayPass(void)
+
+  Summary:
+	Feeds the whole inbound stream to the client once
+
+  Description:
+	The client connects, reads until the stream is used up and ends its
+	session.  When it closes the socket halfway (a refused CONNACK, a
+	protocol error in the capture) it connects again and goes on from
+	where it was, as it did on the board.
+
+  Returns:
+	FALSE if the client stopped reading for REPLAY_GIVE_UP seconds
+  ***************************************************************************/
+static BOOL ReplayPass(void) {
+	DWORD idle = 0, seen = 0, late = 0;
+
+	rxPos = rxMark = 0;
+	while(rxPos < inLen) {
+		// the CONNECT goes out as soon as the socket is open, as MQTTclient.c does
+		if(!sockOpen && (!sessions || sockUsed)) {
+			MQTTEndUsage();
+			MQTTBeginUsage();
+			sockUsed = FALSE;
+			MQTTClient.Server.szRAM = "replay";
+			MQTTClient.ConnectId.szRAM = "replay";
+			MQTTClient.m_Callback = ReplayCallback;
+			sessions++;
+			}
+
+		MQTTTask();
+
+		if(rxPos != seen) {
+			seen = rxPos;
+			idle = late = 0;
+			}
+		else if(++idle >= REPLAY_STALL) {
+			// the client waits for a timer, let it run out
+			tickBase += TICK_SECOND;
+			idle = 0;
+			if(++late >= REPLAY_GIVE_UP) {
+				stalls++;
+				break;
+				}
+			}
+		}
+	MQTTEndUsage();
+	sockOpen = FALSE;
+	sockUsed = TRUE;
+	tickBase += capSpan + TICK_SECOND;
+	return rxPos >= inLen;
+	}
+
+static void ReplayUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttreplay [options] capture\n"
+		"  -n N     passes over the capture (100)\n"
+		"  -f N     bytes the RX FIFO holds (512)\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	struct timespec t0, t1;
+	DWORD passes = 100, i, a0, f0;
+	double wall;
+	int c;
+
+	while((c = getopt(argc, argv, "n:f:")) != -1) {
+		switch(c) {
+			case 'n':	passes = strtoul(optarg, NULL, 10);		break;
+			case 'f':	rxFifo = strtoul(optarg, NULL, 10);		break;
+			default:	ReplayUsage();
+			}
+		}
+	if(optind != argc-1 || !passes || !rxFifo || rxFifo > 0xFFFF)
+		ReplayUsage();
+	if(!ReplayLoad(argv[optind])) {
+		fprintf(stderr, "mqttreplay: %s is not a readable capture\n", argv[optind]);
+		return 1;
+		}
+
+	a0 = allocs;
+	f0 = frees;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for(i=0; i<passes; i++)
+		ReplayPass();
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	printf("capture       %u bytes in (%u frames), %u bytes out, %.3f s\n",
+		inLen, inFrames, outCaptured, (double)capSpan / TICK_SECOND);
+	printf("replay        %u passes, %u sessions, %u publishes delivered, %u stalled\n",
+		passes, sessions, publishes, stalls);
+	printf("written       %.0f bytes per pass (%u when captured)\n", (double)written / passes, outCaptured);
+	printf("heap          %u allocations, %u frees\n", allocs - a0, frees - f0);
+	printf("wall          %.3f s, %.1f MB/s, %.0f frames/s, %.1f ns per byte\n",
+		wall, (double)inLen * passes / wall / 1e6, (double)inFrames * passes / wall,
+		wall * 1e9 / ((double)inLen * passes));
+	return 0;
+	}
+
+
+/****************************************************************************
+  Section:
+	Stack API, as used by MQTT.c
+  ***************************************************************************/
+DWORD TickGet(void) {
+
+	return tickBase + (rxMark < inMarks ? inMark[rxMark].At : capSpan);
+	}
+
+BOOL DNSBeginUsage(void) {
+
+	if(dnsBusy)
+		return FALSE;
+	dnsBusy = TRUE;
+	return TRUE;
+	}
+
+void DNSResolve(BYTE *name, BYTE type) {
+	(void)name;
+	(void)type;
+	}
+
+BOOL DNSIsResolved(IP_ADDR *ip) {
+
+	ip->Val = 0x0100000A;
+	return TRUE;
+	}
+
+BOOL DNSEndUsage(void) {
+
+	dnsBusy = FALSE;
+	return TRUE;
+	}
+
+TCP_SOCKET TCPOpen(DWORD remote, BYTE type, WORD port, BYTE purpose) {
+	(void)remote;
+	(void)type;
+	(void)port;
+	(void)purpose;
+
+	if(sockOpen)
+		return INVALID_SOCKET;
+	sockOpen = sockUsed = TRUE;
+	return 0;
+	}
+
+BOOL TCPIsConnected(TCP_SOCKET s) {
+	(void)s;
+
+	return sockOpen;
+	}
+
+void TCPDisconnect(TCP_SOCKET s) {
+	(void)s;
+
+	sockOpen = FALSE;
+	}
+
+void TCPClose(TCP_SOCKET s) {
+	(void)s;
+
+	sockOpen = FALSE;
+	}
+
+WORD TCPIsPutReady(TCP_SOCKET s) {
+	(void)s;
+
+	return sockOpen ? 0xFFFF : 0;
+	}
+
+WORD TCPPutArray(TCP_SOCKET s, BYTE *data, WORD len) {
+	(void)s;
+	(void)data;
+
+	if(!sockOpen)
+		return 0;
+	written += len;
+	return len;
+	}
+
+BOOL TCPPut(TCP_SOCKET s, BYTE b) {
+
+	return TCPPutArray(s, &b, 1) == 1;
+	}
+
+void TCPFlush(TCP_SOCKET s) {
+	(void)s;
+	}
+
+WORD TCPIsGetReady(TCP_SOCKET s) {
+	(void)s;
+
+	if(!sockOpen)
+		return 0;
+	return inLen - rxPos < rxFifo ? inLen - rxPos : rxFifo;
+	}
+
+// buf NULL discards, as MQTTReadPacket does with frames too big for it
+WORD TCPGetArray(TCP_SOCKET s, BYTE *buf, WORD len) {
+	WORD n = TCPIsGetReady(s);
+
+	if(len < n)
+		n = len;
+	if(buf)
+		memcpy(buf, inData + rxPos, n);
+	rxPos += n;
+	while(rxMark+1 < inMarks && inMark[rxMark+1].Pos <= rxPos)
+		rxMark++;
+	return n;
+	}
+
+BOOL TCPGet(TCP_SOCKET s, BYTE *b) {
+
+	return TCPGetArray(s, b, 1) == 1;
+	}
+
+BYTE *ipcGetHostServerHostname(void) {
+
+	return (BYTE *)"replay";
+	}
+
+BYTE *ipcGetHostServerPasswd(void) {
+
+	return (BYTE *)"";
+	}
@@ -0,0 +1,332 @@
+/*********************************************************************
+ *
+ *                  MQTT client simulation driver
+ *
+ *********************************************************************
+ * FileName:        SimMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c, MQTTclient.c
+ * Processor:       host
+ *
+ * Runs the unmodified MQTTTask and MQTTClientTask against SimStack:
+ * queues messages, steps the tasks and the simulated link in virtual
+ * time, and reports task calls, virtual latency per message and how
+ * many connect/publish cycles per wall clock second that took.
+ *
+ *   make -C sim mqttsim
+ *   sim/mqttsim -n 100000 -d 20 -l 5 -r 5 -f 3 -p -b 8
+ *
+ * -w saves what went over the socket as a capture for ReplayMain.c.
+ *
+ * -P prints the MQTTProf.h probe table; the probes are only built into
+ * mqttprof, this driver with MQTT_PROFILING 1,
+ *
+ *   make -C sim mqttprof
+ *   sim/mqttprof -n 2000 -p -b 8 -t 64 -P
+ *
+ * -L fixes the link parameters of a pipelined client, -a with it adapts
+ * them from there.  -S saves a run's delivery and throughput, -B fails
+ * the run unless it delivers as many and beats the throughput: a client
+ * tuned for a fast link, run on a slow one with and without -a,
+ *
+ *   sim/mqttsim -n 2000 -d 50 -l 5 -p -b 8 -L 2,0,512 -S fixed.sim
+ *   sim/mqttsim -n 2000 -d 50 -l 5 -p -b 8 -L 2,0,512 -a -B fixed.sim
+ *
+ * Same options and seed, same run: nothing depends on the wall clock.
+ * The exit status is 2 if any message failed, one reported delivered
+ * never reached the broker, or one reached it twice, as a retry of one
+ * the broker already had would with -c; or if -B was not beaten, or
+ * -P finds PUBLISHes that were written outside MQTT_PROF_PUT_ARRAY.
+ ********************************************************************/
+#define _POSIX_C_SOURCE 199309L
+#include <time.h>
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "TCPIP Stack/MQTTCapture.h"
+#include "TCPIP Stack/MQTTProf.h"
+#include "MQTTclient.h"
+#include "SimStack.h"
+
+#define SIM_POOL			64		// payload buffers, more than the client can hold
+#define SIM_HISTOGRAM		1000	// latency buckets of 1 ms, the last one open ended
+#define SIM_MS				(TICK_SECOND/1000)
+
+static char simPayload[SIM_POOL][24];
+static DWORD simQueuedAt[SIM_POOL];
+static DWORD simSeq[SIM_POOL];
+static BOOL simArrived[SIM_POOL];
+
+static DWORD outstanding, delivered, failed, arrived, duplicates;
+static DWORD latMin = 0xFFFFFFFF, latMax;		// enqueue to broker, ticks
+static QWORD latSum;
+static DWORD latHist[SIM_HISTOGRAM];
+static QWORD doneSum;							// enqueue to completion, ticks
+static FILE *capFile;
+
+
+// Broker side: first arrival of each message, the others counted
+static void SimArrived(const char *topic, const BYTE *payload, WORD len) {
+	char num[12];
+	DWORD seq, lat;
+	WORD i;
+
+	(void)topic;
+	if(len < 5 || memcmp(payload, "seq=", 4))
+		return;
+	for(i=0; i+4 < len && i < sizeof(num)-1; i++)
+		num[i] = payload[i+4];
+	num[i] = 0;
+	seq = strtoul(num, NULL, 10);
+	if(simSeq[seq % SIM_POOL] != seq)
+		return;
+	if(simArrived[seq % SIM_POOL]) {
+		duplicates++;
+		return;
+		}
+	simArrived[seq % SIM_POOL] = TRUE;
+	lat = TickGet() - simQueuedAt[seq % SIM_POOL];
+	if(lat < latMin)
+		latMin = lat;
+	if(lat > latMax)
+		latMax = lat;
+	latSum += lat;
+	latHist[lat/SIM_MS < SIM_HISTOGRAM ? lat/SIM_MS : SIM_HISTOGRAM-1]++;
+	arrived++;
+	}
+
+static void SimDone(const MQTT_COMPLETION *c) {
+
+	outstanding--;
+	doneSum += c->Latency;
+	if(c->Result == MQTT_SUCCESS)
+		delivered++;
+	else
+		failed++;
+	}
+
+// Latency under which pct % of the arrivals were, ms; in the open
+// ended last bucket all that is known is that it is longer
+static const char *SimPercentile(BYTE pct, char *buf) {
+	QWORD want = (QWORD)arrived * pct / 100, seen = 0;
+	DWORD i;
+
+	for(i=0; i<SIM_HISTOGRAM-1; i++) {
+		seen += latHist[i];
+		if(seen > want)
+			break;
+		}
+	sprintf(buf, i < SIM_HISTOGRAM-1 ? "%u" : ">%u", i);
+	return buf;
+	}
+
+// The probe table; FALSE if the probes are not built in, or fewer of the
+// socket writes were timed than PUBLISHes reached the broker
+static BOOL SimProfile(const SIM_STATS *st) {
+#if MQTT_PROFILING
+	MQTT_PROF_STAT s;
+	BYTE p;
+
+	printf("probe         calls, min, avg, max %s\n",
+#if defined(__x86_64__) || defined(__i386__)
+		"TSC cycles");
+#else
+		"ns");
+#endif
+	for(p=0; MQTTProfGet(p, &s); p++)
+		printf("  %-15s %9u %9u %9u %9u\n", s.Name, s.Count, s.Min, s.Avg, s.Max);
+	return MQTTProfGet(MQTT_PROF_PUT_ARRAY, &s) && s.Count >= st->Publishes;
+#else
+	(void)st;
+	printf("probe         none built in, see mqttprof\n");
+	return FALSE;
+#endif
+	}
+
+static void SimCapturePut(BYTE b) {
+
+	fputc(b, capFile);
+	}
+
+static void SimUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttsim [options]\n"
+		"  -n N     messages (100000)\n"
+		"  -b N     messages kept queued (1)\n"
+		"  -d ms    one way delay (20)\n"
+		"  -j ms    jitter (0)\n"
+		"  -l %%     segments dropped, retransmitted after the RTO (0)\n"
+		"  -r %%     segments reordered (0)\n"
+		"  -f N     broker replies cut into N byte segments (0 = whole)\n"
+		"  -x %%     CONNECTs refused (0)\n"
+		"  -c %%     PUBLISHes the broker closes the connection after (0)\n"
+		"  -o ms    retransmission timeout (200)\n"
+		"  -t N     client TX FIFO bytes (512)\n"
+		"  -q ms    longest clock jump (10)\n"
+		"  -R N     attempts per message (1)\n"
+		"  -v N     MQTT protocol level (3)\n"
+		"  -p       pipelining\n"
+		"  -a       adaptive link (with -p)\n"
+		"  -L b,f,w fixed link: batch, flush delay ms, window bytes (with -p)\n"
+		"  -S file  save delivery and throughput\n"
+		"  -B file  fail unless this run beats the one saved there\n"
+		"  -s N     seed (1)\n"
+		"  -w file  save the wire traffic as a capture\n"
+		"  -P       print the profiling probes (mqttprof)\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	SIM_LINK link;
+	const SIM_STATS *st;
+	const MQTT_LINK_PARAMS *lp;
+	struct timespec t0, t1;
+	DWORD messages = 100000, burst = 1, queued = 0, quantum = 10*SIM_MS;
+	DWORD now = 0, slot, end;
+	QWORD taskCalls = 0;
+	BYTE attempts = 1, ver = MQTTPROTOCOLVERSION;
+	BOOL pipelining = FALSE, adaptive = FALSE, beaten = TRUE, profile = FALSE, profiled = TRUE;
+	const char *capName = NULL, *saveName = NULL, *beatName = NULL;
+	unsigned fixBatch = 0, fixFlush = 0, fixWindow = 0, baseDelivered;
+	double baseRate;
+	FILE *f;
+	char p50[12], p99[12];
+	double wall;
+	int c;
+
+	memset(&link, 0, sizeof(link));
+	link.Delay = 20*SIM_MS;
+	link.Rto = 200*SIM_MS;
+	link.TxFifo = 512;
+	link.RxFifo = 512;
+	link.Seed = 1;
+	link.OnPublish = SimArrived;
+	while((c = getopt(argc, argv, "n:b:d:j:l:r:f:x:c:o:t:q:R:v:pas:w:L:S:B:P")) != -1) {
+		switch(c) {
+			case 'n':	messages = strtoul(optarg, NULL, 10);			break;
+			case 'b':	burst = strtoul(optarg, NULL, 10);				break;
+			case 'd':	link.Delay = strtoul(optarg, NULL, 10)*SIM_MS;	break;
+			case 'j':	link.Jitter = strtoul(optarg, NULL, 10)*SIM_MS;	break;
+			case 'l':	link.Drop = atoi(optarg);						break;
+			case 'r':	link.Reorder = atoi(optarg);					break;
+			case 'f':	link.Fragment = atoi(optarg);					break;
+			case 'x':	link.Refuse = atoi(optarg);						break;
+			case 'c':	link.Cut = atoi(optarg);						break;
+			case 'o':	link.Rto = strtoul(optarg, NULL, 10)*SIM_MS;	break;
+			case 't':	link.TxFifo = atoi(optarg);						break;
+			case 'q':	quantum = strtoul(optarg, NULL, 10)*SIM_MS;		break;
+			case 'R':	attempts = atoi(optarg);						break;
+			case 'v':	ver = atoi(optarg);								break;
+			case 'p':	pipelining = TRUE;								break;
+			case 'a':	adaptive = TRUE;								break;
+			case 's':	link.Seed = strtoul(optarg, NULL, 10);			break;
+			case 'w':	capName = optarg;								break;
+			case 'L':
+				if(sscanf(optarg, "%u,%u,%u", &fixBatch, &fixFlush, &fixWindow) != 3 || !fixBatch)
+					SimUsage();
+				break;
+			case 'S':	saveName = optarg;								break;
+			case 'B':	beatName = optarg;								break;
+			case 'P':	profile = TRUE;									break;
+			default:	SimUsage();
+			}
+		}
+	if(!burst || burst > 16 || !quantum)
+		SimUsage();
+
+	SimInit(&link);
+	MqttClientInit();
+	MqttSetPipelining(pipelining);
+	MqttSetAdaptive(adaptive);
+	if(fixBatch)
+		MqttSetLinkParams(fixBatch, fixFlush*SIM_MS, fixWindow);
+	MqttSetProtocolVersion(ver);
+	MqttSetRetryPolicy(attempts, TICK_SECOND/10, 0);
+	if(capName)
+		MQTTCaptureStart();
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	while(delivered + failed < messages) {
+		// the application: keeps burst messages queued
+		while(queued < messages && outstanding < burst) {
+			slot = queued % SIM_POOL;
+			sprintf(simPayload[slot], "seq=%u", queued);
+			simQueuedAt[slot] = now;
+			simSeq[slot] = queued;
+			simArrived[slot] = FALSE;
+			if(MqttQueueMsgWithCallback((byte*)simPayload[slot], (byte*)"sim/t", (byte*)"simclient",
+				NULL, NULL, NULL, SimDone) >= MQTT_QUEUE_FULL)
+				break;
+			queued++;
+			outstanding++;
+			}
+
+		MQTTClientTask();
+		MQTTTask();
+		taskCalls++;
+
+		if(SimPass(quantum))
+			now = TickGet();
+		}
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	// the last PUBLISH may still be on the wire, a dropped segment an Rto longer
+	for(end = TickGet(); arrived < delivered && TickGet() - end < TICK_SECOND + 2*(link.Delay + link.Jitter + link.Rto);
+		SimPass(quantum)) {
+		MQTTClientTask();
+		MQTTTask();
+		}
+	st = SimGetStats();
+	if(capName) {
+		if(!(capFile = fopen(capName, "wb"))) {
+			perror(capName);
+			return 1;
+			}
+		printf("capture       %u bytes to %s%s\n", MQTTCaptureDump(SimCapturePut), capName,
+			MQTTCaptureFull() ? ", full before the end" : "");
+		fclose(capFile);
+		}
+
+	printf("messages      %u delivered, %u failed, %u reached the broker, %u of them twice\n",
+		delivered, failed, arrived, duplicates);
+	printf("virtual time  %.3f s\n", (double)now / TICK_SECOND);
+	printf("task calls    %llu each (%.1f per message)\n", taskCalls, (double)taskCalls / messages);
+	if(arrived)
+		printf("to broker     min %.1f  avg %.1f  p50 %s  p99 %s  max %.1f ms\n",
+			(double)latMin / SIM_MS, (double)latSum / arrived / SIM_MS,
+			SimPercentile(50, p50), SimPercentile(99, p99), (double)latMax / SIM_MS);
+	printf("to completion avg %.1f ms\n", (double)doneSum / messages / SIM_MS);
+	printf("link          %u connects (%u refused, %u cut), %u segments, %u dropped, %u reordered, %u/%u bytes up/down\n",
+		st->Connects, st->Refused, st->Cuts, st->Segments, st->Dropped, st->Reordered, st->BytesUp, st->BytesDown);
+	if(adaptive || fixBatch) {
+		lp = MqttGetLinkParams();
+		printf("%s      batch %u, flush %.1f ms, window %u, rtt %.1f ms, ack rate %u%%\n",
+			adaptive ? "adaptive" : "fixed   ", lp->BatchMax, (double)lp->FlushDelay / SIM_MS, lp->Window, (double)lp->Rtt / SIM_MS, lp->AckRate);
+		}
+	printf("wall          %.3f s, %.0f sessions/s, %.0f task passes/s\n",
+		wall, st->Connects / wall, taskCalls / wall);
+	if(profile)
+		profiled = SimProfile(st);
+
+	// delivery and messages per virtual second, against another run
+	if(saveName) {
+		if(!(f = fopen(saveName, "w"))) {
+			perror(saveName);
+			return 1;
+			}
+		fprintf(f, "%u %.6f\n", delivered, delivered * (double)TICK_SECOND / now);
+		fclose(f);
+		}
+	if(beatName) {
+		if(!(f = fopen(beatName, "r")) || fscanf(f, "%u %lf", &baseDelivered, &baseRate) != 2) {
+			perror(beatName);
+			return 1;
+			}
+		fclose(f);
+		beaten = delivered >= baseDelivered && delivered * (double)TICK_SECOND / now > baseRate;
+		printf("against %s  %u delivered, %.1f/s there; %.1f/s here, %s\n", beatName, baseDelivered, baseRate,
+			delivered * (double)TICK_SECOND / now, beaten ? "beaten" : "NOT beaten");
+		}
+	return failed || duplicates || arrived != delivered || !beaten || !profiled ? 2 : 0;
+	}
@@ -0,0 +1,954 @@
+/*********************************************************************
+ *
+ *                  Simulated network and broker
+ *
+ *********************************************************************
+ * FileName:        SimStack.c
+ * Dependencies:    TCPIP.h (the simulated one)
+ * Processor:       host
+ *
+ * Virtual TickGet, one TCP socket over a scripted link, a DNS that
+ * always resolves and a minimal broker at the other end, or one of the
+ * stand-ins of SimAddBroker.  Nothing runs
+ * on its own: SimStep moves whatever is due at the current tick, the
+ * driver sets the tick (SimSetTick) and skips idle time (SimNextEvent).
+ ********************************************************************/
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "SimStack.h"
+
+#define SIM_MSS				536
+#define SIM_SEGMENTS		128			// in flight each way
+#define SIM_FIFO_MAX		4096
+#define SIM_BROKER_BUFFER	4096
+#define SIM_AUTO_FLUSH		(TICK_SECOND/25)	// unflushed TX data goes out after this, as TCP.c does
+#define SIM_IDLE_PASSES		8			// SimPass calls without I/O before the clock jumps
+#define SIM_PUSH_IDS		256			// message ids of broker PUBLISHes, in turn
+#define SIM_PUSH_WINDOW		4			// of them unacknowledged, a broker's receive maximum
+#define SIM_ALIASES			16			// MQTT 5 topic aliases the broker takes at most
+#define SIM_TOPIC			128			// longest topic passed to OnPublish + 1
+#define SIM_BROKERS			4			// SimAddBroker stand-ins, 10.0.1.1 on
+
+typedef struct {
+	DWORD At;				// reaches the other end
+	WORD Len;
+	BOOL Fin;				// end of a connection, Len is 0
+	BYTE Data[SIM_MSS];
+	} SIM_SEGMENT;
+
+typedef struct {
+	SIM_SEGMENT Seg[SIM_SEGMENTS];
+	WORD Head;
+	WORD Count;
+	} SIM_PIPE;
+
+static SIM_LINK simLink;
+static SIM_STATS simStats;
+static DWORD simTick;
+static DWORD simRandom;
+static BOOL simActivity;
+static BYTE simIdle;					// SimPass calls since something moved
+
+static SIM_PIPE upPipe;					// client to broker
+static SIM_PIPE downPipe;				// broker to client
+
+// The client socket
+static enum {
+	SOCK_CLOSED = 0,
+	SOCK_SYN,
+	SOCK_OPEN
+	} sockState;
+static DWORD synAt;
+static BOOL synNever;					// the broker is down, the SYN is not answered
+static DWORD sockDelay;					// one way delay of the broker connected to
+static BYTE txFifo[SIM_FIFO_MAX];		// written, not sent yet
+static WORD txLen;
+static DWORD txSince;					// TickGet() of the oldest unsent byte
+static WORD txUnacked;					// sent, still taking FIFO room
+static struct {
+	DWORD At;
+	WORD Len;
+	} txAcks[SIM_SEGMENTS];
+static WORD ackHead, ackCount;
+static BYTE rxFifo[SIM_FIFO_MAX];
+static WORD rxHead, rxLen;
+
+static BOOL dnsBusy, dnsPending;
+static DWORD dnsAt;
+static BYTE dnsBroker;					// stand-in the name resolved to, SIM_BROKERS for none
+
+// Stand-ins for failover brokers, each behind its own address
+static SIM_BROKER simBrokers[SIM_BROKERS];
+static BYTE simBrokerCount;
+static BYTE sockBroker;					// stand-in of the connection, SIM_BROKERS for none
+
+// The broker side of the connection
+static BYTE brokerIn[SIM_BROKER_BUFFER];
+static WORD brokerLen;
+static BYTE brokerVer;
+static BOOL brokerAccepted;				// CONNACK 0 sent, frames behind a refusal are ignored
+static BOOL brokerCut;					// closed the connection, still reads until the client does
+static BOOL brokerSession;				// the last accepted CONNECT had clean session off
+static BOOL pushOpen[SIM_PUSH_IDS];		// QOS1 PUBLISH sent to the client, PUBACK not in yet
+static DWORD pushEnd[SIM_PUSH_IDS];		// downWritten at its last byte
+static WORD pushId, pushesOpen;
+static DWORD pingsOpen;					// PINGREQs sent to the client, PINGRESP not in yet
+static DWORD pingEnd;
+static DWORD downWritten, rxRead;		// bytes of this connection the broker wrote, the client read
+static char brokerAlias[SIM_ALIASES][SIM_TOPIC];	// topic of alias index+1, "" = not set
+static BYTE brokerAliasMax;				// sent in the CONNACK
+
+static BYTE simHostname[] = "broker.sim";
+static BYTE simPasswd[] = "";
+
+
+// xorshift32, so that a seed replays the same run
+static DWORD SimRandom(void) {
+
+	simRandom ^= simRandom << 13;
+	simRandom ^= simRandom >> 17;
+	simRandom ^= simRandom << 5;
+	return simRandom;
+	}
+
+static BOOL SimChance(BYTE pct) {
+
+	return pct && SimRandom() % 100 < pct;
+	}
+
+// Arrival time of a segment sent now, drops and reordering applied
+static DWORD SimArrival(SIM_PIPE *p) {
+	DWORD at = simTick + sockDelay;
+	SIM_SEGMENT *prev;
+	DWORD t;
+
+	if(simLink.Jitter)
+		at += SimRandom() % (simLink.Jitter + 1);
+	if(SimChance(simLink.Drop)) {
+		at += simLink.Rto;
+		simStats.Dropped++;
+		}
+	if(p->Count && SimChance(simLink.Reorder)) {
+		prev = &p->Seg[(p->Head + p->Count - 1) % SIM_SEGMENTS];
+		if(!prev->Fin && prev->At < at) {
+			t = prev->At;
+			prev->At = at;
+			at = t;
+			simStats.Reordered++;
+			}
+		}
+	return at;
+	}
+
+static SIM_SEGMENT *SimQueue(SIM_PIPE *p) {
+	SIM_SEGMENT *s;
+
+	if(p->Count == SIM_SEGMENTS) {
+		fprintf(stderr, "sim: more than %u segments in flight\n", SIM_SEGMENTS);
+		exit(2);
+		}
+	s = &p->Seg[(p->Head + p->Count) % SIM_SEGMENTS];
+	s->At = SimArrival(p);
+	s->Fin = FALSE;
+	s->Len = 0;
+	p->Count++;
+	simStats.Segments++;
+	return s;
+	}
+
+// Sends what the client wrote; the FIFO room comes back with the ack
+static void SimFlushTx(void) {
+	SIM_SEGMENT *s;
+	WORD n, off = 0;
+
+	while(off < txLen) {
+		n = txLen - off > SIM_MSS ? SIM_MSS : txLen - off;
+		s = SimQueue(&upPipe);
+		memcpy(s->Data, txFifo + off, n);
+		s->Len = n;
+		txAcks[(ackHead + ackCount) % SIM_SEGMENTS].At = s->At + sockDelay;
+		txAcks[(ackHead + ackCount) % SIM_SEGMENTS].Len = n;
+		ackCount++;
+		txUnacked += n;
+		simStats.BytesUp += n;
+		off += n;
+		}
+	txLen = 0;
+	}
+
+// Broker reply, cut into segments of simLink.Fragment bytes
+static void SimReply(const BYTE *frame, WORD len) {
+	SIM_SEGMENT *s;
+	WORD n, max = simLink.Fragment && simLink.Fragment < SIM_MSS ? simLink.Fragment : SIM_MSS;
+
+	if(sockState == SOCK_CLOSED || brokerCut)
+		return;
+	while(len) {
+		n = len > max ? max : len;
+		s = SimQueue(&downPipe);
+		memcpy(s->Data, frame, n);
+		s->Len = n;
+		simStats.BytesDown += n;
+		downWritten += n;
+		frame += n;
+		len -= n;
+		}
+	}
+
+// Remaining length field at p, 0 if incomplete
+static BYTE SimLength(const BYTE *p, WORD avail, DWORD *length) {
+	BYTE i;
+
+	*length = 0;
+	for(i=0; i<4 && i<avail; i++) {
+		*length |= (DWORD)(p[i] & 0x7F) << (7*i);
+		if(!(p[i] & 0x80))
+			return i+1;
+		}
+	return 0;
+	}
+
+// The broker closes the connection: the FIN goes down behind its replies
+static void SimBrokerCut(void) {
+	SIM_SEGMENT *s;
+	WORD i;
+
+	// not if the client closed it first, a new connection may be up already
+	if(sockState != SOCK_OPEN)
+		return;
+	for(i=0; i<upPipe.Count; i++)
+		if(upPipe.Seg[(upPipe.Head + i) % SIM_SEGMENTS].Fin)
+			return;
+	s = SimQueue(&downPipe);
+	s->Fin = TRUE;
+	brokerCut = TRUE;
+	memset(pushOpen, 0, sizeof(pushOpen));
+	pushesOpen = 0;
+	pingsOpen = 0;
+	simStats.Cuts++;
+	}
+
+// Applies the Topic Alias of a PUBLISH: a topic sets the alias, an empty
+// one is replaced by it.  FALSE for properties a broker would reject
+static BOOL SimBrokerAlias(const BYTE *p, DWORD len, char *topic, WORD tl) {
+	DWORD i = 0;
+	WORD alias = 0;
+
+	while(i < len) {
+		if(p[i] != 0x23 || i + 3 > len)		// the client sends no other property
+			return FALSE;
+		alias = MAKEWORD(p[i+2], p[i+1]);
+		i += 3;
+		}
+	if(!alias)
+		return tl != 0;
+	if(alias > brokerAliasMax)
+		return FALSE;
+	simStats.AliasBytes += 3;
+	if(tl) {
+		strcpy(brokerAlias[alias-1], topic);
+		return TRUE;
+		}
+	if(!brokerAlias[alias-1][0])
+		return FALSE;
+	strcpy(topic, brokerAlias[alias-1]);
+	simStats.AliasedBytes += strlen(topic);
+	return TRUE;
+	}
+
+// Answers one complete frame from the client
+static void SimBrokerFrame(const BYTE *f, WORD len, BYTE llen) {
+	const BYTE *v = f + 1 + llen;			// variable header
+	WORD vlen = len - 1 - llen;
+	BYTE reply[4 + 2 + 1 + 16];
+	char topic[SIM_TOPIC];
+	DWORD props;
+	WORD pos, tl, n;
+	BYTE qos;
+
+	if(!brokerAccepted && (f[0] & 0xF0) != MQTTCONNECT)
+		return;
+	// what a client may send, and the flags it must have
+	switch(f[0] & 0xF0) {
+		case MQTTPUBLISH:
+			break;
+		case MQTTSUBSCRIBE:
+		case MQTTUNSUBSCRIBE:
+			if((f[0] & 0x0F) != 0x02)
+				simStats.Malformed++;
+			break;
+		case MQTTCONNECT:
+		case MQTTPUBACK:
+		case MQTTPINGREQ:
+		case MQTTPINGRESP:
+		case MQTTDISCONNECT:
+			if(f[0] & 0x0F)
+				simStats.Malformed++;
+			break;
+		default:
+			simStats.Malformed++;
+			return;
+		}
+	switch(f[0] & 0xF0) {
+		case MQTTCONNECT:
+			simStats.Connects++;
+			tl = MAKEWORD(v[1], v[0]);
+			brokerVer = vlen > 2 + tl ? v[2 + tl] : MQTT_VERSION_3_1;
+			brokerAliasMax = brokerVer < MQTT_VERSION_5 ? 0 : simLink.AliasMax < SIM_ALIASES ? simLink.AliasMax : SIM_ALIASES;
+			memset(brokerAlias, 0, sizeof(brokerAlias));	// aliases live as long as the connection
+			brokerCut = FALSE;
+			reply[0] = MQTTCONNACK;
+			reply[1] = brokerVer >= MQTT_VERSION_5 ? 3 : 2;
+			// session present: clean session off now and on the last connection
+			reply[2] = brokerVer >= MQTT_VERSION_3_1_1 && vlen > 3 + tl && !(v[3 + tl] & 0x02) && brokerSession;
+			reply[3] = 0;
+			brokerAccepted = TRUE;
+			if(sockBroker < SIM_BROKERS)
+				simBrokers[sockBroker].Connects++;
+			if(SimChance(sockBroker < SIM_BROKERS ? simBrokers[sockBroker].Refuse : simLink.Refuse)) {
+				reply[3] = brokerVer >= MQTT_VERSION_5 ? 0x88 : 3;
+				simStats.Refused++;
+				brokerAccepted = FALSE;
+				reply[2] = 0;
+				}
+			else
+				brokerSession = vlen > 3 + tl && !(v[3 + tl] & 0x02);
+			reply[4] = 0;						// MQTT 5: no properties
+			if(brokerAliasMax) {
+				reply[4] = 3;
+				reply[5] = 0x22;				// Topic Alias Maximum
+				reply[6] = 0;
+				reply[7] = brokerAliasMax;
+				reply[1] += 3;
+				}
+			SimReply(reply, 2 + reply[1]);
+			break;
+
+		case MQTTPUBLISH:
+			simStats.Publishes++;
+			if(sockBroker < SIM_BROKERS)
+				simBrokers[sockBroker].Publishes++;
+			qos = (f[0] >> 1) & 3;
+			if(f[0] & 0x08)
+				simStats.DupPublishes++;
+			tl = MAKEWORD(v[1], v[0]);
+			simStats.TopicBytes += tl;
+			topic[0] = 0;
+			if(tl < SIM_TOPIC) {
+				memcpy(topic, v + 2, tl);
+				topic[tl] = 0;
+				}
+			pos = 2 + tl;
+			if(qos)
+				pos += 2;
+			if(brokerVer >= MQTT_VERSION_5) {
+				n = SimLength(v + pos, vlen - pos, &props);
+				pos += n;
+				if(!SimBrokerAlias(v + pos, props, topic, tl))
+					simStats.Malformed++;
+				pos += props;
+				}
+			if(simLink.OnPublish && pos <= vlen)
+				simLink.OnPublish(topic, v + pos, vlen - pos);
+			if(qos) {
+				reply[0] = qos == 1 ? MQTTPUBACK : MQTTPUBREC;
+				reply[1] = 2;
+				reply[2] = v[2 + tl];
+				reply[3] = v[3 + tl];
+				SimReply(reply, 4);
+				}
+			if(!brokerCut && SimChance(simLink.Cut))
+				SimBrokerCut();
+			break;
+
+		case MQTTSUBSCRIBE:
+		case MQTTUNSUBSCRIBE:
+			// one return code per filter, the QOS asked for
+			pos = 2;
+			n = 4;
+			reply[0] = (f[0] & 0xF0) == MQTTSUBSCRIBE ? MQTTSUBACK : MQTTUNSUBACK;
+			reply[2] = v[0];
+			reply[3] = v[1];
+			if(brokerVer >= MQTT_VERSION_5) {
+				pos += SimLength(v + pos, vlen - pos, &props);
+				pos += props;
+				reply[n++] = 0;
+				}
+			while(pos + 2 <= vlen && n < sizeof(reply)) {
+				tl = MAKEWORD(v[pos+1], v[pos]);
+				pos += 2 + tl;
+				if(reply[0] == MQTTSUBACK)
+					reply[n++] = v[pos++] & 3;
+				else if(brokerVer >= MQTT_VERSION_5)
+					reply[n++] = 0;
+				}
+			reply[1] = n - 2;
+			SimReply(reply, n);
+			break;
+
+		case MQTTPINGREQ:
+			simStats.Pings++;
+			reply[0] = MQTTPINGRESP;
+			reply[1] = 0;
+			SimReply(reply, 2);
+			break;
+
+		// answers to SimBrokerPing and SimBrokerPublish, each expected once
+		case MQTTPINGRESP:
+			if(vlen || !pingsOpen)
+				simStats.Malformed++;
+			else {
+				pingsOpen--;
+				simStats.PingResps++;
+				}
+			break;
+
+		case MQTTPUBACK:
+			tl = vlen >= 2 ? MAKEWORD(v[1], v[0]) : 0;
+			if(vlen < 2 || (brokerVer < MQTT_VERSION_5 && vlen != 2) || !tl || tl > SIM_PUSH_IDS || !pushOpen[tl-1])
+				simStats.Malformed++;
+			else {
+				pushOpen[tl-1] = FALSE;
+				pushesOpen--;
+				simStats.PubAcks++;
+				}
+			break;
+		}
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL SimBrokerPing(void)
+	BOOL SimBrokerPublish(const char *topic, const BYTE *payload, WORD len)
+
+  Summary:
+	Sends the client a PINGREQ, or a QOS1 PUBLISH, from the broker
+
+  Description:
+	Brokers do not ping their clients, but a client must answer one at
+	any time, as it must PUBACK a QOS1 PUBLISH; both land in the middle
+	of whatever the client is sending.  Like real peers the broker waits
+	for the PINGRESP before the next PINGREQ and keeps at most
+	SIM_PUSH_WINDOW PUBLISHes unacknowledged.  The answers are counted in
+	SIM_STATS, a second or unexpected one as Malformed; what the client
+	closed the connection on before reading it is Unread, anything else
+	it still owes is lost with the connection.
+
+  Returns:
+	FALSE if the broker has no accepted connection to send it on, or
+	is still waiting for answers
+  ***************************************************************************/
+BOOL SimBrokerPing(void) {
+	static const BYTE f[2] = {MQTTPINGREQ, 0};
+
+	if(!brokerAccepted || sockState != SOCK_OPEN || pingsOpen)
+		return FALSE;
+	SimReply(f, 2);
+	pingEnd = downWritten;
+	pingsOpen++;
+	simStats.PushedPings++;
+	return TRUE;
+	}
+
+BOOL SimBrokerPublish(const char *topic, const BYTE *payload, WORD len) {
+	BYTE f[SIM_MSS];
+	WORD tl = strlen(topic), n;
+	DWORD rl = 2 + tl + 2 + (brokerVer >= MQTT_VERSION_5 ? 1 : 0) + len;
+
+	if(!brokerAccepted || sockState != SOCK_OPEN || rl > 127 || pushesOpen >= SIM_PUSH_WINDOW || pushOpen[pushId])
+		return FALSE;
+	f[0] = MQTTPUBLISH | MQTTQOS1;
+	f[1] = rl;
+	f[2] = HIBYTE(tl);
+	f[3] = LOBYTE(tl);
+	memcpy(f+4, topic, tl);
+	n = 4 + tl;
+	f[n++] = HIBYTE(pushId+1);
+	f[n++] = LOBYTE(pushId+1);
+	if(brokerVer >= MQTT_VERSION_5)
+		f[n++] = 0;						// no properties
+	memcpy(f+n, payload, len);
+	SimReply(f, n + len);
+	pushOpen[pushId] = TRUE;
+	pushEnd[pushId] = downWritten;
+	pushesOpen++;
+	pushId = (pushId + 1) % SIM_PUSH_IDS;
+	simStats.PushedPublishes++;
+	return TRUE;
+	}
+
+// Takes in a segment that reached the broker and answers the frames it completes
+static void SimBrokerReceive(const SIM_SEGMENT *s) {
+	DWORD length;
+	WORD used = 0, len;
+	BYTE llen;
+
+	if(s->Fin) {
+		brokerLen = 0;
+		brokerAccepted = FALSE;
+		memset(pushOpen, 0, sizeof(pushOpen));		// answers the client still owed are lost with it
+		pushesOpen = 0;
+		pingsOpen = 0;
+		return;
+		}
+	if(brokerLen + s->Len > SIM_BROKER_BUFFER) {
+		fprintf(stderr, "sim: broker buffer overflow\n");
+		exit(2);
+		}
+	memcpy(brokerIn + brokerLen, s->Data, s->Len);
+	brokerLen += s->Len;
+	while(brokerLen - used >= 2) {
+		llen = SimLength(brokerIn + used + 1, brokerLen - used - 1, &length);
+		if(!llen || (DWORD)(brokerLen - used) < 1 + llen + length)
+			break;
+		len = 1 + llen + length;
+		SimBrokerFrame(brokerIn + used, len, llen);
+		used += len;
+		}
+	memmove(brokerIn, brokerIn + used, brokerLen - used);
+	brokerLen -= used;
+	}
+
+// Drops the client side of the connection; what is on its way up still
+// reaches the broker, followed by the close.  Broker frames the client
+// never read all of are not owed an answer, the ones it read still are
+static void SimClose(void) {
+	SIM_SEGMENT *s;
+	WORD i;
+
+	if(sockState == SOCK_CLOSED)
+		return;
+	for(i=0; i<SIM_PUSH_IDS; i++) {
+		if(pushOpen[i] && pushEnd[i] > rxRead) {
+			pushOpen[i] = FALSE;
+			pushesOpen--;
+			simStats.Unread++;
+			}
+		}
+	if(pingsOpen && pingEnd > rxRead) {
+		pingsOpen = 0;
+		simStats.Unread++;
+		}
+	if(sockState == SOCK_OPEN) {
+		SimFlushTx();
+		s = SimQueue(&upPipe);
+		s->Fin = TRUE;
+		}
+	sockState = SOCK_CLOSED;
+	txLen = txUnacked = 0;
+	ackCount = 0;
+	rxLen = 0;
+	downPipe.Count = 0;
+	simActivity = TRUE;
+	}
+
+
+/*****************************************************************************
+  Function:
+	void SimInit(const SIM_LINK *l)
+
+  Summary:
+	Resets the simulation: link, clock, socket, broker and statistics
+  ***************************************************************************/
+void SimInit(const SIM_LINK *l) {
+
+	simLink = *l;
+	simIdle = 0;
+	if(!simLink.TxFifo || simLink.TxFifo > SIM_FIFO_MAX)
+		simLink.TxFifo = SIM_FIFO_MAX;
+	if(!simLink.RxFifo || simLink.RxFifo > SIM_FIFO_MAX)
+		simLink.RxFifo = SIM_FIFO_MAX;
+	simRandom = simLink.Seed ? simLink.Seed : 1;
+	memset(&simStats, 0, sizeof(simStats));
+	simTick = 0;
+	upPipe.Count = downPipe.Count = 0;
+	sockState = SOCK_CLOSED;
+	txLen = txUnacked = 0;
+	ackCount = 0;
+	rxLen = 0;
+	dnsBusy = dnsPending = FALSE;
+	simBrokerCount = 0;
+	sockBroker = dnsBroker = SIM_BROKERS;
+	sockDelay = simLink.Delay;
+	synNever = FALSE;
+	brokerLen = 0;
+	brokerCut = FALSE;
+	brokerSession = FALSE;
+	memset(pushOpen, 0, sizeof(pushOpen));
+	pushId = pushesOpen = 0;
+	pingsOpen = 0;
+	downWritten = rxRead = 0;
+	}
+
+/*****************************************************************************
+  Function:
+	void SimSetTick(DWORD t)
+
+  Summary:
+	Moves the virtual clock, TickGet() returns t from now on
+  ***************************************************************************/
+void SimSetTick(DWORD t) {
+
+	simTick = t;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL SimStep(void)
+
+  Summary:
+	Delivers what is due at the current tick
+
+  Description:
+	Segments that arrived go to the broker (which may answer) or to the
+	client RX FIFO, acks free TX FIFO room, a pending connect completes.
+	Call it once per main loop pass, like StackTask.
+
+  Returns:
+	TRUE if anything moved since the last call, the socket API included
+  ***************************************************************************/
+BOOL SimStep(void) {
+	SIM_SEGMENT *s;
+	WORD tail, first;
+	BOOL moved;
+
+	if(sockState == SOCK_SYN && !synNever && (LONG)(simTick - synAt) >= 0) {
+		sockState = SOCK_OPEN;
+		simActivity = TRUE;
+		}
+	if(sockState == SOCK_OPEN && txLen && (LONG)(simTick - txSince) >= (LONG)SIM_AUTO_FLUSH) {
+		SimFlushTx();
+		simActivity = TRUE;
+		}
+	while(ackCount && (LONG)(simTick - txAcks[ackHead].At) >= 0) {
+		txUnacked -= txAcks[ackHead].Len;
+		ackHead = (ackHead + 1) % SIM_SEGMENTS;
+		ackCount--;
+		simActivity = TRUE;
+		}
+
+	// in order only: a segment that arrives early waits for the ones before it
+	while(upPipe.Count && (LONG)(simTick - upPipe.Seg[upPipe.Head].At) >= 0) {
+		s = &upPipe.Seg[upPipe.Head];
+		upPipe.Head = (upPipe.Head + 1) % SIM_SEGMENTS;
+		upPipe.Count--;
+		SimBrokerReceive(s);
+		simActivity = TRUE;
+		}
+	while(downPipe.Count && (LONG)(simTick - downPipe.Seg[downPipe.Head].At) >= 0) {
+		s = &downPipe.Seg[downPipe.Head];
+		if(s->Fin) {
+			// closed by the broker, once the client has read what came before;
+			// the client side closes too, what it wrote still goes up first
+			if(rxLen)
+				break;
+			SimClose();
+			break;
+			}
+		if(rxLen + s->Len > simLink.RxFifo)
+			break;				// the window is closed until the client reads
+		tail = (rxHead + rxLen) % SIM_FIFO_MAX;
+		first = SIM_FIFO_MAX - tail;
+		if(first >= s->Len)
+			memcpy(rxFifo + tail, s->Data, s->Len);
+		else {
+			memcpy(rxFifo + tail, s->Data, first);
+			memcpy(rxFifo, s->Data + first, s->Len - first);
+			}
+		rxLen += s->Len;
+		downPipe.Head = (downPipe.Head + 1) % SIM_SEGMENTS;
+		downPipe.Count--;
+		simActivity = TRUE;
+		}
+
+	moved = simActivity;
+	simActivity = FALSE;
+	return moved;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL SimNextEvent(DWORD *at)
+
+  Summary:
+	Tells when something is due next, so that idle time can be skipped
+
+  Parameters:
+	at - set to the tick of the next arrival, ack, connect, DNS answer
+		or automatic flush
+
+  Returns:
+	FALSE if nothing is scheduled
+  ***************************************************************************/
+BOOL SimNextEvent(DWORD *at) {
+	BOOL any = FALSE;
+	DWORD t;
+	WORD i;
+
+#define SIM_EARLIEST(x)	{ t = (x); if(!any || (LONG)(t - *at) < 0) *at = t; any = TRUE; }
+	for(i=0; i<upPipe.Count; i++)
+		SIM_EARLIEST(upPipe.Seg[(upPipe.Head + i) % SIM_SEGMENTS].At);
+	for(i=0; i<downPipe.Count; i++)
+		SIM_EARLIEST(downPipe.Seg[(downPipe.Head + i) % SIM_SEGMENTS].At);
+	if(ackCount)
+		SIM_EARLIEST(txAcks[ackHead].At);
+	if(sockState == SOCK_SYN && !synNever)
+		SIM_EARLIEST(synAt);
+	if(sockState == SOCK_OPEN && txLen)
+		SIM_EARLIEST(txSince + SIM_AUTO_FLUSH);
+	if(dnsPending)
+		SIM_EARLIEST(dnsAt);
+#undef SIM_EARLIEST
+	return any;
+	}
+
+/*****************************************************************************
+  Function:
+	BOOL SimPass(DWORD quantum)
+
+  Summary:
+	SimStep for a driver loop that also owns the virtual clock
+
+  Description:
+	Time only moves once the tasks are waiting: after SIM_IDLE_PASSES
+	calls in a row without I/O the clock jumps to the next event, or by
+	quantum if nothing is due sooner.
+
+  Parameters:
+	quantum - longest jump, ticks
+
+  Returns:
+	TRUE if the clock moved
+  ***************************************************************************/
+BOOL SimPass(DWORD quantum) {
+	DWORD next;
+
+	if(SimStep()) {
+		simIdle = 0;
+		return FALSE;
+		}
+	if(++simIdle < SIM_IDLE_PASSES)
+		return FALSE;
+	if(SimNextEvent(&next) && (LONG)(next - simTick) < (LONG)quantum)
+		simTick = (LONG)(next - simTick) > 0 ? next : simTick + 1;
+	else
+		simTick += quantum;
+	simIdle = 0;
+	return TRUE;
+	}
+
+/*****************************************************************************
+  Function:
+	BYTE SimAddBroker(const SIM_BROKER *b)
+
+  Summary:
+	Adds a broker stand-in that the DNS resolves b->Name to
+
+  Description:
+	A connection to it takes its Delay instead of the link's and is
+	refused at its Refuse rate; while Down its SYNs go unanswered, so
+	the client times out as with a host that is gone.  Names not added
+	go to the default broker.  SimBroker gives the entry back to change
+	it during the run, or to read its counters.
+
+  Returns:
+	The index of the stand-in, SIM_BROKERS if the table is full
+  ***************************************************************************/
+BYTE SimAddBroker(const SIM_BROKER *b) {
+
+	if(simBrokerCount >= SIM_BROKERS)
+		return SIM_BROKERS;
+	simBrokers[simBrokerCount] = *b;
+	simBrokers[simBrokerCount].Connects = simBrokers[simBrokerCount].Publishes = 0;
+	return simBrokerCount++;
+	}
+
+SIM_BROKER *SimBroker(BYTE i) {
+
+	return i < simBrokerCount ? &simBrokers[i] : NULL;
+	}
+
+const SIM_STATS *SimGetStats(void) {
+
+	return &simStats;
+	}
+
+
+/****************************************************************************
+  Section:
+	Stack API, as used by MQTT.c and MQTTclient.c
+  ***************************************************************************/
+DWORD TickGet(void) {
+
+	return simTick;
+	}
+
+BOOL DNSBeginUsage(void) {
+
+	if(dnsBusy)
+		return FALSE;
+	dnsBusy = TRUE;
+	simActivity = TRUE;
+	return TRUE;
+	}
+
+void DNSResolve(BYTE *name, BYTE type) {
+	(void)type;
+
+	for(dnsBroker = 0; dnsBroker < simBrokerCount; dnsBroker++)
+		if(!strcmp((const char *)name, simBrokers[dnsBroker].Name))
+			break;
+	if(dnsBroker == simBrokerCount)
+		dnsBroker = SIM_BROKERS;
+	dnsPending = TRUE;
+	dnsAt = simTick + simLink.DnsDelay;
+	simActivity = TRUE;
+	}
+
+BOOL DNSIsResolved(IP_ADDR *ip) {
+
+	if(!dnsPending || (LONG)(simTick - dnsAt) < 0)
+		return FALSE;
+	ip->v[0] = 10;
+	ip->v[1] = 0;
+	ip->v[2] = dnsBroker < SIM_BROKERS ? 1 : 0;
+	ip->v[3] = dnsBroker < SIM_BROKERS ? dnsBroker+1 : 1;
+	dnsPending = FALSE;
+	simActivity = TRUE;
+	return TRUE;
+	}
+
+BOOL DNSEndUsage(void) {
+
+	dnsBusy = dnsPending = FALSE;
+	return TRUE;
+	}
+
+// One socket: SYN and SYN-ACK take a round trip, a lost SYN an Rto more
+TCP_SOCKET TCPOpen(DWORD remote, BYTE type, WORD port, BYTE purpose) {
+	IP_ADDR ip;
+
+	(void)type;
+	(void)port;
+	(void)purpose;
+
+	if(sockState != SOCK_CLOSED)
+		return INVALID_SOCKET;
+	ip.Val = remote;
+	sockBroker = ip.v[2] == 1 && ip.v[3] >= 1 && ip.v[3] <= simBrokerCount ? ip.v[3]-1 : SIM_BROKERS;
+	sockDelay = sockBroker < SIM_BROKERS ? simBrokers[sockBroker].Delay : simLink.Delay;
+	synNever = sockBroker < SIM_BROKERS && simBrokers[sockBroker].Down;
+	sockState = SOCK_SYN;
+	synAt = simTick + 2*sockDelay;
+	if(simLink.Jitter)
+		synAt += SimRandom() % (simLink.Jitter + 1);
+	if(SimChance(simLink.Drop)) {
+		synAt += simLink.Rto;
+		simStats.Dropped++;
+		}
+	txLen = txUnacked = 0;
+	ackCount = 0;
+	rxLen = 0;
+	downWritten = rxRead = 0;
+	simActivity = TRUE;
+	return 0;
+	}
+
+BOOL TCPIsConnected(TCP_SOCKET s) {
+	(void)s;
+
+	return sockState == SOCK_OPEN;
+	}
+
+void TCPDisconnect(TCP_SOCKET s) {
+	(void)s;
+
+	SimClose();
+	}
+
+void TCPClose(TCP_SOCKET s) {
+	(void)s;
+
+	SimClose();
+	}
+
+WORD TCPIsPutReady(TCP_SOCKET s) {
+	(void)s;
+
+	if(sockState != SOCK_OPEN)
+		return 0;
+	return simLink.TxFifo - txLen - txUnacked;
+	}
+
+WORD TCPPutArray(TCP_SOCKET s, BYTE *data, WORD len) {
+	WORD room = TCPIsPutReady(s);
+
+	if(len > room)
+		len = room;
+	if(!len)
+		return 0;
+	if(!txLen)
+		txSince = simTick;
+	memcpy(txFifo + txLen, data, len);
+	txLen += len;
+	simActivity = TRUE;
+	return len;
+	}
+
+BOOL TCPPut(TCP_SOCKET s, BYTE b) {
+
+	return TCPPutArray(s, &b, 1) == 1;
+	}
+
+void TCPFlush(TCP_SOCKET s) {
+	(void)s;
+
+	if(sockState == SOCK_OPEN && txLen)
+		SimFlushTx();
+	}
+
+WORD TCPIsGetReady(TCP_SOCKET s) {
+	(void)s;
+
+	return sockState == SOCK_OPEN ? rxLen : 0;
+	}
+
+// buf NULL discards, as MQTTReadPacket does with frames too big for it
+WORD TCPGetArray(TCP_SOCKET s, BYTE *buf, WORD len) {
+	WORD n, first;
+	(void)s;
+
+	if(sockState != SOCK_OPEN)
+		return 0;
+	n = len > rxLen ? rxLen : len;
+	if(buf) {
+		first = SIM_FIFO_MAX - rxHead;
+		if(first >= n)
+			memcpy(buf, rxFifo + rxHead, n);
+		else {
+			memcpy(buf, rxFifo + rxHead, first);
+			memcpy(buf + first, rxFifo, n - first);
+			}
+		}
+	rxHead = (rxHead + n) % SIM_FIFO_MAX;
+	rxLen -= n;
+	rxRead += n;
+	if(n)
+		simActivity = TRUE;
+	return n;
+	}
+
+BOOL TCPGet(TCP_SOCKET s, BYTE *b) {
+
+	return TCPGetArray(s, b, 1) == 1;
+	}
+
+BYTE *ipcGetHostServerHostname(void) {
+
+	return simHostname;
+	}
+
+BYTE *ipcGetHostServerPasswd(void) {
+
+	return simPasswd;
+	}
@@ -0,0 +1,100 @@
+/*********************************************************************
+ *
+ *                  Simulated network and broker
+ *
+ *********************************************************************
+ * FileName:        SimStack.h
+ * Dependencies:    TCPIP.h (the simulated one)
+ * Processor:       host
+ ********************************************************************/
+#ifndef __SIMSTACK_H
+#define __SIMSTACK_H
+
+/****************************************************************************
+  Function:
+      typedef struct SIM_LINK
+
+  Summary:
+    Behaviour of the simulated link, in ticks and percent
+
+  Description:
+    Every segment, either way, takes Delay plus up to Jitter ticks.  A
+    dropped segment is retransmitted Rto ticks later; a reordered one
+    swaps its arrival time with the segment sent before it.  TCP hands
+    bytes over in order, so both only show as extra delay to the
+    receiver, as on a real link.  Fragment cuts what the broker sends
+    into segments of at most that many bytes.  After a PUBLISH the
+    broker closes the connection at the Cut rate: it still reads what
+    the client sent before the close reached it, and answers nothing.
+
+  ***************************************************************************/
+typedef struct {
+	DWORD Delay;			// one way
+	DWORD Jitter;
+	DWORD Rto;
+	DWORD DnsDelay;
+	WORD Fragment;			// 0 = one segment per frame
+	BYTE Drop;				// %
+	BYTE Reorder;			// %
+	BYTE Refuse;			// % of CONNECTs refused (CONNACK 3, server unavailable)
+	BYTE Cut;				// % of PUBLISHes the broker closes the connection after
+	BYTE AliasMax;			// MQTT 5 Topic Alias Maximum in the CONNACK, 0 = none
+	WORD TxFifo;			// client TX FIFO, bytes
+	WORD RxFifo;			// client RX FIFO, bytes
+	DWORD Seed;
+	void (*OnPublish)(const char *topic, const BYTE *payload, WORD len);	// broker got a PUBLISH, alias resolved
+	} SIM_LINK;
+
+/****************************************************************************
+  Function:
+      typedef struct SIM_BROKER
+
+  Summary:
+    A failover broker stand-in, see SimAddBroker
+
+  ***************************************************************************/
+typedef struct {
+	const char *Name;		// what the DNS resolves to it
+	DWORD Delay;			// one way, instead of the link's
+	BYTE Refuse;			// % of CONNECTs refused
+	BOOL Down;				// SYNs go unanswered, for new connections
+	DWORD Connects;			// counted by the simulation
+	DWORD Publishes;
+	} SIM_BROKER;
+
+// What went over the link
+typedef struct {
+	DWORD Connects;
+	DWORD Refused;
+	DWORD Cuts;				// connections closed by the broker
+	DWORD Segments;
+	DWORD Dropped;
+	DWORD Reordered;
+	DWORD BytesUp;			// client to broker
+	DWORD BytesDown;
+	DWORD Publishes;
+	DWORD DupPublishes;		// sent again with DUP
+	DWORD Pings;
+	DWORD Malformed;		// frames from the client a broker would reject
+	DWORD PushedPings;		// SimBrokerPing
+	DWORD PushedPublishes;	// SimBrokerPublish
+	DWORD PingResps;		// answers to them
+	DWORD PubAcks;
+	DWORD Unread;			// pushed, the client closed the connection before reading them
+	DWORD TopicBytes;		// topic names in PUBLISHes
+	DWORD AliasBytes;		// MQTT 5 Topic Alias properties
+	DWORD AliasedBytes;		// topic names an alias stood in for
+	} SIM_STATS;
+
+void SimInit(const SIM_LINK *);
+void SimSetTick(DWORD);
+BOOL SimStep(void);
+BOOL SimNextEvent(DWORD *);
+BOOL SimPass(DWORD);
+BOOL SimBrokerPing(void);
+BOOL SimBrokerPublish(const char *, const BYTE *, WORD);
+BYTE SimAddBroker(const SIM_BROKER *);
+SIM_BROKER *SimBroker(BYTE);
+const SIM_STATS *SimGetStats(void);
+
+#endif
@@ -0,0 +1,176 @@
+/*********************************************************************
+ *
+ *                  MQTT request ring, two thread stress test
+ *
+ *********************************************************************
+ * FileName:        SpscMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c, MQTTclient.c
+ * Processor:       host
+ *
+ * A producer thread queues numbered messages as fast as the ring takes
+ * them while the main thread runs MQTTClientTask and MQTTTask against
+ * SimStack, so the lane counters wrap many times with both sides busy.
+ * The broker must see every message once and in order, and completions
+ * must come back in the same order; the exit status is 2 otherwise.
+ *
+ *   make -C sim mqttspsc
+ *   sim/mqttspsc -n 1000000 -p
+ ********************************************************************/
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "MQTTclient.h"
+#include "SimStack.h"
+
+#define SPSC_POOL			256		// payload buffers, more than the ring holds
+#define SPSC_MS				(TICK_SECOND/1000)
+
+static char spscPayload[SPSC_POOL][16];
+static DWORD messages = 100000;
+
+// Written by the producer
+static volatile DWORD produced, refused, shed;
+
+// Written by the consumer, the main thread
+static volatile DWORD completed;
+static DWORD failed, doneOrder;
+static DWORD arrived, duplicates, misordered;
+
+
+static DWORD SpscSeq(const BYTE *p, WORD len) {
+	char num[12];
+	WORD i;
+
+	for(i=0; i+4 < len && i < sizeof(num)-1; i++)
+		num[i] = p[i+4];
+	num[i] = 0;
+	return strtoul(num, NULL, 10);
+	}
+
+// Broker side, runs in the consumer's SimPass
+static void SpscArrived(const char *topic, const BYTE *payload, WORD len) {
+	DWORD seq;
+
+	(void)topic;
+	if(len < 5 || memcmp(payload, "seq=", 4))
+		return;
+	seq = SpscSeq(payload, len);
+	if(seq == arrived)
+		arrived++;
+	else if(seq < arrived)
+		duplicates++;
+	else {
+		misordered++;
+		arrived = seq + 1;
+		}
+	}
+
+static void SpscDone(const MQTT_COMPLETION *c) {
+
+	if(c->Result != MQTT_SUCCESS)
+		failed++;
+	if(SpscSeq(c->Msg, strlen((const char *)c->Msg)) != completed)
+		doneOrder++;
+	__sync_synchronize();			// done with the payload before the producer reuses it
+	completed++;
+	}
+
+// Refills each payload buffer only once its message has completed
+static void *SpscProducer(void *arg) {
+	MQTT_QUEUE_STATUS s;
+	char *p;
+
+	(void)arg;
+	while(produced < messages) {
+		if(produced - completed >= SPSC_POOL) {
+			sched_yield();
+			continue;
+			}
+		__sync_synchronize();
+		p = spscPayload[produced % SPSC_POOL];
+		sprintf(p, "seq=%u", produced);
+		s = MqttQueueMsgWithCallback((byte*)p, (byte*)"sim/spsc", (byte*)"simclient", NULL, NULL, NULL, SpscDone);
+		if(s >= MQTT_QUEUE_FULL) {
+			refused++;
+			sched_yield();
+			continue;
+			}
+		if(s == MQTT_QUEUE_DROPPED)
+			shed++;
+		produced++;
+		}
+	return NULL;
+	}
+
+static void SpscUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttspsc [options]\n"
+		"  -n N     messages (100000)\n"
+		"  -d ms    one way delay (1)\n"
+		"  -p       pipelining\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	SIM_LINK link;
+	pthread_t producer;
+	QWORD passes = 0;
+	DWORD drain;
+	BOOL pipelining = FALSE, ok;
+	int c;
+
+	memset(&link, 0, sizeof(link));
+	link.Delay = 1*SPSC_MS;
+	link.Rto = 200*SPSC_MS;
+	link.TxFifo = 512;
+	link.RxFifo = 512;
+	link.Seed = 1;
+	link.OnPublish = SpscArrived;
+	while((c = getopt(argc, argv, "n:d:p")) != -1) {
+		switch(c) {
+			case 'n':	messages = strtoul(optarg, NULL, 10);			break;
+			case 'd':	link.Delay = strtoul(optarg, NULL, 10)*SPSC_MS;	break;
+			case 'p':	pipelining = TRUE;								break;
+			default:	SpscUsage();
+			}
+		}
+	if(!messages)
+		SpscUsage();
+
+	SimInit(&link);
+	MqttClientInit();
+	MqttSetPipelining(pipelining);
+	if(pthread_create(&producer, NULL, SpscProducer, NULL)) {
+		perror("pthread_create");
+		return 1;
+		}
+
+	while(completed < messages) {
+		MQTTClientTask();
+		MQTTTask();
+		SimPass(SPSC_MS);
+		passes++;
+		if(completed == produced)
+			sched_yield();			// caught up, let the producer run on a single core
+		}
+	pthread_join(producer, NULL);
+	// the last PUBLISH may still be on the wire
+	for(drain = 0; arrived < messages && drain < 1000; drain++) {
+		MQTTClientTask();
+		MQTTTask();
+		SimPass(SPSC_MS);
+		}
+
+	printf("producer      %u queued, refused %u times while full, %u shed\n", produced, refused, shed);
+	printf("consumer      %u completed, %u failed, %u out of order, %llu passes\n",
+		completed, failed, doneOrder, passes);
+	printf("broker        %u in order, %u duplicates, %u out of order\n", arrived, duplicates, misordered);
+
+	ok = !failed && !doneOrder && !shed && arrived == messages && !duplicates && !misordered;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 2;
+	}
@@ -0,0 +1,194 @@
+/*********************************************************************
+ *
+ *                  MQTT client TX/RX stress test
+ *
+ *********************************************************************
+ * FileName:        StressMain.c
+ * Dependencies:    SimStack.c, mla_legacy/MQTT*.c, MQTTclient.c
+ * Processor:       host
+ *
+ * Publishes payloads several times the size of a small TX FIFO, so each
+ * PUBLISH is streamed over many passes, while the broker keeps sending
+ * PINGREQs and QOS1 PUBLISHes that the client must answer in between.
+ * Fails (exit status 2) if a message is lost or arrives damaged, if the
+ * broker sees a frame a real one would reject (a reply written into the
+ * middle of a PUBLISH), or if a frame of the broker the client read
+ * goes unanswered: only what a session closed on unread may.
+ *
+ * -u drives the client through MQTTClientTaskBudget alone, as a main
+ * loop that sleeps whenever it says the client is settled: a reply owed
+ * or a PUBLISH half sent that it overlooked would wait for the broker to
+ * wake the loop again.
+ *
+ *   make -C sim mqttstress
+ *   sim/mqttstress -n 2000 -t 48 -e 1
+ *   sim/mqttstress -n 2000 -p -u
+ ********************************************************************/
+#include <unistd.h>
+
+#include "TCPIPConfig.h"
+#include "TCPIP Stack/TCPIP.h"
+#include "MQTTclient.h"
+#include "SimStack.h"
+
+#define STRESS_POOL			64
+#define STRESS_PAYLOAD		120		// bytes of each message
+#define STRESS_MS			(TICK_SECOND/1000)
+#define STRESS_SLEEP		(10*STRESS_MS)	// -u: main loop sleep once the client is settled
+
+static char stressPayload[STRESS_POOL][STRESS_PAYLOAD+1];
+static BOOL stressArrived[STRESS_POOL];
+static DWORD outstanding, delivered, failed, arrived, damaged;
+
+
+// "seq=N;" then letters that follow from N, so any cut or splice shows
+static void StressFill(char *p, DWORD seq) {
+	WORD i;
+
+	i = sprintf(p, "seq=%u;", seq);
+	for(; i<STRESS_PAYLOAD; i++)
+		p[i] = 'a' + (seq + i) % 26;
+	p[STRESS_PAYLOAD] = 0;
+	}
+
+static void StressArrived(const char *topic, const BYTE *payload, WORD len) {
+	char want[STRESS_PAYLOAD+1];
+	DWORD seq;
+
+	(void)topic;
+	if(len != STRESS_PAYLOAD || memcmp(payload, "seq=", 4)) {
+		damaged++;
+		return;
+		}
+	seq = strtoul((const char *)payload + 4, NULL, 10);
+	StressFill(want, seq);
+	if(memcmp(payload, want, STRESS_PAYLOAD)) {
+		damaged++;
+		return;
+		}
+	if(!stressArrived[seq % STRESS_POOL]) {
+		stressArrived[seq % STRESS_POOL] = TRUE;
+		arrived++;
+		}
+	}
+
+static void StressDone(const MQTT_COMPLETION *c) {
+
+	outstanding--;
+	if(c->Result == MQTT_SUCCESS)
+		delivered++;
+	else
+		failed++;
+	}
+
+static void StressUsage(void) {
+
+	fprintf(stderr,
+		"usage: mqttstress [options]\n"
+		"  -n N     messages (2000)\n"
+		"  -t N     client TX FIFO bytes (48)\n"
+		"  -e ms    broker PINGREQ or PUBLISH every ms (1)\n"
+		"  -d ms    one way delay (5)\n"
+		"  -f N     broker frames cut into N byte segments (3)\n"
+		"  -p       pipelining\n"
+		"  -u       run the client through MQTTClientTaskBudget only\n"
+		"  -s N     seed (1)\n");
+	exit(1);
+	}
+
+int main(int argc, char **argv) {
+	SIM_LINK link;
+	const SIM_STATS *st;
+	DWORD messages = 2000, every = 1*STRESS_MS, queued = 0, slot, lastPush = 0, pushed, end;
+	BOOL pipelining = FALSE, budgeted = FALSE, ping = TRUE, ok;
+	MQTT_BUDGET budget = { 8, 512, 0, 0 };
+	DWORD sleeps = 0;
+	static const BYTE cmd[] = "set led=on";
+	int c;
+
+	memset(&link, 0, sizeof(link));
+	link.Delay = 5*STRESS_MS;
+	link.Rto = 200*STRESS_MS;
+	link.TxFifo = 48;
+	link.RxFifo = 512;
+	link.Fragment = 3;
+	link.Seed = 1;
+	link.OnPublish = StressArrived;
+	while((c = getopt(argc, argv, "n:t:e:d:f:pus:")) != -1) {
+		switch(c) {
+			case 'n':	messages = strtoul(optarg, NULL, 10);			break;
+			case 't':	link.TxFifo = atoi(optarg);						break;
+			case 'e':	every = strtoul(optarg, NULL, 10)*STRESS_MS;	break;
+			case 'd':	link.Delay = strtoul(optarg, NULL, 10)*STRESS_MS;	break;
+			case 'f':	link.Fragment = atoi(optarg);					break;
+			case 'p':	pipelining = TRUE;								break;
+			case 'u':	budgeted = TRUE;								break;
+			case 's':	link.Seed = strtoul(optarg, NULL, 10);			break;
+			default:	StressUsage();
+			}
+		}
+	if(!every || link.TxFifo < 8)
+		StressUsage();
+
+	SimInit(&link);
+	MqttClientInit();
+	MqttSetPipelining(pipelining);
+	while(delivered + failed < messages) {
+		while(queued < messages && outstanding < 4) {
+			slot = queued % STRESS_POOL;
+			StressFill(stressPayload[slot], queued);
+			stressArrived[slot] = FALSE;
+			if(MqttQueueMsgWithCallback((byte*)stressPayload[slot], (byte*)"sim/stress", (byte*)"simclient",
+				NULL, NULL, NULL, StressDone) >= MQTT_QUEUE_FULL)
+				break;
+			queued++;
+			outstanding++;
+			}
+
+		// the broker talks whenever it likes, mostly while a PUBLISH is half sent
+		if(TickGet() - lastPush >= every) {
+			if(ping ? SimBrokerPing() : SimBrokerPublish("sim/cmd", cmd, sizeof(cmd)-1))
+				ping = !ping;
+			lastPush = TickGet();
+			}
+
+		if(!budgeted) {
+			MQTTClientTask();
+			MQTTTask();
+			SimPass(STRESS_MS);
+			}
+		else if(MQTTClientTaskBudget(&budget))
+			SimPass(STRESS_MS);
+		else {
+			SimPass(STRESS_SLEEP);
+			sleeps++;
+			}
+		}
+	// the last PUBLISH may still be on the wire
+	for(end = TickGet(); arrived < delivered && TickGet() - end < TICK_SECOND; SimPass(STRESS_MS)) {
+		if(budgeted)
+			MQTTClientTaskBudget(&budget);
+		else {
+			MQTTClientTask();
+			MQTTTask();
+			}
+		}
+
+	st = SimGetStats();
+	pushed = st->PushedPings + st->PushedPublishes;
+	printf("messages      %u delivered, %u failed, %u reached the broker, %u damaged\n",
+		delivered, failed, arrived, damaged);
+	printf("broker sent   %u PINGREQ, %u QOS1 PUBLISH; answered %u PINGRESP, %u PUBACK; %u never read\n",
+		st->PushedPings, st->PushedPublishes, st->PingResps, st->PubAcks, st->Unread);
+	printf("link          %u connects, %u frames a broker would reject, %u/%u bytes up/down\n",
+		st->Connects, st->Malformed, st->BytesUp, st->BytesDown);
+	if(budgeted)
+		printf("main loop     slept %u times, %.3f s virtual\n", sleeps, (double)TickGet() / TICK_SECOND);
+
+	// every frame the client read is owed its answer, only what a session
+	// closed on before reading it may go without
+	ok = !failed && arrived == delivered && !damaged && !st->Malformed && st->PubAcks
+		&& st->PingResps + st->PubAcks + st->Unread == pushed;
+	printf("%s\n", ok ? "PASS" : "FAIL");
+	return ok ? 0 : 2;
+	}
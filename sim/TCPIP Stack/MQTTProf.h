@@ -0,0 +1,2 @@
+// Simulation build: the module header is the one of mla_legacy
+#include "../../mla_legacy/MQTTProf.h"
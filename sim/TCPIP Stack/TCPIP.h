@@ -0,0 +1,76 @@
+/*********************************************************************
+ *
+ *                  Simulated TCP/IP stack
+ *
+ *********************************************************************
+ * FileName:        TCPIP.h
+ * Dependencies:    none
+ * Processor:       host (Linux, any C99 compiler)
+ *
+ * The part of the Microchip TCP/IP stack API the MQTT client uses,
+ * implemented by sim/SimStack.c over virtual time and an in-memory
+ * broker.  MQTT.c and MQTTclient.c build against it unmodified.
+ ********************************************************************/
+#ifndef __TCPIP_H
+#define __TCPIP_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef unsigned char BYTE;
+typedef unsigned short WORD;
+typedef unsigned int DWORD;				// 32 bits, as on PIC32
+typedef int LONG;
+typedef unsigned long long QWORD;
+typedef int BOOL;
+typedef unsigned char byte;
+typedef unsigned short word;
+typedef unsigned char bool;
+
+#define TRUE	1
+#define FALSE	0
+#define ROM		const
+
+#define HIBYTE(a)			((BYTE)((a)>>8))
+#define LOBYTE(a)			((BYTE)(a))
+#define MAKEWORD(lo,hi)		((WORD)(((WORD)(hi)<<8)|(lo)))
+
+// Virtual time: one tick is 100 us
+#define TICK_SECOND		10000ul
+DWORD TickGet(void);
+
+typedef union {
+	DWORD Val;
+	BYTE v[4];
+	} IP_ADDR;
+
+#define DNS_TYPE_A		1
+BOOL DNSBeginUsage(void);
+void DNSResolve(BYTE *, BYTE);
+BOOL DNSIsResolved(IP_ADDR *);
+BOOL DNSEndUsage(void);
+
+typedef BYTE TCP_SOCKET;
+#define INVALID_SOCKET			0xFE
+#define TCP_OPEN_IP_ADDRESS		3
+#define TCP_PURPOSE_DEFAULT		0
+TCP_SOCKET TCPOpen(DWORD, BYTE, WORD, BYTE);
+BOOL TCPIsConnected(TCP_SOCKET);
+void TCPDisconnect(TCP_SOCKET);
+void TCPClose(TCP_SOCKET);
+WORD TCPIsPutReady(TCP_SOCKET);
+BOOL TCPPut(TCP_SOCKET, BYTE);
+WORD TCPPutArray(TCP_SOCKET, BYTE *, WORD);
+void TCPFlush(TCP_SOCKET);
+WORD TCPIsGetReady(TCP_SOCKET);
+BOOL TCPGet(TCP_SOCKET, BYTE *);
+WORD TCPGetArray(TCP_SOCKET, BYTE *, WORD);
+
+// Board services MqttClientInit reads the broker from
+BYTE *ipcGetHostServerHostname(void);
+BYTE *ipcGetHostServerPasswd(void);
+
+#include "../../mla_legacy/MQTT.h"
+
+#endif
@@ -0,0 +1,19 @@
+/*********************************************************************
+ *
+ *                  Simulation build configuration
+ *
+ *********************************************************************
+ * FileName:        TCPIPConfig.h
+ * Processor:       host
+ ********************************************************************/
+#ifndef __TCPIPCONFIG_H
+#define __TCPIPCONFIG_H
+
+#define STACK_USE_MQTT_CLIENT
+
+// room for mqttsim -w, mqttreplay builds without it
+#ifndef MQTT_CAPTURE_SIZE
+#define MQTT_CAPTURE_SIZE	(4ul*1024*1024)
+#endif
+
+#endif
@@ -0,0 +1 @@
+// Simulation build: the types come with TCPIP.h
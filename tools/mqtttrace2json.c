@@ -0,0 +1,193 @@
+/*********************************************************************
+ *
+ *                  MQTT trace dump to Chrome trace JSON
+ *
+ *********************************************************************
+ * FileName:        mqtttrace2json.c
+ * Dependencies:    none (host tool, any C89 compiler)
+ *
+ * Reads a dump from the MQTTTrace recorder, raw (MQTTTraceDump over a
+ * UART) or hex (MqttPublishTrace payloads, concatenated), and writes
+ * JSON for chrome://tracing or ui.perfetto.dev:
+ *   thread 1: MQTTTask states, thread 2: MQTTClientTask states,
+ *   socket reads/writes as counters, inbound frames as instants.
+ *
+ *   cc -o mqtttrace2json mqtttrace2json.c
+ *   mqtttrace2json dump.bin > trace.json
+ ********************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+// Keep in step with MQTTTrace.h
+#define TRACE_VERSION	2			// stack states numbered as below
+#define TRACE_HEADER	10
+#define TRACE_STATE		1
+#define TRACE_CLIENT	2
+#define TRACE_RX		3
+#define TRACE_TX		4
+#define TRACE_FRAME		5
+#define TRACE_MARK		6
+
+// Keep in step with the state enums of MQTT.c and MQTTclient.c
+static const char *StackStates[] = {
+	"HOME", "BEGIN", "NAME_RESOLVE", "OBTAIN_SOCKET", "SOCKET_OBTAINED",
+	"CONNECT", "CONNECT_ACK", "PING", "PUBLISH", "PUBLISH_STREAM",
+	"PUBLISH_ACK", "SUBSCRIBE", "SUBSCRIBE_ACK", "UNSUBSCRIBE",
+	"UNSUBSCRIBE_ACK", "DISCONNECT_INIT", "DISCONNECT",
+	"CLOSE", "QUIT", "IDLE"
+	};
+static const char *ClientStates[] = {
+	"HOME", "BEGIN", "CONNECT", "CONNECT_WAIT", "PUBLISH", "PUBLISH_WAIT",
+	"FINISHING", "DONE"
+	};
+static const char *FrameTypes[] = {
+	"?", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL",
+	"PUBCOMP", "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK",
+	"PINGREQ", "PINGRESP", "DISCONNECT", "?"
+	};
+
+typedef struct {
+	int Open;					// a state is running
+	unsigned State;
+	double Start;				// us
+	} LANE;
+
+static unsigned long TickRate;
+static unsigned long TickBase;
+static int First = 1;
+
+// Whole file into memory, hex text turned back into bytes
+static unsigned char *Load(FILE *f, long *len) {
+	unsigned char *buf = NULL, *out;
+	long n = 0, size = 0, i, o;
+	int c;
+
+	while((c = getc(f)) != EOF) {
+		if(n == size) {
+			size = size ? size*2 : 4096;
+			if(!(buf = realloc(buf, size)))
+				return NULL;
+			}
+		buf[n++] = (unsigned char)c;
+		}
+	if(n < 8 || memcmp(buf, "4D515452", 8)) {
+		*len = n;
+		return buf;
+		}
+	out = buf;
+	for(i=0, o=0; i+1 < n; ) {
+		if(!isxdigit(buf[i])) {
+			i++;
+			continue;
+			}
+		if(!isxdigit(buf[i+1]))
+			break;
+		c = (isdigit(buf[i]) ? buf[i]-'0' : toupper(buf[i])-'A'+10) << 4;
+		c |= isdigit(buf[i+1]) ? buf[i+1]-'0' : toupper(buf[i+1])-'A'+10;
+		out[o++] = (unsigned char)c;
+		i += 2;
+		}
+	*len = o;
+	return out;
+	}
+
+static unsigned long Get32(const unsigned char *p) {
+	return ((unsigned long)p[0] << 24) | ((unsigned long)p[1] << 16) |
+		((unsigned long)p[2] << 8) | p[3];
+	}
+
+static void Comma(void) {
+	printf(First ? "\n" : ",\n");
+	First = 0;
+	}
+
+static void CloseState(LANE *l, int tid, const char **names, unsigned count, double ts) {
+	if(!l->Open)
+		return;
+	Comma();
+	printf("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.1f,\"dur\":%.1f}",
+		l->State < count ? names[l->State] : "?", tid, l->Start, ts - l->Start);
+	l->Open = 0;
+	}
+
+static void OpenState(LANE *l, unsigned state, double ts) {
+	l->Open = 1;
+	l->State = state;
+	l->Start = ts;
+	}
+
+int main(int argc, char **argv) {
+	LANE stack = {0}, client = {0};
+	unsigned char *buf, *e;
+	long len, i;
+	unsigned eventSize;
+	unsigned long rx = 0, tx = 0;
+	double ts = 0;
+
+	FILE *f = argc > 1 ? fopen(argv[1], "rb") : stdin;
+	if(!f) {
+		perror(argv[1]);
+		return 1;
+		}
+	buf = Load(f, &len);
+	if(!buf || len < TRACE_HEADER || memcmp(buf, "MQTR", 4)) {
+		fprintf(stderr, "not an MQTT trace dump\n");
+		return 1;
+		}
+	eventSize = buf[5];
+	TickRate = Get32(buf+6);
+	if(buf[4] != TRACE_VERSION || eventSize < 8 || !TickRate) {
+		fprintf(stderr, "unsupported dump (version %u)\n", buf[4]);
+		return 1;
+		}
+	if(len >= TRACE_HEADER + 4)
+		TickBase = Get32(buf+TRACE_HEADER);
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	Comma();
+	printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{\"name\":\"MQTTTask\"}}");
+	Comma();
+	printf("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":2,\"args\":{\"name\":\"MQTTClientTask\"}}");
+
+	for(i = TRACE_HEADER; i + (long)eventSize <= len; i += eventSize) {
+		e = buf + i;
+		// ticks wrap, differences do not
+		ts = (double)((Get32(e) - TickBase) & 0xFFFFFFFFUL) * 1e6 / TickRate;
+		switch(e[4]) {
+			case TRACE_STATE:
+				CloseState(&stack, 1, StackStates, sizeof(StackStates)/sizeof(*StackStates), ts);
+				OpenState(&stack, e[5], ts);
+				break;
+			case TRACE_CLIENT:
+				CloseState(&client, 2, ClientStates, sizeof(ClientStates)/sizeof(*ClientStates), ts);
+				OpenState(&client, e[5], ts);
+				break;
+			case TRACE_RX:
+			case TRACE_TX:
+				if(e[4] == TRACE_RX)
+					rx += ((unsigned)e[6] << 8) | e[7];
+				else
+					tx += ((unsigned)e[6] << 8) | e[7];
+				Comma();
+				printf("{\"name\":\"socket bytes\",\"ph\":\"C\",\"pid\":1,\"ts\":%.1f,\"args\":{\"rx\":%lu,\"tx\":%lu}}",
+					ts, rx, tx);
+				break;
+			case TRACE_FRAME:
+				Comma();
+				printf("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":1,\"ts\":%.1f,\"args\":{\"header\":%u,\"length\":%u}}",
+					FrameTypes[e[5] >> 4], ts, e[5], ((unsigned)e[6] << 8) | e[7]);
+				break;
+			default:
+				Comma();
+				printf("{\"name\":\"%s %u\",\"ph\":\"i\",\"s\":\"p\",\"pid\":1,\"ts\":%.1f,\"args\":{\"b\":%u}}",
+					e[4] == TRACE_MARK ? "mark" : "event", e[5], ts, ((unsigned)e[6] << 8) | e[7]);
+				break;
+			}
+		}
+	CloseState(&stack, 1, StackStates, sizeof(StackStates)/sizeof(*StackStates), ts);
+	CloseState(&client, 2, ClientStates, sizeof(ClientStates)/sizeof(*ClientStates), ts);
+	printf("\n]}\n");
+	return 0;
+	}